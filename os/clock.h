@@ -0,0 +1,28 @@
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+// This file is shared by Kernel and User-space application.
+
+#include "types.h"
+
+// clock ids of clock_gettime()
+#define CLOCK_REALTIME  0  // wall-clock time. We have no RTC: its epoch is the boot time.
+#define CLOCK_MONOTONIC 1  // time since boot
+
+#define NSEC_PER_SEC  (1000000000ull)
+#define NSEC_PER_USEC (1000ull)
+
+// default timer slack of a process, see timer_slack()
+#define TIMER_SLACK_DEFAULT_NS (50000)
+
+struct timespec {
+    int64 tv_sec;
+    int64 tv_nsec;  // [0, NSEC_PER_SEC)
+};
+
+typedef struct {
+    uint64 sec;   // 自 Unix 纪元起的秒数
+    uint64 usec;  // 微秒数
+} TimeVal;
+
+#endif  // __CLOCK_H__
@@ -0,0 +1,181 @@
+#include "compact.h"
+
+#include "defs.h"
+#include "kthread.h"
+#include "timer.h"
+#include "trap.h"
+
+// Physical memory compaction.
+//
+// A 2MiB-aligned range of the page allocator is chosen, the one with the most free pages first.
+// Its free pages are isolated from the free list (kpage_isolate_block), and every user page
+//  mapped into it is copied to a new page, its PTE rewritten, and the old page freed into the
+//  isolated range. If nothing else lives in the range, it becomes a free block.
+//
+// There is no reverse mapping: all processes' page tables are walked to find the pages.
+// Only the current process and processes that are not RUNNING are walked, for the same TLB
+//  reason as in ksm.c. Pages of kernel objects, page tables, KSM frames and running processes
+//  are unmovable, and make the block fail.
+
+extern uint64 __kva kpage_allocator_base;
+extern uint64 __kva kpage_allocator_size;
+
+static struct compact_stat stat;
+static uint64 time_spent;  // in cycles
+
+// only accessed by the hart owning `compacting`.
+static int64 compacting = 0;
+static uint64 last_run_tick;
+
+static int migrate_page(pte_t *pte) {
+    uint64 __pa pa    = PTE2PA(*pte);
+    uint64 __pa newpa = (uint64)kallocpage();
+    if (newpa == 0) {
+        stat.migrate_failed++;
+        return -ENOMEM;
+    }
+    memmove((void *)PA_TO_KVA(newpa), (void *)PA_TO_KVA(pa), PGSIZE);
+    // the idle age of the old frame is not carried over, see wss.c
+    *pte = PA2PTE(newpa) | (PTE_FLAGS(*pte) & ~PTE_AGE_VALID);
+    kfreepage((void *)pa);
+    stat.pages_migrated++;
+    return 0;
+}
+
+// Move all pages of @mm out of [block, block + 2MiB).
+static int migrate_mm(struct mm *mm, uint64 __pa block) {
+    assert(holding(&mm->lock));
+
+    for (struct vma *vma = mm->vma; vma; vma = vma->next) {
+        for (uint64 va = vma->vm_start; va < vma->vm_end; va += PGSIZE) {
+            pte_t *pte = walk(mm, va, 0);
+            if (pte == NULL || !(*pte & PTE_V) || !(*pte & PTE_U) || (*pte & PTE_KSM))
+                continue;
+            uint64 __pa pa = PTE2PA(*pte);
+            if (pa < block || pa >= block + PGSIZE_2M)
+                continue;
+            if (migrate_page(pte) < 0)
+                return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+// Try to turn @block into a free block. Returns 1 on success.
+static int compact_block(uint64 __pa block) {
+    struct proc *curr = curr_proc();
+
+    kpage_isolate_block(block);
+
+    for (int i = 0; i < nr_procs; i++) {
+        struct proc *p = pool[i];
+        acquire(&p->lock);
+        if ((p == curr || p->state == RUNNABLE || p->state == SLEEPING) && p->mm) {
+            struct mm *mm = p->mm;
+            acquire(&mm->lock);
+            int ret = migrate_mm(mm, block);
+            release(&mm->lock);
+            if (p == curr)
+                sfence_vma();
+            if (ret < 0) {
+                release(&p->lock);
+                break;
+            }
+        }
+        release(&p->lock);
+    }
+
+    if (kpage_end_isolation()) {
+        stat.blocks_compacted++;
+        return 1;
+    }
+    stat.blocks_failed++;
+    return 0;
+}
+
+/**
+ * @brief Compact the physical memory until there are @nr_blocks free 2MiB blocks,
+ *  or every block has been tried.
+ *
+ * Must not be called with any p->lock or mm->lock held.
+ * Returns the number of free blocks, or -EBUSY if another hart is compacting.
+ */
+int compact_memory(int nr_blocks) {
+    if (__sync_lock_test_and_set(&compacting, 1) != 0)
+        return -EBUSY;
+
+    uint64 start = r_time();
+    stat.nr_runs++;
+    // cached page-table pages are unmovable.
+    mm_cache_drain();
+
+    uint64 __pa base = ROUNDUP_2N(KVA_TO_PA(kpage_allocator_base), PGSIZE_2M);
+    uint64 __pa end  = KVA_TO_PA(kpage_allocator_base + kpage_allocator_size) & ~(PGSIZE_2M - 1);
+    uint8 tried[PHYS_MEM_SIZE / PGSIZE_2M];
+    memset(tried, 0, sizeof(tried));
+
+    while (kpage_nr_blocks() < nr_blocks) {
+        // pick the untried block with the most free pages.
+        uint64 __pa best = 0;
+        int best_free    = -1;
+        for (uint64 __pa block = base; block < end; block += PGSIZE_2M) {
+            if (tried[(block - RISCV_DDR_BASE) / PGSIZE_2M])
+                continue;
+            int nr_free = kpage_nr_free_in(block);
+            if (nr_free > best_free) {
+                best      = block;
+                best_free = nr_free;
+            }
+        }
+        if (best_free < 0)
+            break;
+        tried[(best - RISCV_DDR_BASE) / PGSIZE_2M] = 1;
+        // a block without a single free page is unlikely to be movable.
+        if (best_free == 0)
+            break;
+        compact_block(best);
+    }
+
+    int ret = kpage_nr_blocks();
+    time_spent += r_time() - start;
+    __sync_lock_release(&compacting);
+    return ret;
+}
+
+int compact_scan_active() {
+    return stat.period != 0;
+}
+
+// Called by kscand. Compact one more block every `period` ticks.
+void compact_scan_tick() {
+    if (stat.period == 0 || ticks - last_run_tick < stat.period)
+        return;
+    last_run_tick = ticks;
+    compact_memory(kpage_nr_blocks() + 1);
+}
+
+int64 sys_compactctl(int cmd, uint64 arg) {
+    struct proc *p = curr_proc();
+    struct compact_stat kstat;
+    int ret;
+
+    switch (cmd) {
+        case COMPACT_CMD_GET_STAT:
+            kstat             = stat;
+            kstat.free_blocks = kpage_nr_blocks();
+            kstat.time_us     = time_spent * 1000000 / CPU_FREQ;
+            acquire(&p->mm->lock);
+            ret = copy_to_user(p->mm, arg, (char *)&kstat, sizeof(kstat));
+            release(&p->mm->lock);
+            return ret;
+        case COMPACT_CMD_RUN:
+            return compact_memory(arg);
+        case COMPACT_CMD_SET_PERIOD:
+            stat.period = arg;
+            if (stat.period)
+                kscand_wake();
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
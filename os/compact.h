@@ -0,0 +1,34 @@
+#ifndef __COMPACT_H__
+#define __COMPACT_H__
+
+// This file is shared by Kernel and User-space application.
+
+#include "types.h"
+
+// Physical memory compaction:
+//  movable user pages are migrated out of a 2MiB-aligned range, so that the range
+//  becomes a free block for kallocblock().
+
+// commands of compactctl(cmd, arg)
+#define COMPACT_CMD_GET_STAT   1  // arg: struct compact_stat __user *
+#define COMPACT_CMD_RUN        2  // arg: number of free blocks wanted, returns the number of free blocks
+#define COMPACT_CMD_SET_PERIOD 3  // arg: background compaction period in ticks, 0 disables it
+
+struct compact_stat {
+    uint64 period;            // background compaction period in ticks
+    uint64 free_blocks;       // free 2MiB blocks
+    uint64 nr_runs;           // how many times compaction has run
+    uint64 blocks_compacted;  // blocks turned into free blocks
+    uint64 blocks_failed;     // blocks with unmovable pages
+    uint64 pages_migrated;    // user pages moved
+    uint64 migrate_failed;    // pages not moved because we ran out of memory
+    uint64 time_us;           // time spent in compaction
+};
+
+// kernel interfaces, see compact.c
+int compact_memory(int nr_blocks);
+void compact_scan_tick();
+int compact_scan_active();
+int64 sys_compactctl(int cmd, uint64 arg);
+
+#endif  // __COMPACT_H__
@@ -142,10 +142,10 @@ static void consintr(int c) {
                 cons.buf[cons.e++ % INPUT_BUF_SIZE] = c;
 
                 if (c == '\n' || c == C('D') || cons.e - cons.r == INPUT_BUF_SIZE) {
-                    // wake up consoleread() if a whole line (or end-of-file)
-                    // has arrived.
+                    // wake up one consoleread() if a whole line (or end-of-file)
+                    // has arrived. It passes on what it leaves unread.
                     cons.w = cons.e;
-                    wakeup(&cons);
+                    wakeup_one(&cons);
                 }
             }
             break;
@@ -263,6 +263,9 @@ int64 user_console_read(uint64 __user buf, int64 n) {
             break;
         }
     }
+    // hand the rest of the input to the next reader.
+    if (cons.r != cons.w)
+        wakeup_one(&cons);
     release(&cons.lock);
 
     return target - n;
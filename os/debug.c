@@ -29,7 +29,7 @@ void print_ktrapframe(struct ktrapframe *tf) {
 void print_procs() {
     extern struct proc *pool[];
 
-    for (int i = 0; i < NPROC; i++) {
+    for (int i = 0; i < nr_procs; i++) {
         struct proc *p = pool[i];
         if (p->state == UNUSED)
             continue;
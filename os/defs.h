@@ -21,7 +21,7 @@
 // Kernel defines
 #define ENABLE_SMP    (1)
 #define NCPU          (4)
-#define NPROC         (512)
+#define NPROC         (32768)  // slots are created on demand, see proc.c
 #define KSTRING_MAX   (256)
 #define MAXARG        (32)
 #define PHYS_MEM_SIZE (128ull * 1024 * 1024)
@@ -29,6 +29,7 @@
 // Common macros
 #define MIN(a, b)      (a < b ? a : b)
 #define MAX(a, b)      (a > b ? a : b)
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - __builtin_offsetof(type, member)))
 #define MEMORY_FENCE() __sync_synchronize()
 #define __noreturn     __attribute__((noreturn))
 
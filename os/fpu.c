@@ -0,0 +1,126 @@
+#include "fpu.h"
+
+#include "defs.h"
+#include "trap.h"
+
+// Lazy floating-point context switching.
+//
+// The kernel never touches the FP registers, so they hold the state of the last
+//  process which used them on this hart, cpu->fpu_owner.
+//
+// sstatus.FS tells us what the user did with them:
+//  - A process returns to the user with FS=Off, unless its state is still live in
+//    the registers of this hart. Its first FP instruction then traps, and we load
+//    its state (or zeros) and return with FS=Clean, see fpu_handle_trap().
+//  - The hardware sets FS=Dirty when the user writes an FP register. When the process
+//    is switched out, the registers are saved only if FS is Dirty, see fpu_switch_out().
+// So a process which does not use FP never saves or restores anything.
+
+static inline uint64 fs_state() {
+    return r_sstatus() & SSTATUS_FS;
+}
+
+static inline void set_fs(uint64 fs) {
+    w_sstatus((r_sstatus() & ~SSTATUS_FS) | fs);
+}
+
+// FS must not be Off.
+static void fpu_save(struct fpstate *st) {
+    asm volatile(
+        "fsd f0, 0*8(%0)\n fsd f1, 1*8(%0)\n fsd f2, 2*8(%0)\n fsd f3, 3*8(%0)\n"
+        "fsd f4, 4*8(%0)\n fsd f5, 5*8(%0)\n fsd f6, 6*8(%0)\n fsd f7, 7*8(%0)\n"
+        "fsd f8, 8*8(%0)\n fsd f9, 9*8(%0)\n fsd f10, 10*8(%0)\n fsd f11, 11*8(%0)\n"
+        "fsd f12, 12*8(%0)\n fsd f13, 13*8(%0)\n fsd f14, 14*8(%0)\n fsd f15, 15*8(%0)\n"
+        "fsd f16, 16*8(%0)\n fsd f17, 17*8(%0)\n fsd f18, 18*8(%0)\n fsd f19, 19*8(%0)\n"
+        "fsd f20, 20*8(%0)\n fsd f21, 21*8(%0)\n fsd f22, 22*8(%0)\n fsd f23, 23*8(%0)\n"
+        "fsd f24, 24*8(%0)\n fsd f25, 25*8(%0)\n fsd f26, 26*8(%0)\n fsd f27, 27*8(%0)\n"
+        "fsd f28, 28*8(%0)\n fsd f29, 29*8(%0)\n fsd f30, 30*8(%0)\n fsd f31, 31*8(%0)\n"
+        ::"r"(st->f)
+        : "memory");
+    asm volatile("frcsr %0" : "=r"(st->fcsr));
+}
+
+// FS must not be Off.
+static void fpu_restore(struct fpstate *st) {
+    asm volatile(
+        "fld f0, 0*8(%0)\n fld f1, 1*8(%0)\n fld f2, 2*8(%0)\n fld f3, 3*8(%0)\n"
+        "fld f4, 4*8(%0)\n fld f5, 5*8(%0)\n fld f6, 6*8(%0)\n fld f7, 7*8(%0)\n"
+        "fld f8, 8*8(%0)\n fld f9, 9*8(%0)\n fld f10, 10*8(%0)\n fld f11, 11*8(%0)\n"
+        "fld f12, 12*8(%0)\n fld f13, 13*8(%0)\n fld f14, 14*8(%0)\n fld f15, 15*8(%0)\n"
+        "fld f16, 16*8(%0)\n fld f17, 17*8(%0)\n fld f18, 18*8(%0)\n fld f19, 19*8(%0)\n"
+        "fld f20, 20*8(%0)\n fld f21, 21*8(%0)\n fld f22, 22*8(%0)\n fld f23, 23*8(%0)\n"
+        "fld f24, 24*8(%0)\n fld f25, 25*8(%0)\n fld f26, 26*8(%0)\n fld f27, 27*8(%0)\n"
+        "fld f28, 28*8(%0)\n fld f29, 29*8(%0)\n fld f30, 30*8(%0)\n fld f31, 31*8(%0)\n"
+        ::"r"(st->f)
+        : "memory");
+    asm volatile("fscsr %0" ::"r"(st->fcsr));
+}
+
+// A new process, or one that has called exec, has no FP state.
+void fpu_init_proc(struct proc *p) {
+    p->fpu_used = 0;
+    p->fpu_cpu  = -1;
+}
+
+// Called by fork() on the parent @p, the child @np inherits its FP state.
+void fpu_fork(struct proc *p, struct proc *np) {
+    push_off();
+    if (fs_state() == SSTATUS_FS_DIRTY) {
+        fpu_save(&p->fpstate);
+        set_fs(SSTATUS_FS_CLEAN);
+    }
+    pop_off();
+    np->fpstate  = p->fpstate;
+    np->fpu_used = p->fpu_used;
+    np->fpu_cpu  = -1;
+}
+
+// Called when @p gives up this hart. Its registers stay live, we only save them if they are dirty.
+void fpu_switch_out(struct proc *p) {
+    assert(holding(&p->lock));
+
+    if (fs_state() == SSTATUS_FS_DIRTY) {
+        assert(mycpu()->fpu_owner == p);
+        fpu_save(&p->fpstate);
+        set_fs(SSTATUS_FS_CLEAN);
+    }
+}
+
+// The sstatus @p returns to the user with: FP is enabled only if its state is live on this hart.
+uint64 fpu_user_sstatus(struct proc *p, uint64 sstatus) {
+    struct cpu *c = mycpu();
+
+    if (c->fpu_owner == p && p->fpu_cpu == c->cpuid) {
+        // keep a Dirty state, it has not been saved yet.
+        if ((sstatus & SSTATUS_FS) == SSTATUS_FS_OFF)
+            sstatus |= SSTATUS_FS_CLEAN;
+        return sstatus;
+    }
+    return (sstatus & ~SSTATUS_FS) | SSTATUS_FS_OFF;
+}
+
+/**
+ * @brief Handle an IllegalInstruction trap from the user, which may be its first FP instruction.
+ *
+ * @return 1 if FP has been enabled and the instruction should be retried, 0 otherwise.
+ */
+int fpu_handle_trap(struct proc *p) {
+    if (fs_state() != SSTATUS_FS_OFF)
+        return 0;
+
+    push_off();
+    struct cpu *c = mycpu();
+    set_fs(SSTATUS_FS_CLEAN);
+    if (!p->fpu_used) {
+        memset(&p->fpstate, 0, sizeof(p->fpstate));
+        p->fpu_used = 1;
+    }
+    // never leak the registers of the previous owner.
+    fpu_restore(&p->fpstate);
+    // loading the registers has made them Dirty.
+    set_fs(SSTATUS_FS_CLEAN);
+    c->fpu_owner = p;
+    p->fpu_cpu   = c->cpuid;
+    pop_off();
+    return 1;
+}
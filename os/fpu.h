@@ -0,0 +1,19 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include "types.h"
+
+// Floating-point registers of a user process, see fpu.c
+struct fpstate {
+    uint64 f[32];
+    uint64 fcsr;
+};
+
+struct proc;
+void fpu_init_proc(struct proc *p);
+void fpu_fork(struct proc *p, struct proc *np);
+void fpu_switch_out(struct proc *p);
+uint64 fpu_user_sstatus(struct proc *p, uint64 sstatus);
+int fpu_handle_trap(struct proc *p);
+
+#endif  // FPU_H
@@ -0,0 +1,29 @@
+#ifndef __HWPROBE_H__
+#define __HWPROBE_H__
+
+// This file is shared by Kernel and User-space application.
+
+#include "types.h"
+
+// riscv_hwprobe(pairs, count): ask the kernel which ISA extensions user code may use.
+//  For each pair, the kernel fills `value` for the given `key`.
+//  An unknown key is set to -1 and its value to 0.
+// Keys and bits follow Linux's <asm/hwprobe.h>, so programs can share the probing code.
+
+struct riscv_hwprobe {
+    int64 key;
+    uint64 value;
+};
+
+#define RISCV_HWPROBE_KEY_BASE_BEHAVIOR  3
+#define RISCV_HWPROBE_BASE_BEHAVIOR_IMA  (1 << 0)  // rv64ima user ABI
+
+#define RISCV_HWPROBE_KEY_IMA_EXT_0 4
+#define RISCV_HWPROBE_IMA_FD        (1 << 0)  // F and D
+#define RISCV_HWPROBE_IMA_C         (1 << 1)  // C, never reported: we can not tell from S-mode
+#define RISCV_HWPROBE_IMA_V         (1 << 2)  // V, vector registers are saved and restored by the kernel
+
+// Not in Linux: VLEN / 8, 0 if V is not supported. Reading it does not turn V on.
+#define RISCV_HWPROBE_KEY_VLENB 0x1000
+
+#endif  // __HWPROBE_H__
@@ -0,0 +1,234 @@
+#include "ipc.h"
+
+#include "defs.h"
+#include "trap.h"
+
+// Synchronous IPC.
+//
+// A server waits for calls in ipc_reply_wait() (IPC_RECV). A client calling it copies its message
+//  registers straight into the server's trapframe, waits for the reply (IPC_REPLY), and switches
+//  directly to the server with sched_handoff(): the server runs at once on the client's cpu,
+//  without going through the run queue. The reply comes back the same way.
+//  So a round trip costs two syscalls and two context switches, and no pass through the scheduler.
+// A client calling a busy server is queued on it (IPC_SEND), and the server takes it without
+//  blocking at its next ipc_reply_wait().
+// When the handoff is not possible (this cpu has to reschedule, or the partner may not run here),
+//  the partner is woken up as usual.
+//
+// ipc_lock protects the ipc state of every process, and is taken before p->lock.
+//  Holding it, we may lock both ends of a call: other code holding two p->locks at once
+//  only tries the second one (see pick_next_direct()), so this can't deadlock.
+// A process waiting in IPC is SLEEPING on no wait queue: only its partner or kill() wakes it up.
+
+#define IPC_IDLE  0
+#define IPC_RECV  1  // waiting for a call
+#define IPC_SEND  2  // calling, queued on the partner
+#define IPC_REPLY 3  // calling, received by the partner, waiting for its reply
+#define IPC_DEAD  4  // exiting, can't be called anymore
+
+static spinlock_t ipc_lock;
+
+void ipc_init() {
+    spinlock_init(&ipc_lock, "ipc");
+}
+
+void ipc_proc_init(struct proc *p) {
+    memset(&p->ipc, 0, sizeof(p->ipc));
+    p->ipc.send_tail = &p->ipc.send_head;
+}
+
+// Message registers are a1..a4, see IPC_NR_MR.
+static inline void copy_msg(struct proc *to, struct proc *from) {
+    to->trapframe->a1 = from->trapframe->a1;
+    to->trapframe->a2 = from->trapframe->a2;
+    to->trapframe->a3 = from->trapframe->a3;
+    to->trapframe->a4 = from->trapframe->a4;
+}
+
+static inline int ipc_waiting(struct proc *p) {
+    return p->state == SLEEPING && p->sleep_chan == &p->ipc;
+}
+
+// Wake up @p, which is locked, and unlock it.
+static void ipc_wake(struct proc *p) {
+    assert(holding(&p->lock));
+    if (ipc_waiting(p)) {
+        p->state = RUNNABLE;
+        add_task(p);
+    }
+    release(&p->lock);
+}
+
+// @srv takes the call of @client: the message goes to srv's registers, and @client waits for the reply.
+static void ipc_receive(struct proc *srv, struct proc *client) {
+    assert(holding(&ipc_lock));
+
+    copy_msg(srv, client);
+    srv->ipc.state    = IPC_IDLE;
+    srv->ipc.result   = client->pid;
+    srv->ipc.nr_clients++;
+    client->ipc.state = IPC_REPLY;
+}
+
+// End the call of @client with @result.
+static void ipc_finish(struct proc *client, int64 result) {
+    assert(holding(&ipc_lock));
+
+    client->ipc.state   = IPC_IDLE;
+    client->ipc.result  = result;
+    client->ipc.partner = NULL;
+}
+
+// Give up the call or the wait of @p, which has been killed.
+static void ipc_cancel(struct proc *p) {
+    assert(holding(&ipc_lock));
+
+    struct proc *srv = p->ipc.partner;
+    if (p->ipc.state == IPC_SEND) {
+        struct proc **pp = &srv->ipc.send_head;
+        while (*pp != p) pp = &(*pp)->ipc.send_next;
+        *pp = p->ipc.send_next;
+        if (srv->ipc.send_tail == &p->ipc.send_next)
+            srv->ipc.send_tail = pp;
+    } else if (p->ipc.state == IPC_REPLY) {
+        srv->ipc.nr_clients--;
+    }
+    p->ipc.state   = IPC_IDLE;
+    p->ipc.partner = NULL;
+}
+
+/**
+ * @brief Wait until the ipc state of the current process @p is back to IPC_IDLE, or it is killed.
+ *
+ * Must hold ipc_lock and p->lock. If @next is not NULL, it is a SLEEPING process we have just
+ *  given a message to: we switch straight to it, and must hold next->lock too.
+ * All these locks are released on return.
+ *
+ * @return the result set by the partner, or -EINTR if killed.
+ */
+static int64 ipc_wait(struct proc *p, struct proc *next) {
+    for (;;) {
+        if (p->killed) {
+            if (next)
+                ipc_wake(next);
+            ipc_cancel(p);
+            release(&p->lock);
+            release(&ipc_lock);
+            return -EINTR;
+        }
+
+        p->sleep_chan = &p->ipc;
+        p->state      = SLEEPING;
+        release(&ipc_lock);
+        if (next == NULL || sched_handoff(next) < 0) {
+            if (next)
+                ipc_wake(next);
+            sched();
+        }
+        next          = NULL;
+        p->sleep_chan = NULL;
+        release(&p->lock);
+
+        acquire(&ipc_lock);
+        acquire(&p->lock);
+        if (p->ipc.state == IPC_IDLE) {
+            int64 result = p->ipc.result;
+            release(&p->lock);
+            release(&ipc_lock);
+            return result;
+        }
+    }
+}
+
+int64 sys_ipc_call(int pid) {
+    struct proc *p = curr_proc();
+
+    acquire(&ipc_lock);
+    struct proc *srv = findproc(pid);
+    if (srv == NULL || srv == p || srv->ipc.state == IPC_DEAD) {
+        int ret = (srv == NULL || srv == p) ? -EINVAL : -ENOENT;
+        if (srv)
+            release(&srv->lock);
+        release(&ipc_lock);
+        return ret;
+    }
+
+    acquire(&p->lock);
+    p->ipc.partner = srv;
+    if (srv->ipc.state == IPC_RECV) {
+        ipc_receive(srv, p);
+        if (ipc_waiting(srv))
+            return ipc_wait(p, srv);
+    } else {
+        p->ipc.state        = IPC_SEND;
+        p->ipc.send_next    = NULL;
+        *srv->ipc.send_tail = p;
+        srv->ipc.send_tail  = &p->ipc.send_next;
+    }
+    release(&srv->lock);
+    return ipc_wait(p, NULL);
+}
+
+int64 sys_ipc_reply_wait(int client) {
+    struct proc *p    = curr_proc();
+    struct proc *next = NULL;  // the client we have replied to, if it is waiting
+
+    acquire(&ipc_lock);
+    if (client != 0 && (next = findproc(client)) != NULL) {
+        int ours = next->ipc.state == IPC_REPLY && next->ipc.partner == p;
+        if (ours) {
+            copy_msg(next, p);
+            ipc_finish(next, 0);
+            p->ipc.nr_clients--;
+        }
+        if (!ours || !ipc_waiting(next)) {
+            release(&next->lock);
+            next = NULL;
+        }
+    }
+
+    acquire(&p->lock);
+    struct proc *caller = p->ipc.send_head;
+    if (caller == NULL) {
+        p->ipc.state = IPC_RECV;
+        return ipc_wait(p, next);
+    }
+
+    // a call is already queued: take it without blocking.
+    p->ipc.send_head = caller->ipc.send_next;
+    if (p->ipc.send_head == NULL)
+        p->ipc.send_tail = &p->ipc.send_head;
+    ipc_receive(p, caller);
+    int64 result = p->ipc.result;
+    if (next)
+        ipc_wake(next);
+    release(&p->lock);
+    release(&ipc_lock);
+    return result;
+}
+
+// Called by exit(): fail the calls queued on @p or waiting for its reply, and refuse new ones.
+void ipc_exit(struct proc *p) {
+    struct proc *c;
+
+    acquire(&ipc_lock);
+    p->ipc.state = IPC_DEAD;
+    while ((c = p->ipc.send_head) != NULL) {
+        p->ipc.send_head = c->ipc.send_next;
+        ipc_finish(c, -ENOENT);
+        acquire(&c->lock);
+        ipc_wake(c);
+    }
+    p->ipc.send_tail = &p->ipc.send_head;
+
+    for (int i = 0; i < nr_procs && p->ipc.nr_clients > 0; i++) {
+        c = pool[i];
+        if (c->ipc.state == IPC_REPLY && c->ipc.partner == p) {
+            p->ipc.nr_clients--;
+            ipc_finish(c, -ENOENT);
+            acquire(&c->lock);
+            ipc_wake(c);
+        }
+    }
+    release(&ipc_lock);
+}
@@ -0,0 +1,44 @@
+#ifndef __IPC_H__
+#define __IPC_H__
+
+// This file is shared by Kernel and User-space application.
+
+#include "types.h"
+
+// Synchronous IPC, in the style of L4. Processes are addressed by pid.
+//
+// ipc_call(pid, msg): send msg to the server pid, and wait for its reply, which overwrites msg.
+//  Returns 0, -EINVAL if pid is not a process or is the caller,
+//  -ENOENT if the server exits before replying, or -EINTR if the caller is killed.
+// ipc_reply_wait(client, msg): reply msg to client (0: no one), then wait for the next call,
+//  whose message overwrites msg. Returns the pid of the caller, or -EINTR if killed.
+//  A reply to a process not waiting for ours is dropped: the caller may have been killed.
+//
+// Messages are IPC_NR_MR words, passed in registers a1..a4: the kernel never copies them
+//  through user memory.
+#define IPC_NR_MR 4
+
+struct ipc_msg {
+    uint64 mr[IPC_NR_MR];  // message registers
+};
+
+// per-process state, embedded in struct proc. Protected by ipc_lock, see ipc.c.
+struct proc;
+struct ipc {
+    int state;                // IPC_IDLE, IPC_RECV, IPC_SEND, IPC_REPLY or IPC_DEAD
+    int64 result;             // of the last blocking operation, set by the partner
+    struct proc *partner;     // IPC_SEND, IPC_REPLY: the server we have called
+    struct proc *send_head;   // callers waiting for us to receive them, in order
+    struct proc **send_tail;
+    struct proc *send_next;   // in the send queue of our partner
+    int nr_clients;           // callers received and not replied to yet
+};
+
+// kernel interfaces, see ipc.c
+void ipc_init();
+void ipc_proc_init(struct proc *p);
+void ipc_exit(struct proc *p);
+int64 sys_ipc_call(int pid);
+int64 sys_ipc_reply_wait(int client);
+
+#endif  // __IPC_H__
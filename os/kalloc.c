@@ -1,24 +1,82 @@
 #include "kalloc.h"
 
+#include "compact.h"
 #include "defs.h"
+#include "workqueue.h"
 
 struct linklist {
     struct linklist *next;
 };
 
+// Free pages are kept in a doubly-linked list, so that compaction can take
+//  any of them out of the list. See compact.c.
+struct freepage {
+    struct freepage *next;
+    struct freepage *prev;
+};
+
+// state of every physical frame, protected by kpagelock.
+enum pgstate {
+    PG_ALLOCATED = 0,
+    PG_FREE,      // in kmem.freelist
+    PG_ISOLATED,  // free, held by compaction
+    PG_BLOCK,     // free, part of a 2MiB block in kmem.blocks
+};
+
 struct {
-    struct linklist *freelist;
+    struct freepage freelist;  // list head
+    struct freepage *blocks;   // free 2MiB blocks, linked by their first page
+    uint64 nr_blocks;
+    uint64 __pa isolating;     // the block being compacted, or 0
 } kmem;
 
 int kalloc_inited = 0;
 
+// Pool of zero-filled pages for kzallocpage(), refilled on the workqueue when it runs low,
+//  so that page-table pages are not cleared on the syscall path.
+// The refill never takes the last free pages, and pooled pages are reported as free, see kzpool_nrpages().
+#define ZERO_POOL_MAX     (64)
+#define ZERO_POOL_LOW     (16)
+#define ZERO_POOL_RESERVE (4 * ZERO_POOL_MAX)  // free pages left to kallocpage() by the refill
+
+static struct {
+    spinlock_t lock;
+    uint64 __pa pages[ZERO_POOL_MAX];
+    int nr;
+    int ready;  // the workqueue is up, see kzpool_init()
+} zpool;
+static struct work zpool_work;
+
 extern uint64 __kva kpage_allocator_base;
 extern uint64 __kva kpage_allocator_size;
 static spinlock_t kpagelock;
-int64 freepages_count;
+int64 freepages_count;  // includes isolated pages and pages in free blocks
+int64 allocfail_count;  // how many times kallocpage() has failed, see oom.c
+
+static uint8 pgstate[PHYS_MEM_SIZE >> PGSHIFT];
+
+static inline uint8 *page_state(uint64 __pa pa) {
+    return &pgstate[(pa - RISCV_DDR_BASE) >> PGSHIFT];
+}
+
+static inline void freelist_add(uint64 __pa pa) {
+    struct freepage *f = (struct freepage *)PA_TO_KVA(pa);
+    f->next            = kmem.freelist.next;
+    f->prev            = &kmem.freelist;
+    f->next->prev      = f;
+    kmem.freelist.next = f;
+    *page_state(pa)    = PG_FREE;
+}
+
+static inline void freelist_del(struct freepage *f) {
+    f->prev->next = f->next;
+    f->next->prev = f->prev;
+}
 
 void kpgmgrinit() {
     spinlock_init(&kpagelock, "pageallocator");
+    spinlock_init(&zpool.lock, "zpool");
+    kmem.freelist.next = kmem.freelist.prev = &kmem.freelist;
 
     uint64 kpage_allocator_end = kpage_allocator_base + kpage_allocator_size;
 
@@ -39,7 +97,6 @@ void kpgmgrinit() {
 // initializing the allocator; see kinit above.)
 void kfreepage(void *__pa pa) {
     uint64 ra = r_ra();  // who calls me?
-    struct linklist *l;
 
     uint64 __kva kvaddr = PA_TO_KVA(pa);
     if (!PGALIGNED((uint64)pa) || !(kpage_allocator_base <= kvaddr && kvaddr < kpage_allocator_base + kpage_allocator_size))
@@ -50,9 +107,14 @@ void kfreepage(void *__pa pa) {
         debugf("free: %p, called by %p", pa, ra);
 
     acquire(&kpagelock);
-    l             = (struct linklist *)kvaddr;
-    l->next       = kmem.freelist;
-    kmem.freelist = l;
+    if (*page_state((uint64)pa) != PG_ALLOCATED)
+        panic("double free %p, called by %p", pa, ra);
+    if (kmem.isolating && kmem.isolating <= (uint64)pa && (uint64)pa < kmem.isolating + PGSIZE_2M) {
+        // keep it for compaction.
+        *page_state((uint64)pa) = PG_ISOLATED;
+    } else {
+        freelist_add((uint64)pa);
+    }
     freepages_count++;
     release(&kpagelock);
 }
@@ -64,10 +126,20 @@ void *__pa kallocpage() {
     uint64 ra = r_ra();  // who calls me?
 
     acquire(&kpagelock);
-    struct linklist *l;
-    l = kmem.freelist;
+    struct freepage *l = NULL;
+    if (kmem.freelist.next != &kmem.freelist) {
+        l = kmem.freelist.next;
+        freelist_del(l);
+    } else if (kmem.blocks) {
+        // no single page left, break a free block.
+        l           = kmem.blocks;
+        kmem.blocks = l->next;
+        kmem.nr_blocks--;
+        uint64 __pa block = KVA_TO_PA((uint64)l);
+        for (uint64 pa = block + PGSIZE; pa < block + PGSIZE_2M; pa += PGSIZE) freelist_add(pa);
+    }
     if (l) {
-        kmem.freelist = l->next;
+        *page_state(KVA_TO_PA((uint64)l)) = PG_ALLOCATED;
         freepages_count--;
     }
     release(&kpagelock);
@@ -77,12 +149,184 @@ void *__pa kallocpage() {
     if (l != NULL) {
         memset((char *)l, 0xaf, PGSIZE);  // fill with junk
     } else {
+        __sync_fetch_and_add(&allocfail_count, 1);
         warnf("out of memory, called by %p", ra);
         return 0;
     }
     return (void *)KVA_TO_PA((uint64)l);
 }
 
+// Allocate a physically contiguous, 2MiB-aligned block.
+// If there is none, compact the memory and try again.
+// Must not be called with any p->lock or mm->lock held.
+// Returns 0 if the memory cannot be allocated.
+void *__pa kallocblock() {
+    uint64 ra = r_ra();  // who calls me?
+
+    for (int retry = 0; retry < 2; retry++) {
+        acquire(&kpagelock);
+        struct freepage *b = kmem.blocks;
+        if (b) {
+            kmem.blocks = b->next;
+            kmem.nr_blocks--;
+            uint64 __pa block = KVA_TO_PA((uint64)b);
+            for (uint64 pa = block; pa < block + PGSIZE_2M; pa += PGSIZE) *page_state(pa) = PG_ALLOCATED;
+            freepages_count -= PGSIZE_2M / PGSIZE;
+        }
+        release(&kpagelock);
+
+        if (b) {
+            memset((char *)b, 0xaf, PGSIZE_2M);  // fill with junk
+            return (void *)KVA_TO_PA((uint64)b);
+        }
+        if (retry == 0)
+            compact_memory(1);
+    }
+    warnf("no free 2MiB block, called by %p", ra);
+    return 0;
+}
+
+void kfreeblock(void *__pa block) {
+    uint64 __kva kvaddr = PA_TO_KVA(block);
+    if (((uint64)block & (PGSIZE_2M - 1)) || !(kpage_allocator_base <= kvaddr && kvaddr + PGSIZE_2M <= kpage_allocator_base + kpage_allocator_size))
+        panic("invalid block %p", block);
+    memset((void *)kvaddr, 0xdd, PGSIZE_2M);
+
+    acquire(&kpagelock);
+    for (uint64 pa = (uint64)block; pa < (uint64)block + PGSIZE_2M; pa += PGSIZE) {
+        assert(*page_state(pa) == PG_ALLOCATED);
+        *page_state(pa) = PG_BLOCK;
+    }
+    ((struct freepage *)kvaddr)->next = kmem.blocks;
+    kmem.blocks                       = (struct freepage *)kvaddr;
+    kmem.nr_blocks++;
+    freepages_count += PGSIZE_2M / PGSIZE;
+    release(&kpagelock);
+}
+
+
+static void zpool_refill(struct work *w) {
+    for (;;) {
+        acquire(&zpool.lock);
+        int full = zpool.nr >= ZERO_POOL_MAX;
+        release(&zpool.lock);
+        if (full || freepages_count <= ZERO_POOL_RESERVE)
+            return;
+
+        void *__pa pa = kallocpage();
+        if (pa == NULL)
+            return;
+        memset((void *)PA_TO_KVA(pa), 0, PGSIZE);
+
+        acquire(&zpool.lock);
+        if (zpool.nr < ZERO_POOL_MAX) {
+            zpool.pages[zpool.nr++] = (uint64)pa;
+            pa                      = NULL;
+        }
+        release(&zpool.lock);
+        if (pa)
+            kfreepage(pa);
+        cond_resched();
+    }
+}
+
+void kzpool_init() {
+    INIT_WORK(&zpool_work, zpool_refill);
+    acquire(&zpool.lock);
+    zpool.ready = 1;
+    release(&zpool.lock);
+    queue_work(&zpool_work);
+}
+
+// Allocate a zero-filled page. Returns 0 if the memory cannot be allocated.
+void *__pa kzallocpage() {
+    acquire(&zpool.lock);
+    uint64 __pa pa = zpool.nr ? zpool.pages[--zpool.nr] : 0;
+    int refill     = zpool.ready && zpool.nr < ZERO_POOL_LOW;
+    release(&zpool.lock);
+    if (refill)
+        queue_work(&zpool_work);
+    if (pa)
+        return (void *)pa;
+
+    void *__pa newpa = kallocpage();
+    if (newpa)
+        memset((void *)PA_TO_KVA(newpa), 0, PGSIZE);
+    return newpa;
+}
+
+// Free all the pages of the zero pool. Returns the number of pages freed.
+int kzpool_drain() {
+    int freed = 0;
+    acquire(&zpool.lock);
+    while (zpool.nr) {
+        kfreepage((void *)zpool.pages[--zpool.nr]);
+        freed++;
+    }
+    release(&zpool.lock);
+    return freed;
+}
+
+int64 kzpool_nrpages() {
+    return zpool.nr;
+}
+
+uint64 kpage_nr_blocks() {
+    return kmem.nr_blocks;
+}
+
+// Number of pages of the 2MiB block @block in the free list.
+int kpage_nr_free_in(uint64 __pa block) {
+    int nr = 0;
+    acquire(&kpagelock);
+    for (uint64 pa = block; pa < block + PGSIZE_2M; pa += PGSIZE) nr += (*page_state(pa) == PG_FREE);
+    release(&kpagelock);
+    return nr;
+}
+
+// Take all free pages of @block out of the free list,
+//  pages of @block freed later are isolated as well, until kpage_end_isolation().
+void kpage_isolate_block(uint64 __pa block) {
+    acquire(&kpagelock);
+    assert(kmem.isolating == 0);
+    kmem.isolating = block;
+    for (uint64 pa = block; pa < block + PGSIZE_2M; pa += PGSIZE) {
+        if (*page_state(pa) == PG_FREE) {
+            freelist_del((struct freepage *)PA_TO_KVA(pa));
+            *page_state(pa) = PG_ISOLATED;
+        }
+    }
+    release(&kpagelock);
+}
+
+// If every page of the isolated block is free, turn it into a free block.
+// Otherwise, give the isolated pages back to the free list.
+// Returns 1 if the block is now free.
+int kpage_end_isolation() {
+    acquire(&kpagelock);
+    uint64 __pa block = kmem.isolating;
+    int all_free      = 1;
+    for (uint64 pa = block; pa < block + PGSIZE_2M; pa += PGSIZE) all_free &= (*page_state(pa) == PG_ISOLATED);
+
+    for (uint64 pa = block; pa < block + PGSIZE_2M; pa += PGSIZE) {
+        if (*page_state(pa) != PG_ISOLATED)
+            continue;
+        if (all_free)
+            *page_state(pa) = PG_BLOCK;
+        else
+            freelist_add(pa);
+    }
+    if (all_free) {
+        struct freepage *b = (struct freepage *)PA_TO_KVA(block);
+        b->next            = kmem.blocks;
+        kmem.blocks        = b;
+        kmem.nr_blocks++;
+    }
+    kmem.isolating = 0;
+    release(&kpagelock);
+    return all_free;
+}
+
 // Object Allocator
 static uint64 allocator_mapped_va = KERNEL_ALLOCATOR_BASE;
 
@@ -6,6 +6,20 @@
 void kpgmgrinit();
 void kfreepage(void *pa);
 void *__pa kallocpage();
+void *__pa kallocblock();
+void kfreeblock(void *__pa block);
+
+// zero-filled pages, see kzallocpage()
+void kzpool_init();
+void *__pa kzallocpage();
+int kzpool_drain();
+int64 kzpool_nrpages();
+
+// used by compaction, see compact.c
+uint64 kpage_nr_blocks();
+int kpage_nr_free_in(uint64 __pa block);
+void kpage_isolate_block(uint64 __pa block);
+int kpage_end_isolation();
 
 // Object Allocator:
 
@@ -0,0 +1,322 @@
+#include "ksm.h"
+
+#include "defs.h"
+#include "kthread.h"
+#include "trap.h"
+
+// Kernel Same-page Merging.
+//
+// The scanner runs in kscand (see kthread.c), once per tick, and hashes up to `pages_to_scan`
+//  pages of writable VMAs. A page whose content is already present in the stable
+//  table is remapped read-only to that KSM frame (PTE_KSM), and its own frame is freed.
+// A page matching a recently seen candidate in the unstable table is promoted in place:
+//  its PTE becomes read-only and its frame becomes a new KSM frame that later scanned
+//  pages can merge into. Candidates are only hints, they are always verified by memcmp.
+//
+// Only processes that are not RUNNING are scanned, and p->lock is held while we touch
+//  their page table. So no hart has live TLB entries for the PTEs we rewrite:
+//  userret always flushes the TLB before returning to the user.
+//
+// Writing to a KSM page, by the user (StorePageFault) or by the kernel (copy_to_user),
+//  breaks the sharing, see ksm_unmerge().
+
+#define KSM_HASH_SIZE     (1024)
+#define KSM_UNSTABLE_SIZE (1024)
+#define KSM_MAX_NODES     (4096)
+
+struct ksm_node {
+    uint64 __pa pa;
+    uint32 hash;
+    int refcnt;                   // number of PTEs mapping this frame
+    struct ksm_node *hash_next;   // chained in stable_hash[hash]
+    struct ksm_node *pa_next;     // chained in stable_pa[pfn]
+};
+
+struct ksm_candidate {
+    uint64 __pa pa;
+    uint32 hash;
+    uint32 round;  // valid only in the same full scan round
+};
+
+static spinlock_t ksm_lock;  // protects stable tables and stats
+static allocator_t ksm_node_allocator;
+static struct ksm_node *stable_hash[KSM_HASH_SIZE];
+static struct ksm_node *stable_pa[KSM_HASH_SIZE];
+static struct ksm_candidate unstable[KSM_UNSTABLE_SIZE];
+
+static struct ksm_stat stat;
+
+// scanner state, only accessed by the hart owning `scanning`.
+static int64 scanning = 0;
+static uint64 last_scan_tick;
+static uint32 round = 1;
+static int cursor_index;
+static uint64 cursor_va;
+
+void ksm_init() {
+    spinlock_init(&ksm_lock, "ksm");
+    allocator_init(&ksm_node_allocator, "ksm_node", sizeof(struct ksm_node), KSM_MAX_NODES);
+    stat.run           = 0;
+    stat.pages_to_scan = 100;
+}
+
+static uint32 ksm_hash(void *__kva page) {
+    // FNV-1a over 64-bit words, folded into 32 bits.
+    uint64 *w = page;
+    uint64 h  = 0xcbf29ce484222325ull;
+    for (int i = 0; i < PGSIZE / sizeof(uint64); i++) {
+        h ^= w[i];
+        h *= 0x100000001b3ull;
+    }
+    return (uint32)(h ^ (h >> 32));
+}
+
+static inline int pa_slot(uint64 __pa pa) {
+    return (pa >> PGSHIFT) % KSM_HASH_SIZE;
+}
+
+static struct ksm_node *stable_lookup(uint32 hash, void *__kva page) {
+    assert(holding(&ksm_lock));
+
+    for (struct ksm_node *n = stable_hash[hash % KSM_HASH_SIZE]; n; n = n->hash_next) {
+        if (n->hash == hash && memcmp((void *)PA_TO_KVA(n->pa), page, PGSIZE) == 0)
+            return n;
+    }
+    return NULL;
+}
+
+static struct ksm_node *stable_lookup_pa(uint64 __pa pa) {
+    assert(holding(&ksm_lock));
+
+    for (struct ksm_node *n = stable_pa[pa_slot(pa)]; n; n = n->pa_next) {
+        if (n->pa == pa)
+            return n;
+    }
+    panic("ksm: no node for frame %p", pa);
+}
+
+static struct ksm_node *stable_insert(uint64 __pa pa, uint32 hash) {
+    assert(holding(&ksm_lock));
+
+    if (ksm_node_allocator.available_count == 0)
+        return NULL;
+
+    struct ksm_node *n = kalloc(&ksm_node_allocator);
+    n->pa              = pa;
+    n->hash            = hash;
+    n->refcnt          = 1;
+    n->hash_next       = stable_hash[hash % KSM_HASH_SIZE];
+    n->pa_next         = stable_pa[pa_slot(pa)];
+    stable_hash[hash % KSM_HASH_SIZE] = n;
+    stable_pa[pa_slot(pa)]            = n;
+
+    stat.pages_shared++;
+    stat.pages_sharing++;
+    return n;
+}
+
+static void stable_remove(struct ksm_node *node) {
+    assert(holding(&ksm_lock));
+
+    struct ksm_node **pn;
+    for (pn = &stable_hash[node->hash % KSM_HASH_SIZE]; *pn != node; pn = &(*pn)->hash_next)
+        ;
+    *pn = node->hash_next;
+    for (pn = &stable_pa[pa_slot(node->pa)]; *pn != node; pn = &(*pn)->pa_next)
+        ;
+    *pn = node->pa_next;
+
+    stat.pages_shared--;
+    kfree(&ksm_node_allocator, node);
+}
+
+// Drop one reference of a KSM frame, free it if it is the last one.
+// Used when a PTE with PTE_KSM is unmapped.
+void ksm_put_page(uint64 __pa pa) {
+    acquire(&ksm_lock);
+    struct ksm_node *node = stable_lookup_pa(pa);
+    stat.pages_sharing--;
+    if (--node->refcnt == 0) {
+        stable_remove(node);
+        kfreepage((void *)pa);
+    }
+    release(&ksm_lock);
+}
+
+/**
+ * @brief Break the sharing of the KSM page mapped by @pte, make it privately writable.
+ *
+ * If we are the last user of the frame, the frame is taken back without copying.
+ * mm->lock must be held.
+ *
+ * @return the physical address now mapped by @pte, or 0 if we run out of memory.
+ */
+uint64 __pa ksm_unmerge(struct mm *mm, pte_t *pte) {
+    assert(holding(&mm->lock));
+    assert(*pte & PTE_KSM);
+
+    uint64 __pa pa    = PTE2PA(*pte);
+    uint64 __pa newpa = 0;
+    uint64 flags      = (PTE_FLAGS(*pte) & ~PTE_KSM) | PTE_W | PTE_A | PTE_D;
+
+    acquire(&ksm_lock);
+    struct ksm_node *node = stable_lookup_pa(pa);
+    if (node->refcnt == 1) {
+        stable_remove(node);
+        newpa = pa;
+    } else {
+        newpa = (uint64)kallocpage();
+        if (newpa == 0) {
+            release(&ksm_lock);
+            return 0;
+        }
+        memmove((void *)PA_TO_KVA(newpa), (void *)PA_TO_KVA(pa), PGSIZE);
+        node->refcnt--;
+    }
+    stat.pages_sharing--;
+    release(&ksm_lock);
+
+    *pte = PA2PTE(newpa) | flags;
+    sfence_vma();
+    return newpa;
+}
+
+// Try to merge the page mapped by @pte.
+static void ksm_scan_page(pte_t *pte) {
+    uint64 __pa pa     = PTE2PA(*pte);
+    void *__kva page   = (void *)PA_TO_KVA(pa);
+    uint32 hash        = ksm_hash(page);
+    uint64 ro_ksm_pte  = (*pte & ~PTE_W) | PTE_KSM;
+
+    acquire(&ksm_lock);
+    stat.pages_scanned++;
+
+    struct ksm_node *node = stable_lookup(hash, page);
+    if (node) {
+        // merge into an existing KSM frame.
+        node->refcnt++;
+        stat.pages_sharing++;
+        *pte = PA2PTE(node->pa) | PTE_FLAGS(ro_ksm_pte);
+        release(&ksm_lock);
+        kfreepage((void *)pa);
+        return;
+    }
+
+    struct ksm_candidate *c = &unstable[hash % KSM_UNSTABLE_SIZE];
+    if (c->round == round && c->hash == hash && c->pa != pa && memcmp((void *)PA_TO_KVA(c->pa), page, PGSIZE) == 0) {
+        // seen an identical page in this round: promote this one to a KSM frame.
+        if (stable_insert(pa, hash))
+            *pte = ro_ksm_pte;
+        c->round = 0;
+    } else {
+        c->pa    = pa;
+        c->hash  = hash;
+        c->round = round;
+    }
+    release(&ksm_lock);
+}
+
+// Scan up to @budget pages of @mm, starting at cursor_va. Return the number of pages scanned.
+// When the whole mm has been scanned, cursor_va is set to MAXVA.
+static int ksm_scan_mm(struct mm *mm, int budget) {
+    assert(holding(&mm->lock));
+
+    int scanned = 0;
+    while (scanned < budget) {
+        // VMAs are not sorted: pick the lowest writable VMA ending after the cursor.
+        struct vma *next = NULL;
+        for (struct vma *vma = mm->vma; vma; vma = vma->next) {
+            if (!(vma->pte_flags & PTE_W) || vma->vm_end <= cursor_va)
+                continue;
+            if (next == NULL || vma->vm_start < next->vm_start)
+                next = vma;
+        }
+        if (next == NULL) {
+            cursor_va = MAXVA;
+            break;
+        }
+
+        uint64 va = MAX(cursor_va, next->vm_start);
+        for (; va < next->vm_end && scanned < budget; va += PGSIZE, scanned++) {
+            pte_t *pte = walk(mm, va, 0);
+            if (pte == NULL || !(*pte & PTE_V) || !(*pte & PTE_U) || (*pte & PTE_KSM))
+                continue;
+            ksm_scan_page(pte);
+        }
+        cursor_va = va;
+    }
+    return scanned;
+}
+
+int ksm_scan_active() {
+    return stat.run;
+}
+
+// Called by kscand. Scan at most `pages_to_scan` pages per tick.
+void ksm_scan_tick() {
+    if (!stat.run || ticks == last_scan_tick)
+        return;
+    // only one hart scans at a time.
+    if (__sync_lock_test_and_set(&scanning, 1) != 0)
+        return;
+    last_scan_tick = ticks;
+
+    int budget = stat.pages_to_scan;
+    for (int n = 0; n < nr_procs && budget > 0; n++) {
+        struct proc *p = pool[cursor_index];
+
+        acquire(&p->lock);
+        // skip running processes: they may have live TLB entries on another hart.
+        if ((p->state == RUNNABLE || p->state == SLEEPING) && p->mm) {
+            struct mm *mm = p->mm;
+            acquire(&mm->lock);
+            budget -= ksm_scan_mm(mm, budget);
+            release(&mm->lock);
+        } else {
+            cursor_va = MAXVA;
+        }
+        release(&p->lock);
+
+        if (budget > 0 || cursor_va == MAXVA) {
+            cursor_va = 0;
+            if (++cursor_index >= nr_procs) {
+                cursor_index = 0;
+                round++;
+                stat.full_scans++;
+            }
+        }
+    }
+
+    __sync_lock_release(&scanning);
+}
+
+int64 sys_ksmctl(int cmd, uint64 arg) {
+    struct proc *p = curr_proc();
+    struct ksm_stat kstat;
+    int ret = 0;
+
+    switch (cmd) {
+        case KSM_CMD_GET_STAT:
+            acquire(&ksm_lock);
+            kstat             = stat;
+            kstat.pages_saved = stat.pages_sharing - stat.pages_shared;
+            release(&ksm_lock);
+
+            acquire(&p->mm->lock);
+            ret = copy_to_user(p->mm, arg, (char *)&kstat, sizeof(kstat));
+            release(&p->mm->lock);
+            return ret;
+        case KSM_CMD_SET_RUN:
+            stat.run = (arg != 0);
+            if (stat.run)
+                kscand_wake();
+            return 0;
+        case KSM_CMD_SET_PAGES_TO_SCAN:
+            if (arg == 0 || arg > 4096)
+                return -EINVAL;
+            stat.pages_to_scan = arg;
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef __KSM_H__
+#define __KSM_H__
+
+// This file is shared by Kernel and User-space application.
+
+#include "types.h"
+
+// Kernel Same-page Merging (KSM):
+//  A background scanner hashes writable user pages. Pages with identical contents
+//  are merged into one read-only frame, which is un-merged again on write.
+
+// commands of ksmctl(cmd, arg)
+#define KSM_CMD_GET_STAT          1  // arg: struct ksm_stat __user *
+#define KSM_CMD_SET_RUN           2  // arg: 0 stop, 1 run
+#define KSM_CMD_SET_PAGES_TO_SCAN 3  // arg: pages scanned per tick
+
+struct ksm_stat {
+    uint64 run;            // is the scanner running?
+    uint64 pages_to_scan;  // pages scanned per tick
+    uint64 pages_shared;   // number of KSM frames in use
+    uint64 pages_sharing;  // number of user PTEs mapping a KSM frame
+    uint64 pages_saved;    // pages_sharing - pages_shared
+    uint64 pages_scanned;  // total pages hashed by the scanner
+    uint64 full_scans;     // how many times all processes have been scanned
+};
+
+// kernel interfaces, see ksm.c
+struct mm;
+void ksm_init();
+void ksm_scan_tick();
+int ksm_scan_active();
+uint64 ksm_unmerge(struct mm *mm, uint64 *pte);
+void ksm_put_page(uint64 pa);
+int64 sys_ksmctl(int cmd, uint64 arg);
+
+#endif  // __KSM_H__
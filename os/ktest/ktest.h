@@ -6,7 +6,8 @@ uint64 ktest_syscall(uint64 args[6]);
 
 #define KTEST_PRINT_USERPGT 1
 #define KTEST_PRINT_KERNPGT 2
-#define KTEST_GET_NRFREEPGS 3
+#define KTEST_GET_NRFREEPGS 3  // waits for the workqueues first, so that reaped mms are counted: it sleeps
 #define KTEST_GET_NRSTRBUF  4
+#define KTEST_ALLOC_BLOCKS  5
 
 #endif  // __KTEST_H__
\ No newline at end of file
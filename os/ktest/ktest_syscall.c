@@ -1,9 +1,26 @@
 #include "defs.h"
 #include "ktest.h"
+#include "workqueue.h"
 
 extern int64 freepages_count;
 extern allocator_t kstrbuf;
 
+// Allocate @n 2MiB blocks at most with kallocblock(), which compacts memory if needed, and free them.
+// Returns the number of blocks allocated.
+static uint64 ktest_alloc_blocks(uint64 n) {
+    void *__pa blocks[8];
+    uint64 nr = 0;
+
+    if (n > sizeof(blocks) / sizeof(blocks[0]))
+        n = sizeof(blocks) / sizeof(blocks[0]);
+    while (nr < n && (blocks[nr] = kallocblock()) != NULL) {
+        assert(((uint64)blocks[nr] & (PGSIZE_2M - 1)) == 0);
+        nr++;
+    }
+    for (uint64 i = 0; i < nr; i++) kfreeblock(blocks[i]);
+    return nr;
+}
+
 uint64 ktest_syscall(uint64 args[6]) {
     uint64 which = args[0];
     switch (which) {
@@ -14,9 +31,15 @@ uint64 ktest_syscall(uint64 args[6]) {
             vm_print(kernel_pagetable);
             break;
         case KTEST_GET_NRFREEPGS:
-            return freepages_count;
+            // wait for exited processes to tear down their mm, see mm_reap(): this sleeps,
+            //  never call it with a lock held.
+            // page-table pages cached by vm.c and pre-zeroed pages are free as well.
+            flush_workqueues();
+            return freepages_count + mm_cache_nrpages() + kzpool_nrpages();
         case KTEST_GET_NRSTRBUF:
             return kstrbuf.available_count;
+        case KTEST_ALLOC_BLOCKS:
+            return ktest_alloc_blocks(args[1]);
     }
     return 0;
 }
\ No newline at end of file
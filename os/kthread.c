@@ -0,0 +1,88 @@
+#include "kthread.h"
+
+#include "compact.h"
+#include "defs.h"
+#include "ksm.h"
+#include "timer.h"
+#include "trap.h"
+#include "wss.h"
+
+// Kernel threads are processes without mm, which never return to the user.
+// They are scheduled through the run queues like everyone else, and can sleep and
+//  be preempted. They have no parent and never exit; kill() and sigkill() refuse them.
+
+static void kthread_entry() {
+    struct proc *p = curr_proc();
+    // we may have been switched to directly, see sched().
+    finish_switch();
+    release(&p->lock);
+    intr_on();
+
+    p->kthread_fn(p->kthread_arg);
+    panic("kthread %d returned", p->pid);
+}
+
+// Create a kernel thread running @fn(@arg) at @nice, and queue it on this cpu.
+struct proc *kthread_create(void (*fn)(void *), void *arg, int nice) {
+    return kthread_create_on(fn, arg, nice, -1);
+}
+
+// Create a kernel thread bound to @cpu, or running on the housekeeping cpus if @cpu is -1.
+struct proc *kthread_create_on(void (*fn)(void *), void *arg, int nice, int cpu) {
+    struct proc *p = allocproc();
+    if (p == NULL)
+        return NULL;
+
+    p->kthread     = 1;
+    p->kthread_fn  = fn;
+    p->kthread_arg = arg;
+    p->context.ra  = (uint64)kthread_entry;
+    p->nice        = nice;  // the weight follows when it is first switched to, see set_next_task()
+    if (cpu >= 0)
+        p->cpus_allowed = 1ull << cpu;
+    p->state       = RUNNABLE;
+    add_task(p);
+    release(&p->lock);
+    return p;
+}
+
+// kscand: background scanning of KSM, WSS and compaction, at the lowest priority.
+// It polls once per tick while a scanner is enabled, and sleeps until kscand_wake() otherwise.
+
+static spinlock_t kscand_lock;
+static int kscand_kicked;
+
+static int kscand_active() {
+    return ksm_scan_active() || wss_scan_active() || compact_scan_active();
+}
+
+static void kscand(void *arg) {
+    for (;;) {
+        ksm_scan_tick();
+        wss_scan_tick();
+        compact_scan_tick();
+
+        if (kscand_active()) {
+            tick_sleep(ticks + 1);
+            continue;
+        }
+        acquire(&kscand_lock);
+        while (!kscand_kicked) sleep(&kscand_kicked, &kscand_lock);
+        kscand_kicked = 0;
+        release(&kscand_lock);
+    }
+}
+
+// A scanner has been enabled. Must be called without any p->lock.
+void kscand_wake() {
+    acquire(&kscand_lock);
+    kscand_kicked = 1;
+    release(&kscand_lock);
+    wakeup(&kscand_kicked);
+}
+
+void kscand_init() {
+    spinlock_init(&kscand_lock, "kscand");
+    if (kthread_create(kscand, NULL, NICE_MAX) == NULL)
+        panic("kscand_init");
+}
@@ -0,0 +1,13 @@
+#ifndef KTHREAD_H
+#define KTHREAD_H
+
+#include "types.h"
+
+// Kernel threads, see kthread.c
+struct proc;
+struct proc *kthread_create(void (*fn)(void *), void *arg, int nice);
+struct proc *kthread_create_on(void (*fn)(void *), void *arg, int nice, int cpu);
+void kscand_init();
+void kscand_wake();
+
+#endif  // KTHREAD_H
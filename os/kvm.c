@@ -2,6 +2,7 @@
 #include "vm.h"
 
 pagetable_t kernel_pagetable;
+static spinlock_t kvm_lock;  // protects runtime changes to kernel_pagetable, see kvm_map_page()
 static uint64 __kva init_page_allocator;
 static uint64 __kva init_page_allocator_base;
 
@@ -43,6 +44,7 @@ static uint64 __kva allockernelpage() {
 void kvm_init() {
     init_page_allocator      = KERNEL_DIRECT_MAPPING_BASE + kernel_image_end_2M;
     init_page_allocator_base = init_page_allocator;
+    spinlock_init(&kvm_lock, "kvm");
     infof("boot-stage page allocator: base %p, end %p", init_page_allocator, init_page_allocator + PGSIZE_2M);
 
     kernel_pagetable = kvmmake();
@@ -208,4 +210,59 @@ void kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm) {
     }
     assert(vaddr == vaddr_end);
     assert(sz == 0);
-}
\ No newline at end of file
+}
+
+// Walk the kernel page table to the level-0 PTE of @va, allocating page tables if @alloc.
+// Huge pages are not expected here.
+static pte_t *kvm_walk(uint64 va, int alloc) {
+    assert(holding(&kvm_lock));
+
+    pagetable_t pgt = kernel_pagetable;
+    for (int level = 2; level > 0; level--) {
+        pte_t *pte = &pgt[PX(level, va)];
+        if (*pte & PTE_V) {
+            assert(!(*pte & (PTE_R | PTE_W | PTE_X)));
+            pgt = (pagetable_t)PA_TO_KVA(PTE2PA(*pte));
+        } else {
+            void *__pa pa;
+            if (!alloc || (pa = kallocpage()) == NULL)
+                return NULL;
+            pgt = (pagetable_t)PA_TO_KVA(pa);
+            memset(pgt, 0, PGSIZE);
+            *pte = MAKE_PTE((uint64)pa, 0);
+        }
+    }
+    return &pgt[PX(0, va)];
+}
+
+/**
+ * @brief Map one page into the kernel page table after boot, used for kernel stacks.
+ *
+ * Page tables are never freed once allocated.
+ * The caller must make the mapping visible to other harts before they use it.
+ * @return 0, or -ENOMEM if a page table can't be allocated.
+ */
+int kvm_map_page(uint64 va, uint64 __pa pa, int perm) {
+    acquire(&kvm_lock);
+    pte_t *pte = kvm_walk(va, 1);
+    if (pte == NULL) {
+        release(&kvm_lock);
+        return -ENOMEM;
+    }
+    assert_str(!(*pte & PTE_V), "kvm_map_page: %p already mapped", va);
+    *pte = MAKE_PTE(pa, perm);
+    release(&kvm_lock);
+    return 0;
+}
+
+// Unmap one page mapped by kvm_map_page(), return its physical address.
+// The caller must flush the TLB of all harts before reusing the page.
+uint64 __pa kvm_unmap_page(uint64 va) {
+    acquire(&kvm_lock);
+    pte_t *pte = kvm_walk(va, 0);
+    assert_str(pte && (*pte & PTE_V), "kvm_unmap_page: %p not mapped", va);
+    uint64 __pa pa = PTE2PA(*pte);
+    *pte           = 0;
+    release(&kvm_lock);
+    return pa;
+}
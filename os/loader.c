@@ -173,10 +173,8 @@ int load_user_elf(struct user_app *app, struct proc *p, char *args[]) {
     release(&new_mm->lock);
 
     // free the old mm. for the first process, p->mm = NULL.
-    if (p->mm) {
-        acquire(&p->mm->lock);
-        mm_free(p->mm);    
-    }
+    if (p->mm)
+        mm_free_async(p->mm);
     
     // we can modify p's fields because we will return to the new exec-ed process.
     p->mm      = new_mm;
@@ -37,6 +37,26 @@ void acquire(spinlock_t *lk)
 	lk->where = (void *)ra;
 }
 
+// Acquire the lock only if it is free, never spins.
+// Return 1 if the lock has been acquired.
+int try_acquire(spinlock_t *lk)
+{
+	uint64 ra = r_ra();
+	push_off();
+	if (holding(lk))
+		panic("already acquired by %p, now %p", lk->where, ra);
+
+	if (__sync_lock_test_and_set(&lk->locked, 1) != 0) {
+		pop_off();
+		return 0;
+	}
+	__sync_synchronize();
+
+	lk->cpu = mycpu();
+	lk->where = (void *)ra;
+	return 1;
+}
+
 // Release the lock.
 void release(spinlock_t *lk)
 {
@@ -106,6 +126,9 @@ void pop_off(void)
 	if (c->noff == 0 && c->interrupt_on) {
 		if (c->inkernel_trap)
 			panic("pop_off->intr_on happens in kernel trap");
+		// the last lock is released: a preemption point, see sched.c
+		if (c->need_resched)
+			preempt_schedule();
 		intr_on();
 	}
 }
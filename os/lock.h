@@ -28,6 +28,7 @@ typedef struct sleeplock sleeplock_t;
 
 void spinlock_init(struct spinlock *lk, char *name);
 void acquire(struct spinlock *lk);
+int try_acquire(struct spinlock *lk);
 void release(struct spinlock *lk);
 int holding(struct spinlock *lk);
 void push_off(void);
@@ -2,11 +2,14 @@
 #include "debug.h"
 #include "defs.h"
 #include "kalloc.h"
+#include "ksm.h"
+#include "kthread.h"
 #include "loader.h"
 #include "plic.h"
 #include "proc.h"
 #include "sbi.h"
 #include "timer.h"
+#include "workqueue.h"
 
 uint64 __pa kernel_image_end_4k;
 uint64 __pa kernel_image_end_2M;
@@ -209,13 +212,19 @@ static void bootcpu_init() {
     trap_init();
     console_init();
     printf("UART inited.\n");
+    vec_init();
     plicinit();
     kpgmgrinit();
     uvm_init();
+    ksm_init();
     proc_init();
+    ipc_init();
     allocator_init(&kstrbuf, "kstrbuf", KSTRING_MAX, 4096);
     loader_init();
     load_init_app();
+    workqueue_init();
+    kzpool_init();
+    kscand_init();
 
     timer_init();
     plicinithart();
@@ -0,0 +1,164 @@
+#include "oom.h"
+
+#include "defs.h"
+#include "timer.h"
+#include "trap.h"
+#include "workqueue.h"
+
+// Out-Of-Memory killer.
+//
+// When kallocpage() fails in a syscall triggered by the user (fork, exec, sbrk),
+//  the syscall is retried after some memory is given back:
+//  first the page-table caches are drained and the mms of exited processes are reaped, then the process with the highest badness,
+//  which is its RSS adjusted by oom_score_adj, is killed with SIGKILL.
+//  Processes running on another cpu are not candidates, see scorable().
+// init_proc and processes with OOM_SCORE_ADJ_MIN are never chosen.
+
+#define OOM_TOTAL_PAGES (PHYS_MEM_SIZE / PGSIZE)
+#define OOM_WAIT_TICKS  (20)  // how long to wait for a victim to exit
+
+extern struct proc *init_proc;
+extern int64 allocfail_count;
+extern int64 freepages_count;
+
+static int eligible(struct proc *p) {
+    assert(holding(&p->lock));
+    return p != init_proc && p->mm != NULL && p->oom_score_adj != OOM_SCORE_ADJ_MIN;
+}
+
+// Only the current process and processes that are not RUNNING are scored: a running process
+//  may hold its mm->lock and wait for its p->lock, see do_signal().
+static int scorable(struct proc *p) {
+    return p == curr_proc() || p->state != RUNNING;
+}
+
+static int64 badness(struct proc *p) {
+    assert(holding(&p->lock) && scorable(p));
+
+    acquire(&p->mm->lock);
+    int64 points = mm_rss(p->mm);
+    release(&p->mm->lock);
+
+    points += (int64)p->oom_score_adj * OOM_TOTAL_PAGES / 1000;
+    return MAX(points, 1);
+}
+
+// Wait until the victim at @slot with @pid has exited, and its mm has been reaped.
+static void oom_wait(struct proc *curr, int slot, int pid) {
+    struct proc *p = pool[slot];
+
+    for (int t = 0; t < OOM_WAIT_TICKS && !iskilled(curr); t++) {
+        acquire(&p->lock);
+        if (p->pid != pid || p->state == UNUSED) {
+            release(&p->lock);
+            return;
+        }
+        if (p->state == ZOMBIE) {
+            release(&p->lock);
+            flush_workqueues();
+            return;
+        }
+        release(&p->lock);
+
+        tick_sleep(ticks + 1);
+    }
+}
+
+/**
+ * @brief Give back some memory by reaping zombies or killing a process.
+ *
+ * Must be called without any lock held.
+ * Returns 0 if the caller should retry its allocation, -ENOMEM otherwise.
+ */
+static int oom_kill() {
+    struct proc *curr = curr_proc();
+
+    // exited processes detach their mm, which may still be queued for the reaper.
+    int64 before = freepages_count;
+    flush_workqueues();
+    uint64 freed = MAX(freepages_count - before, 0);
+
+    freed += mm_cache_drain() + kzpool_drain() + proc_cache_drain();
+    if (freed > 0) {
+        infof("oom: reaped %d pages of caches and exited processes", freed);
+        return 0;
+    }
+
+    // pick the victim. If a previous victim is still exiting, wait for it instead.
+    int victim = -1, victim_pid = -1, dying = 0;
+    int64 best = 0;
+    for (int i = 0; i < nr_procs && !dying; i++) {
+        struct proc *p = pool[i];
+        acquire(&p->lock);
+        if ((p->state == RUNNABLE || p->state == SLEEPING || p->state == RUNNING) && eligible(p)) {
+            int64 points = (p->killed || !scorable(p)) ? 0 : badness(p);
+            if (p->killed && p != curr) {
+                dying  = 1;
+                victim = i;
+                victim_pid = p->pid;
+            } else if (points > best) {
+                best       = points;
+                victim     = i;
+                victim_pid = p->pid;
+            }
+        }
+        release(&p->lock);
+    }
+    if (victim < 0) {
+        warnf("oom: no process to kill");
+        return -ENOMEM;
+    }
+
+    if (!dying) {
+        struct proc *p = pool[victim];
+        acquire(&p->lock);
+        if (p->pid == victim_pid && p->state != ZOMBIE && p->state != UNUSED) {
+            warnf("oom: kill pid %d, badness %d, score_adj %d", p->pid, best, p->oom_score_adj);
+            p->killed = -10 - SIGKILL;
+            if (p->state == SLEEPING) {
+                p->state = RUNNABLE;
+                add_task(p);
+            }
+        }
+        release(&p->lock);
+
+        // we are the victim: fail the syscall, and exit on the way to the user.
+        if (p == curr)
+            return -ENOMEM;
+    }
+
+    oom_wait(curr, victim, victim_pid);
+    return iskilled(curr) ? -ENOMEM : 0;
+}
+
+// Take a snapshot before an allocating syscall, see oom_retry().
+uint64 oom_begin() {
+    return allocfail_count;
+}
+
+/**
+ * @brief Decide whether a syscall returning @ret should be retried.
+ *
+ * If it failed with -ENOMEM because kallocpage() ran out of memory since @snapshot,
+ *  run the OOM killer and return 1 if some memory has been given back.
+ */
+int oom_retry(int64 ret, uint64 *snapshot) {
+    if (ret != -ENOMEM || allocfail_count == *snapshot)
+        return 0;
+    *snapshot = allocfail_count;
+    return oom_kill() == 0;
+}
+
+int64 sys_oom_score_adj(int pid, int adj) {
+    if (adj < OOM_SCORE_ADJ_MIN || adj > OOM_SCORE_ADJ_MAX)
+        return -EINVAL;
+    if (pid == 0)
+        pid = curr_proc()->pid;
+
+    struct proc *p = findproc(pid);
+    if (p == NULL)
+        return -EINVAL;
+    p->oom_score_adj = adj;
+    release(&p->lock);
+    return 0;
+}
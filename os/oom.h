@@ -0,0 +1,18 @@
+#ifndef __OOM_H__
+#define __OOM_H__
+
+// This file is shared by Kernel and User-space application.
+
+#include "types.h"
+
+// oom_score_adj(pid, adj): adjust how likely a process is chosen by the OOM killer.
+//  pid 0 means the calling process. The value is inherited by forked children.
+#define OOM_SCORE_ADJ_MIN (-1000)  // never killed
+#define OOM_SCORE_ADJ_MAX (1000)
+
+// kernel interfaces, see oom.c
+uint64 oom_begin();
+int oom_retry(int64 ret, uint64 *snapshot);
+int64 sys_oom_score_adj(int pid, int adj);
+
+#endif  // __OOM_H__
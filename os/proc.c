@@ -4,17 +4,150 @@
 #include "kalloc.h"
 #include "loader.h"
 #include "queue.h"
+#include "timer.h"
 #include "trap.h"
 
+// Process slots are created on demand, up to NPROC, and are never freed:
+//  an unused slot waits on the free slot list, keeping its kernel stack and trapframe
+//  for the next process. proc_cache_drain() gives them back under memory pressure,
+//  except for the NPROC_RESERVED slots created at boot.
 struct proc *pool[NPROC];
+int nr_procs;       // pool[0, nr_procs) are valid
+uint64 kstack_gen;  // bumped when a kernel stack is mapped, see scheduler()
 struct proc *init_proc = NULL;
-static allocator_t proc_allocator;
+
+#define NPROC_RESERVED (64)
+
+// pid_lock protects the free slot list, and the creation of slots.
+// A pid encodes its slot: pid = generation * NPROC + index + 1, so findproc() needs no table,
+//  and pids are recycled below PID_MAX instead of growing forever.
+#define PID_MAX         (1 << 22)
+#define PID_GENERATIONS (PID_MAX / NPROC)
 
 static spinlock_t pid_lock;
-static spinlock_t wait_lock;
+static struct proc *free_head, *free_tail;
+static uint64 __kva slot_page, slot_page_end;  // the page new slots are carved from
+
+// Wait queues: sleeping processes are hashed by their sleep channel,
+//  so wakeup() only visits processes sleeping on a channel in the same bucket.
+// Lock order: bucket->lock, then p->lock.
+#define WAITQ_HASH_SIZE (64)
+
+static struct waitq_bucket {
+    spinlock_t lock;
+    struct proc *head;
+} waitq[WAITQ_HASH_SIZE];
 
 extern void sched_init();
 
+// Create a new UNUSED slot, without kernel stack and trapframe. pid_lock must be held.
+static struct proc *new_slot() {
+    assert(holding(&pid_lock));
+
+    const uint64 size = ROUNDUP_2N(sizeof(struct proc), 16);
+    if (nr_procs == NPROC || sched_grow(nr_procs + 1) < 0)
+        return NULL;
+    if (slot_page + size > slot_page_end) {
+        void *__pa pa = kallocpage();
+        if (pa == NULL)
+            return NULL;
+        slot_page     = PA_TO_KVA(pa);
+        slot_page_end = slot_page + PGSIZE;
+    }
+    struct proc *p = (struct proc *)slot_page;
+    slot_page += size;
+
+    memset(p, 0, sizeof(*p));
+    spinlock_init(&p->lock, "proc");
+    spinlock_init(&p->child_lock, "child");
+    p->index  = nr_procs;
+    p->state  = UNUSED;
+    p->kstack = KERNEL_STACK_PROCS + p->index * 2 * KERNEL_STACK_SIZE;
+
+    pool[nr_procs] = p;
+    // those who scan pool[0, nr_procs) without pid_lock must see the slot first.
+    __sync_synchronize();
+    nr_procs++;
+    return p;
+}
+
+// Give @p its trapframe and kernel stack if it has not got them yet.
+static int alloc_kstack(struct proc *p) {
+    if (p->trapframe == NULL) {
+        void *__pa pa = kallocpage();
+        if (pa == NULL)
+            return -ENOMEM;
+        p->trapframe = (struct trapframe *)PA_TO_KVA(pa);
+    }
+    while (p->kstack_pages < KERNEL_STACK_SIZE / PGSIZE) {
+        void *__pa pa = kallocpage();
+        if (pa == NULL)
+            return -ENOMEM;
+        if (kvm_map_page(p->kstack + p->kstack_pages * PGSIZE, (uint64)pa, PTE_A | PTE_D | PTE_R | PTE_W) < 0) {
+            kfreepage(pa);
+            return -ENOMEM;
+        }
+        p->kstack_pages++;
+        // other harts may have cached the invalid PTE: they flush before switching to a new stack.
+        __sync_fetch_and_add(&kstack_gen, 1);
+    }
+    sfence_vma();
+    return 0;
+}
+
+// Put a freed slot at the tail, so that a pid is not reused soon.
+static void free_slot(struct proc *p) {
+    acquire(&pid_lock);
+    p->free_next = NULL;
+    if (free_tail)
+        free_tail->free_next = p;
+    else
+        free_head = p;
+    free_tail = p;
+    release(&pid_lock);
+}
+
+/**
+ * @brief Free the kernel stacks and trapframes cached by unused slots.
+ *
+ * Must be called without any lock held, other harts are asked to flush their TLB.
+ * @return the number of pages freed.
+ */
+int proc_cache_drain() {
+    uint64 __kva pages = 0;  // freed pages, linked through their first word
+    int nr             = 0;
+
+    acquire(&pid_lock);
+    for (struct proc *p = free_head; p; p = p->free_next) {
+        if (p->index < NPROC_RESERVED)
+            continue;
+        if (p->trapframe) {
+            *(uint64 *)p->trapframe = pages;
+            pages                   = (uint64)p->trapframe;
+            p->trapframe            = NULL;
+            nr++;
+        }
+        while (p->kstack_pages > 0) {
+            p->kstack_pages--;
+            uint64 __kva pg = PA_TO_KVA(kvm_unmap_page(p->kstack + p->kstack_pages * PGSIZE));
+            *(uint64 *)pg   = pages;
+            pages           = pg;
+            nr++;
+        }
+    }
+    release(&pid_lock);
+
+    if (nr == 0)
+        return 0;
+    flush_tlb_remote();
+    while (pages) {
+        uint64 __kva next = *(uint64 *)pages;
+        kfreepage((void *)KVA_TO_PA(pages));
+        pages = next;
+    }
+    return nr;
+}
+
 // initialize the proc table at boot time.
 void proc_init() {
     // we only init once.
@@ -23,51 +156,44 @@ void proc_init() {
     proc_inited = 1;
 
     spinlock_init(&pid_lock, "pid");
-    spinlock_init(&wait_lock, "wait");
-
-    allocator_init(&proc_allocator, "proc", sizeof(struct proc), NPROC);
-    struct proc *p;
-
-    uint64 proc_kstack = KERNEL_STACK_PROCS;
-
-    for (int i = 0; i < NPROC; i++) {
-        p = kalloc(&proc_allocator);
-        memset(p, 0, sizeof(*p));
-        spinlock_init(&p->lock, "proc");
-        p->index = i;
-        p->state = UNUSED;
-
-        // allocate the Trapframe.
-        uint64 __pa tf = (uint64)kallocpage();
-        // during system boots, we should always have enough memory.
-        assert(tf);
-        p->trapframe = (struct trapframe *)PA_TO_KVA(tf);
-
-        p->kstack = proc_kstack;
-        for (uint64 va = proc_kstack; va < proc_kstack + KERNEL_STACK_SIZE; va += PGSIZE) {
-            uint64 __pa newpg = (uint64)kallocpage();
-            assert(newpg);
-            kvmmap(kernel_pagetable, va, newpg, PGSIZE, PTE_A | PTE_D | PTE_R | PTE_W);
-        }
-        sfence_vma();
-        proc_kstack += 2 * KERNEL_STACK_SIZE;
-
-        pool[i] = p;
-    }
+    for (int i = 0; i < WAITQ_HASH_SIZE; i++) spinlock_init(&waitq[i].lock, "waitq");
     sched_init();
-}
-
-static int allocpid() {
-    static int PID = 1;
-    int retpid     = -1;
 
+    // during system boots, we should always have enough memory.
     acquire(&pid_lock);
-    retpid = PID++;
+    for (int i = 0; i < NPROC_RESERVED; i++) {
+        struct proc *p = new_slot();
+        assert(p);
+        assert(alloc_kstack(p) == 0);
+        p->free_next = NULL;
+        if (free_tail)
+            free_tail->free_next = p;
+        else
+            free_head = p;
+        free_tail = p;
+    }
     release(&pid_lock);
+}
 
-    return retpid;
+// Find the live process with @pid, return it with p->lock held, or NULL.
+// Kernel threads are not visible to the user, and are never found.
+struct proc *findproc(int pid) {
+    if (pid <= 0 || pid > PID_MAX)
+        return NULL;
+
+    int index = (pid - 1) % NPROC;
+    if (index >= nr_procs)
+        return NULL;
+    struct proc *p = pool[index];
+    acquire(&p->lock);
+    if (p->state != UNUSED && p->pid == pid && !p->kthread)
+        return p;
+    release(&p->lock);
+    return NULL;
 }
+
 static void first_sched_ret(void) {
+    finish_switch();
     release(&curr_proc()->lock);
     assert(curr_proc()->state == RUNNING);
     intr_off();
@@ -79,24 +205,37 @@ static void first_sched_ret(void) {
 // If there are no free procs, or a memory allocation fails, return 0.
 struct proc *allocproc() {
     struct proc *p;
-    for (int i = 0; i < NPROC; i++) {
-        p = pool[i];
-        acquire(&p->lock);
-        if (p->state == UNUSED) {
-            goto found;
-        }
+
+    acquire(&pid_lock);
+    p = free_head;
+    if (p) {
+        free_head = p->free_next;
+        if (free_head == NULL)
+            free_tail = NULL;
+    } else {
+        p = new_slot();
+    }
+    release(&pid_lock);
+    if (p == NULL)
+        return 0;
+
+    acquire(&p->lock);
+    assert(p->state == UNUSED);
+    if (alloc_kstack(p) < 0) {
         release(&p->lock);
+        free_slot(p);
+        return 0;
     }
-    return 0;
 
-found:
     // initialize a proc
     tracef("init proc %p", p);
     p->parent     = NULL;
     p->exit_code  = 0;
     p->sleep_chan = NULL;
-    p->pid        = allocpid();
+    p->pid        = p->generation * NPROC + p->index + 1;
+    p->generation = (p->generation + 1) % PID_GENERATIONS;
     p->state      = USED;
+    p->kthread    = 0;
 
     // fork or exec(load_user_elf) will initialize these:
     p->mm      = NULL;
@@ -104,10 +243,18 @@ found:
 
     // prepare trapframe and the first return context.
     memset(&p->context, 0, sizeof(p->context));
-    memset((void *)p->kstack, 0, KERNEL_STACK_SIZE);
-    memset((void *)p->trapframe, 0, PGSIZE);
+    memset((void *)p->trapframe, 0, sizeof(struct trapframe));
     p->context.ra = (uint64)first_sched_ret;
     p->context.sp = p->kstack + KERNEL_STACK_SIZE;
+    wss_init(p);
+    ipc_proc_init(p);
+    fpu_init_proc(p);
+    vec_init_proc(p);
+    rseq_init_proc(p);
+    p->oom_score_adj  = 0;
+    p->timer_slack_ns = TIMER_SLACK_DEFAULT_NS;
+    p->last_cpu      = -1;
+    sched_proc_init(p, NULL);
 
     // Project signal: signal_init
     siginit(p);
@@ -119,6 +266,7 @@ found:
 
 static void freeproc(struct proc *p) {
     assert(holding(&p->lock));
+    assert(p->children == NULL);
 
     p->state      = UNUSED;
     p->pid        = -1;
@@ -127,27 +275,42 @@ static void freeproc(struct proc *p) {
     p->killed     = 0;
     p->parent     = NULL;
 
+    // exit() has already detached the mm, only a failed fork() still has one.
     if (p->mm) {
         assert(!holding(&p->mm->lock));
-        acquire(&p->mm->lock);
-        mm_free(p->mm);
+        mm_free_async(p->mm);
     }
 
     p->mm      = NULL;
     p->vma_brk = NULL;
+    vec_free(p);
+    free_slot(p);
+}
+
+static struct waitq_bucket *waitq_bucket(void *chan) {
+    uint64 h = (uint64)chan * 0x9e3779b97f4a7c15ull;
+    return &waitq[(h >> 32) % WAITQ_HASH_SIZE];
 }
 
 void sleep(void *chan, spinlock_t *lk) {
-    struct proc *p = curr_proc();
+    struct proc *p           = curr_proc();
+    struct waitq_bucket *b   = waitq_bucket(chan);
 
     // Must acquire p->lock in order to
     // change p->state and then call sched.
-    // Once we hold p->lock, we can be
-    // guaranteed that we won't miss any wakeup
-    // (wakeup locks p->lock),
+    // Once we are on the wait queue and hold p->lock,
+    // we can be guaranteed that we won't miss any wakeup
+    // (wakeup locks the bucket and then p->lock),
     // so it's okay to release lk.
 
+    acquire(&b->lock);
     acquire(&p->lock);  // DOC: sleeplock1
+    p->wq_next = b->head;
+    if (b->head)
+        b->head->wq_pprev = &p->wq_next;
+    p->wq_pprev = &b->head;
+    b->head     = p;
+    release(&b->lock);
     release(lk);
 
     // Go to sleep.
@@ -158,24 +321,88 @@ void sleep(void *chan, spinlock_t *lk) {
 
     // p get waking up, Tidy up.
     p->sleep_chan = 0;
+    release(&p->lock);
+
+    // we may have been woken up by kill() without leaving the queue.
+    acquire(&b->lock);
+    *p->wq_pprev = p->wq_next;
+    if (p->wq_next)
+        p->wq_next->wq_pprev = p->wq_pprev;
+    p->wq_next  = NULL;
+    p->wq_pprev = NULL;
+    release(&b->lock);
 
     // Reacquire original lock.
-    release(&p->lock);
     acquire(lk);
 }
 
-// Wake up all processes sleeping on chan.
-// Must be called without any p->lock.
-void wakeup(void *chan) {
-    for (int i = 0; i < NPROC; i++) {
-        struct proc *p = pool[i];
+// Wake up processes sleeping on chan, at most @nr of them if @nr > 0.
+static void __wakeup(void *chan, int nr) {
+    struct waitq_bucket *b = waitq_bucket(chan);
+
+    acquire(&b->lock);
+    for (struct proc *p = b->head; p; p = p->wq_next) {
         acquire(&p->lock);
+        // a woken process stays on the queue until it runs, skip it.
         if (p->state == SLEEPING && p->sleep_chan == chan) {
             p->state = RUNNABLE;
             add_task(p);
+            if (--nr == 0) {
+                release(&p->lock);
+                break;
+            }
         }
         release(&p->lock);
     }
+    release(&b->lock);
+}
+
+// Wake up all processes sleeping on chan.
+// Must be called without any p->lock.
+void wakeup(void *chan) {
+    __wakeup(chan, 0);
+}
+
+// Wake up one process sleeping on chan, for resources that only one waiter can take.
+// Must be called without any p->lock.
+void wakeup_one(void *chan) {
+    __wakeup(chan, 1);
+}
+
+// Children lists:
+//  p->children links the children of p through their sibling links, under p->child_lock.
+//  Lock order: p->child_lock, then init_proc->child_lock, then p->lock of any process.
+
+static void link_child(struct proc *parent, struct proc *child) {
+    assert(holding(&parent->child_lock));
+
+    child->parent       = parent;
+    child->sibling_next = parent->children;
+    if (parent->children)
+        parent->children->sibling_pprev = &child->sibling_next;
+    child->sibling_pprev = &parent->children;
+    parent->children     = child;
+}
+
+static void unlink_child(struct proc *child) {
+    assert(holding(&child->parent->child_lock));
+
+    *child->sibling_pprev = child->sibling_next;
+    if (child->sibling_next)
+        child->sibling_next->sibling_pprev = child->sibling_pprev;
+    child->sibling_next  = NULL;
+    child->sibling_pprev = NULL;
+}
+
+// Lock the child_lock of p's parent, which may be reparenting p to init_proc meanwhile.
+static struct proc *lock_parent(struct proc *p) {
+    for (;;) {
+        struct proc *parent = p->parent;
+        acquire(&parent->child_lock);
+        if (p->parent == parent)
+            return parent;
+        release(&parent->child_lock);
+    }
 }
 
 int fork() {
@@ -195,28 +422,43 @@ int fork() {
     assert(holding(&np->lock));
 
     struct proc *p = curr_proc();
-    acquire(&p->lock);
+    // nobody can reach np yet, so it's ok to hold np->lock here.
+    acquire(&p->child_lock);
+    link_child(p, np);
+    release(&p->child_lock);
+
+    // Copy user memory from parent to child, holding only the two mm locks so that
+    //  a big copy can be preempted, see mm_copy(). Only we change our own mm, and nobody
+    //  looks at np or its mm while np is USED.
+    release(&np->lock);
     acquire(&p->mm->lock);
-
-    // Copy user memory from parent to child.
-    if ((ret = mm_copy(p->mm, np->mm)) < 0)
-        goto err_free;
-    // Set np's vma_brk
-    np->vma_brk = mm_find_vma(np->mm, p->vma_brk->vm_start);
-    np->brk     = p->brk;
-
+    if ((ret = mm_copy(p->mm, np->mm)) == 0) {
+        // Set np's vma_brk
+        np->vma_brk = mm_find_vma(np->mm, p->vma_brk->vm_start);
+        np->brk     = p->brk;
+    }
     release(&p->mm->lock);
     release(&np->mm->lock);
+    if (ret == 0)
+        ret = vec_fork(p, np);
+    acquire(&np->lock);
+    if (ret < 0)
+        goto err_free;
+    acquire(&p->lock);
 
     // copy saved user registers.
     *(np->trapframe) = *(p->trapframe);
+    fpu_fork(p, np);
+    rseq_fork(p, np);
 
     // Project signal: fork
     siginit_fork(p, np);
 
     // Cause fork to return 0 in the child.
     np->trapframe->a0 = 0;
-    np->parent        = p;
+    np->oom_score_adj  = p->oom_score_adj;
+    np->timer_slack_ns = p->timer_slack_ns;
+    sched_proc_init(np, p);
     np->state         = RUNNABLE;
     add_task(np);
     release(&np->lock);
@@ -225,9 +467,9 @@ int fork() {
     return np->pid;
 
 err_free:
-    release(&np->mm->lock);
-    release(&p->mm->lock);
-    release(&p->lock);
+    acquire(&p->child_lock);
+    unlink_child(np);
+    release(&p->child_lock);
     freeproc(np);
     release(&np->lock);
     return ret;
@@ -254,6 +496,10 @@ int exec(char *name, char *args[]) {
         return ret;
     }
 
+    fpu_init_proc(p);
+    vec_free(p);
+    rseq_init_proc(p);
+
     // Project signal: exec
     siginit_exec(p);
 
@@ -265,50 +511,42 @@ int exec(char *name, char *args[]) {
 
 int wait(int pid, int __user *code) {
     struct proc *child;
-    int havekids;
     struct proc *p = curr_proc();
 
-    acquire(&wait_lock);
+    acquire(&p->child_lock);
 
     for (;;) {
-        // Scan through table looking for exited children.
-        havekids = 0;
-        for (int i = 0; i < NPROC; i++) {
-            child = pool[i];
-            if (child == p)
-                continue;
-
+        // Scan through our children looking for exited ones.
+        for (child = p->children; child; child = child->sibling_next) {
             acquire(&child->lock);
-            if (child->parent == p) {
-                havekids = 1;
-                if (child->state == ZOMBIE && (pid <= 0 || child->pid == pid)) {
-                    int cpid = child->pid;
-                    // Found one.
-                    if (code) {
-                        acquire(&p->mm->lock);
-                        int exit_code = child->exit_code;
-                        copy_to_user(p->mm, (uint64)code, (char*)&exit_code, sizeof(int));
-                        release(&p->mm->lock);
-                    }
-                    freeproc(child);
-                    release(&child->lock);
-
-                    release(&wait_lock);
-                    return cpid;
+            if (child->state == ZOMBIE && (pid <= 0 || child->pid == pid)) {
+                // Found one.
+                int cpid      = child->pid;
+                int exit_code = child->exit_code;
+                unlink_child(child);
+                freeproc(child);
+                release(&child->lock);
+                release(&p->child_lock);
+
+                if (code) {
+                    acquire(&p->mm->lock);
+                    copy_to_user(p->mm, (uint64)code, (char*)&exit_code, sizeof(int));
+                    release(&p->mm->lock);
                 }
+                return cpid;
             }
             release(&child->lock);
         }
 
         // No waiting if we don't have any children.
-        if (!havekids || p->killed) {
-            release(&wait_lock);
+        if (p->children == NULL || p->killed) {
+            release(&p->child_lock);
             return -ECHILD;
         }
 
         debugf("pid %d sleeps for wait", p->pid);
         // Wait for a child to exit.
-        sleep(p, &wait_lock);  // DOC: wait-sleep
+        sleep(p, &p->child_lock);  // DOC: wait-sleep
     }
 }
 
@@ -320,36 +558,43 @@ void exit(int code) {
         panic("init process exited");
     }
 
-    acquire(&wait_lock);
-
-    int wakeinit = 0;
-
-    // reparent:
-    for (int i = 0; i < NPROC; i++) {
-        struct proc *child = pool[i];
-        if (child == p)
-            continue;
-        acquire(&child->lock);
-        if (child->parent == p) {
-            child->parent = init_proc;
-            wakeinit      = 1;
-            // if child has dead, wake up init to do clean up.
+    // detach our address space, the reaper frees it in the background.
+    // wait() in the parent then only has the slot to free.
+    acquire(&p->lock);
+    struct mm *mm = p->mm;
+    p->mm         = NULL;
+    p->vma_brk    = NULL;
+    release(&p->lock);
+    mm_free_async(mm);
+
+    // fail the IPC calls waiting for us.
+    ipc_exit(p);
+
+    // reparent our children to init, and wake it up to clean up the dead ones.
+    acquire(&p->child_lock);
+    if (p->children) {
+        acquire(&init_proc->child_lock);
+        struct proc *child;
+        while ((child = p->children) != NULL) {
+            unlink_child(child);
+            link_child(init_proc, child);
         }
-        release(&child->lock);
-    }
-    if (wakeinit)
         wakeup(init_proc);
+        release(&init_proc->child_lock);
+    }
+    release(&p->child_lock);
 
     // wakeup wait-ing parent.
-    //  There is no race because locking against "wait_lock"
-    wakeup(p->parent);
+    //  There is no race because we hold its child_lock until we are a ZOMBIE.
+    struct proc *parent = lock_parent(p);
+    wakeup(parent);
 
     acquire(&p->lock);
 
     p->exit_code = code;
     p->state     = ZOMBIE;
 
-    release(&wait_lock);
+    release(&parent->child_lock);
 
     sched();
     panic_never_reach();
@@ -359,24 +604,18 @@ void exit(int code) {
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
 int kill(int pid) {
-    struct proc *p;
-
-    for (int i = 0; i < NPROC; i++) {
-        p = pool[i];
-        acquire(&p->lock);
-        if (p->pid == pid) {
-            p->killed = -1;
-            if (p->state == SLEEPING) {
-                // Wake process from sleep().
-                p->state = RUNNABLE;
-                add_task(p);
-            }
-            release(&p->lock);
-            return 0;
-        }
-        release(&p->lock);
+    struct proc *p = findproc(pid);
+    if (p == NULL)
+        return -EINVAL;
+
+    p->killed = -1;
+    if (p->state == SLEEPING) {
+        // Wake process from sleep().
+        p->state = RUNNABLE;
+        add_task(p);
     }
-    return -EINVAL;
+    release(&p->lock);
+    return 0;
 }
 
 void setkilled(struct proc *p, int reason) {
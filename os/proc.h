@@ -2,9 +2,15 @@
 #define PROC_H
 
 #include "queue.h"
+#include "sched.h"
 #include "riscv.h"
 #include "vm.h"
+#include "fpu.h"
+#include "vector.h"
 #include "signal/ksignal.h"
+#include "wss.h"
+#include "ipc.h"
+#include "rseq.h"
 
 enum {
     STDIN  = 0,
@@ -32,6 +38,43 @@ struct context {
     uint64 s11;
 };
 
+// Per-CPU run queue, see sched.c
+// The heap is split into page-sized chunks, allocated by sched_grow() as the process table grows.
+#define RQ_CHUNK  (PGSIZE / sizeof(struct proc *))
+#define RQ_CHUNKS (64)
+
+// Real-time processes of a run queue: one FIFO list per priority.
+struct rt_rq {
+    struct proc *head[RT_PRIO_MAX + 1];
+    struct proc *tail[RT_PRIO_MAX + 1];
+    uint64 bitmap[2];     // bit i is set if head[i] is not empty
+    int nr_running;
+    uint64 period_start;  // see rt_period_check()
+    uint64 time;          // cycles used by real-time processes in this period
+    int throttled;        // time has reached the runtime of the period
+};
+
+struct rq {
+    spinlock_t lock;
+    int cpu;                        // the cpu owning this queue
+    struct proc **heap[RQ_CHUNKS];  // RUNNABLE processes to run on this cpu, min-heap of vruntime
+    int nr_running;                 // processes in heap
+    uint64 load;                 // sum of the weights of processes in heap
+    uint64 min_vruntime;         // monotonic, vruntime of processes in heap is relative to it
+    uint64 last_balance;         // tick of the last load balancing
+    // counters:
+    uint64 nr_switches;
+    uint64 steals;
+    uint64 migrations;
+    uint64 balanced;
+    uint64 direct_switches;
+    uint64 preemptions;
+    uint64 max_latency;
+    uint64 rt_throttled;
+    uint64 handoffs;
+    struct rt_rq rt;  // real-time processes, they run before those in heap
+};
+
 struct cpu {
     int mhart_id;                  // mhartid for this cpu, passed by OpenSBI
     struct proc *proc;             // current process
@@ -41,11 +84,25 @@ struct cpu {
     int interrupt_on;              // Is the interrupt Enabled before the first push-off?
     uint64 sched_kstack_top;       // top of per-cpu sheduler kernel stack
     int cpuid;                     // for debug purpose
+    struct rq rq;                  // run queue of this cpu
+    int tick_stopped;              // is the periodic tick stopped? see timer.c
+    uint64 timer_irqs;             // timer interrupts taken, see timer_tick()
+    int online;                    // has entered scheduler()
+    int idle;                      // is waiting for interrupts in scheduler()
+    int need_resched;              // the running process should yield, see resched_curr()
+    uint64 resched_time;           // when need_resched was set, to measure the latency
+    uint64 ipi_pending;            // IPI_* reasons, see smp.c
+    uint64 kstack_gen;             // kstack_gen at our last sfence.vma, see scheduler()
+    struct proc *switch_from;      // the process whose lock we release after a direct switch, see sched()
+    struct proc *fpu_owner;        // whose FP state is in the FP registers, see fpu.c
+    struct proc *vec_owner;        // whose vector state is in the vector registers, see vector.c
 };
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 extern struct proc *pool[];
+extern int nr_procs;
+extern uint64 kstack_gen;
 
 // Per-process state
 struct proc {
@@ -56,16 +113,59 @@ struct proc {
     int exit_code;
     void *sleep_chan;
     int killed;
+    // protected by the wait queue bucket of sleep_chan, see sleep():
+    struct proc *wq_next;
+    struct proc **wq_pprev;  // NULL if not on a wait queue
+    int oom_score_adj;  // see oom.c
+    uint64 timer_slack_ns;
+
+    struct proc *parent;  // Parent process, protected by parent->child_lock
 
-    struct proc *parent;  // Parent process
+    // see wait() and exit():
+    spinlock_t child_lock;  // protects children, and the parent and sibling links of the children
+    struct proc *children;
+    struct proc *sibling_next;
+    struct proc **sibling_pprev;
 
     int index;
+    int kstack_pages;          // pages mapped at kstack, see alloc_kstack()
+    uint32 generation;         // how many times this slot has been allocated, see allocproc()
+    struct proc *free_next;    // in the free slot list, protected by pid_lock
+    int last_cpu;  // cpu this process last ran on, -1 if never
+    // scheduling, see sched.c
+    int nice;
+    uint64 weight;
+    uint64 vruntime;  // in weighted cycles
+    uint64 exec_start;
+    uint64 sum_exec_runtime;
+    int preempt_count;  // preempt_disable() depth
+    int policy;                // SCHED_NORMAL, SCHED_FIFO or SCHED_RR
+    int rt_priority;           // RT_PRIO_MIN .. RT_PRIO_MAX for the real-time policies
+    int rt_slice;              // ticks left in the timeslice, -1: unlimited (SCHED_FIFO), 0: go behind its peers
+    struct proc *rt_next;      // in its rt_rq list, protected by the rq lock
+    int sched_pending;         // a policy change waits for the process to leave its queue, see set_scheduler()
+    int pending_policy;
+    int pending_rt_priority;
+    uint64 cpus_allowed;       // cpus it may run on, see sched_setaffinity()
     struct mm *mm;
     struct vma *vma_brk;                // special vma for heap, included in mm->vma list.
     uint64 brk;                         // end address of heap
     struct trapframe *__kva trapframe;  // data page for trampoline.S
     uint64 __kva kstack;                // Virtual address of kernel stack
     struct context context;             // swtch() here to run process
+    struct wss wss;                     // working-set estimation, see wss.c
+    struct ipc ipc;                     // synchronous IPC, see ipc.c
+    uint64 __user rseq;                 // the registered struct rseq, or 0, see rseq.c
+    uint32 rseq_sig;                    // signature preceding the abort handlers
+    int rseq_pending;                   // switched in since the last return to user
+    struct fpstate fpstate;             // saved FP registers, see fpu.c
+    int fpu_used;                       // has used FP since exec
+    int fpu_cpu;                        // the cpu whose FP registers hold our latest state, or -1
+    struct vstate vstate;               // saved vector registers, see vector.c
+    int vec_cpu;                        // the cpu whose vector registers hold our latest state, or -1
+    int kthread;                        // is a kernel thread, see kthread.c
+    void (*kthread_fn)(void *);
+    void *kthread_arg;
 
     // Project signal:
     struct ksignal signal;
@@ -75,9 +175,13 @@ static inline int cpuid() {
     return r_tp();
 }
 
-// cpu.c
+// smp.c
 struct cpu *mycpu();
 struct cpu *getcpu(int i);
+void handle_ipi();
+void smp_send_reschedule(int cpu);
+void smp_call_function(uint64 cpumask, void (*func)(void *), void *info);
+void flush_tlb_remote();
 
 static inline struct proc *curr_proc() {
     push_off();
@@ -90,6 +194,8 @@ static inline struct proc *curr_proc() {
 // proc.c
 void proc_init();
 struct proc *allocproc();
+struct proc *findproc(int pid);
+int proc_cache_drain();
 int fork();
 int exec(char *name, char *arg[]);
 int wait(int, int *);
@@ -100,6 +206,7 @@ void setkilled(struct proc *, int reason);
 
 void sleep(void *chan, spinlock_t *lk);
 void wakeup(void *chan);
+void wakeup_one(void *chan);
 
 // sched.c
 void scheduler() __attribute__((noreturn));
@@ -8,6 +8,7 @@ void init_queue(struct queue *q) {
     spinlock_init(&q->lock, "queue");
     q->front = q->tail = 0;
     q->empty           = 1;
+    q->count           = 0;
 }
 
 void push_queue(struct queue *q, void *data) {
@@ -17,7 +18,8 @@ void push_queue(struct queue *q, void *data) {
     }
     q->empty         = 0;
     q->data[q->tail] = data;
-    q->tail          = (q->tail + 1) % NPROC;
+    q->tail          = (q->tail + 1) % QUEUE_SIZE;
+    q->count++;
     release(&q->lock);
 }
 
@@ -29,7 +31,8 @@ void *pop_queue(struct queue *q) {
     }
 
     void *data = q->data[q->front];
-    q->front   = (q->front + 1) % NPROC;
+    q->front   = (q->front + 1) % QUEUE_SIZE;
+    q->count--;
     if (q->front == q->tail)
         q->empty = 1;
     release(&q->lock);
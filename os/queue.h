@@ -11,6 +11,7 @@ struct queue {
     int front;
     int tail;
     int empty;
+    int count;
 };
 
 void init_queue(struct queue *);
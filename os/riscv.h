@@ -8,6 +8,16 @@
 
 // Supervisor Status Register, sstatus
 #define SSTATUS_SUM  (1L << 18)  // SUM (permit Supervisor User Memory access)
+#define SSTATUS_FS   (3L << 13)  // Floating-point unit state:
+#define SSTATUS_FS_OFF   (0L << 13)
+#define SSTATUS_FS_INIT  (1L << 13)
+#define SSTATUS_FS_CLEAN (2L << 13)
+#define SSTATUS_FS_DIRTY (3L << 13)
+#define SSTATUS_VS   (3L << 9)   // Vector unit state, same encoding as FS
+#define SSTATUS_VS_OFF   (0L << 9)
+#define SSTATUS_VS_INIT  (1L << 9)
+#define SSTATUS_VS_CLEAN (2L << 9)
+#define SSTATUS_VS_DIRTY (3L << 9)
 #define SSTATUS_SPP  (1L << 8)   // Previous mode, 1=Supervisor, 0=User
 #define SSTATUS_SPIE (1L << 5)   // Supervisor Previous Interrupt Enable
 #define SSTATUS_SIE  (1L << 1)   // Supervisor Interrupt Enable
@@ -33,6 +43,9 @@ static inline void w_sip(uint64 x) {
     asm volatile("csrw sip, %0" : : "r"(x));
 }
 
+#define SIP_SSIP (1L << 1)  // software interrupt pending, set by SBI IPIs
+#define SIP_STIP (1L << 5)  // timer interrupt pending
+
 static inline void w_stimecmp(uint64 x) {
     // asm volatile("csrw stimecmp, %0" : : "r" (x));
     asm volatile("csrw 0x14d, %0" : : "r"(x));
@@ -202,6 +215,10 @@ static inline void sfence_vma() {
 #define PTE_A (1L << 6)
 #define PTE_D (1L << 7)
 
+// software-defined bits (RSW), ignored by the hardware.
+#define PTE_KSM       (1L << 8)  // read-only page merged by KSM, see ksm.c
+#define PTE_AGE_VALID (1L << 9)  // idle age of the mapped page is tracked, see wss.c
+
 #define PTE_RWX (PTE_R | PTE_W | PTE_X)
 
 // shift a physical address to the right place for a PTE.
@@ -0,0 +1,123 @@
+#include "rseq.h"
+
+#include "defs.h"
+#include "trap.h"
+
+// Restartable sequences.
+//
+// p->rseq_pending is set whenever a registered process is switched in, see set_next_task():
+//  it may have been preempted or migrated since it last ran in user mode. On its way back
+//  to user, usertrapret() then aborts the critical section it was in, and updates the cpu id.
+//  Nothing else can move the process to another cpu before it returns to user:
+//  interrupts stay off from there to sret.
+// Delivering a signal handler aborts the critical section too, before do_signal() saves the
+//  interrupted registers: sigreturn then resumes at the abort handler.
+//
+// Like Linux, we clear rseq_cs whenever we find the process outside of its critical section.
+
+#define RSEQ_CS_OFFSET __builtin_offsetof(struct rseq, rseq_cs)
+
+void rseq_init_proc(struct proc *p) {
+    p->rseq         = 0;
+    p->rseq_sig     = 0;
+    p->rseq_pending = 0;
+}
+
+void rseq_fork(struct proc *p, struct proc *np) {
+    np->rseq     = p->rseq;
+    np->rseq_sig = p->rseq_sig;
+    // its first switch in sets rseq_pending.
+}
+
+// Move the user pc of @p to the abort handler if it is in a critical section. mm->lock must be held.
+// Returns -EINVAL if the rseq area or the critical section descriptor is bad.
+static int rseq_ip_fixup(struct proc *p) {
+    struct mm *mm        = p->mm;
+    struct trapframe *tf = p->trapframe;
+    struct rseq_cs cs;
+    uint64 ucs;
+    uint32 sig;
+
+    assert(holding(&mm->lock));
+
+    if (copy_from_user(mm, (char *)&ucs, p->rseq + RSEQ_CS_OFFSET, sizeof(ucs)) < 0)
+        return -EINVAL;
+    if (ucs == 0)
+        return 0;
+    if (copy_from_user(mm, (char *)&cs, ucs, sizeof(cs)) < 0)
+        return -EINVAL;
+
+    uint64 end = cs.start_ip + cs.post_commit_offset;
+    if (cs.version != 0 || end < cs.start_ip || (cs.start_ip <= cs.abort_ip && cs.abort_ip < end))
+        return -EINVAL;
+    if (cs.start_ip <= tf->epc && tf->epc < end) {
+        if (copy_from_user(mm, (char *)&sig, cs.abort_ip - sizeof(sig), sizeof(sig)) < 0 || sig != p->rseq_sig)
+            return -EINVAL;
+        debugf("rseq: abort %d at %p to %p", p->pid, tf->epc, cs.abort_ip);
+        tf->epc = cs.abort_ip;
+    }
+
+    ucs = 0;
+    return copy_to_user(mm, p->rseq + RSEQ_CS_OFFSET, (char *)&ucs, sizeof(ucs));
+}
+
+// Called by do_signal() with mm->lock held, before the user registers are saved for a handler.
+int rseq_signal_deliver(struct proc *p) {
+    if (p->rseq == 0)
+        return 0;
+    return rseq_ip_fixup(p);
+}
+
+// Called by usertrapret() if rseq_pending is set. Interrupts must be off.
+// Returns -EINVAL if the process has to be killed.
+int rseq_handle_resume(struct proc *p) {
+    assert(!intr_get());
+
+    p->rseq_pending = 0;
+    if (p->rseq == 0)
+        return 0;
+
+    uint32 ids[2] = {cpuid(), cpuid()};  // cpu_id_start, cpu_id
+    acquire(&p->mm->lock);
+    int ret = rseq_ip_fixup(p);
+    if (ret == 0)
+        ret = copy_to_user(p->mm, p->rseq, (char *)ids, sizeof(ids));
+    release(&p->mm->lock);
+    return ret;
+}
+
+int64 sys_rseq(uint64 __user rseq, uint32 len, int flags, uint32 sig) {
+    struct proc *p = curr_proc();
+    uint32 ids[2];
+    int ret;
+
+    if (flags == RSEQ_FLAG_UNREGISTER) {
+        if (p->rseq == 0 || rseq != p->rseq || sig != p->rseq_sig)
+            return -EINVAL;
+        ids[0] = 0;
+        ids[1] = RSEQ_CPU_ID_UNINITIALIZED;
+        acquire(&p->mm->lock);
+        ret = copy_to_user(p->mm, rseq, (char *)ids, sizeof(ids));
+        release(&p->mm->lock);
+        rseq_init_proc(p);
+        return ret;
+    }
+
+    if (flags != 0 || len != sizeof(struct rseq) || rseq == 0 || rseq % __alignof__(struct rseq) != 0)
+        return -EINVAL;
+    if (p->rseq)
+        return (rseq == p->rseq && sig == p->rseq_sig) ? -EBUSY : -EINVAL;
+
+    // check that the area is writable. The cpu id is written on our way back to user.
+    ids[0] = ids[1] = RSEQ_CPU_ID_UNINITIALIZED;
+    acquire(&p->mm->lock);
+    ret = copy_to_user(p->mm, rseq, (char *)ids, sizeof(ids));
+    release(&p->mm->lock);
+    if (ret < 0)
+        return ret;
+
+    p->rseq         = rseq;
+    p->rseq_sig     = sig;
+    p->rseq_pending = 1;
+    return 0;
+}
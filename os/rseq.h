@@ -0,0 +1,46 @@
+#ifndef __RSEQ_H__
+#define __RSEQ_H__
+
+// This file is shared by Kernel and User-space application.
+
+#include "types.h"
+
+// Restartable sequences, with the layout of Linux's <linux/rseq.h>.
+//
+// rseq(rseq, len, flags, sig): register the struct rseq of the calling process, len must be
+//  sizeof(struct rseq). The kernel keeps cpu_id_start and cpu_id up to date on every return to user.
+//  With RSEQ_FLAG_UNREGISTER, the same rseq and sig unregister it.
+//  Registration is inherited by forked children, and dropped by exec.
+//
+// Critical sections: before entering one, user code points rseq_cs at a struct rseq_cs describing it.
+//  If the process is preempted, migrated, or interrupted by a signal handler before the commit
+//  instruction at start_ip + post_commit_offset, it resumes at abort_ip instead, and rseq_cs
+//  is cleared. The 4 bytes before abort_ip must be `sig`, or the process is killed.
+//  No syscall may be made inside a critical section.
+#define RSEQ_FLAG_UNREGISTER      (1 << 0)
+#define RSEQ_CPU_ID_UNINITIALIZED ((uint32)-1)
+
+struct rseq_cs {
+    uint32 version;  // must be 0
+    uint32 flags;
+    uint64 start_ip;
+    uint64 post_commit_offset;  // the critical section is [start_ip, start_ip + post_commit_offset)
+    uint64 abort_ip;            // outside the critical section
+} __attribute__((aligned(32)));
+
+struct rseq {
+    uint32 cpu_id_start;  // the current cpu, 0 if not registered
+    uint32 cpu_id;        // the current cpu, or RSEQ_CPU_ID_UNINITIALIZED if not registered
+    uint64 rseq_cs;       // struct rseq_cs __user * of the current critical section, or 0
+    uint32 flags;
+} __attribute__((aligned(32)));
+
+// kernel interfaces, see rseq.c
+struct proc;
+void rseq_init_proc(struct proc *p);
+void rseq_fork(struct proc *p, struct proc *np);
+int rseq_signal_deliver(struct proc *p);
+int rseq_handle_resume(struct proc *p);
+int64 sys_rseq(uint64 rseq, uint32 len, int flags, uint32 sig);
+
+#endif  // __RSEQ_H__
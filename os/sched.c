@@ -1,38 +1,696 @@
+#include "sched.h"
+
 #include "defs.h"
 #include "kalloc.h"
 #include "loader.h"
 #include "proc.h"
-#include "queue.h"
+#include "timer.h"
 #include "trap.h"
 
-static struct queue task_queue;
+// Every cpu has its own run queue (struct rq):
+//  a process made RUNNABLE is queued on the cpu which forks, wakes up or preempts it.
+//  An idle cpu steals a process from the busiest queue,
+//  and every BALANCE_INTERVAL ticks, a cpu pulls processes from the busiest queue
+//  until both queues have about the same length.
+//
+// Fair-share policy, like Linux CFS:
+//  a process's vruntime grows with the CPU time it gets, scaled by NICE_0_WEIGHT / weight,
+//  and the run queue is a min-heap of vruntime: the process that got the least runs first.
+//  The running process is preempted at a timer tick when it has used its timeslice,
+//  i.e. its share (weight / load) of SCHED_LATENCY_US, or when it is SCHED_WAKEUP_GRAN_US
+//  ahead of the leftmost process.
+//
+// vruntime is only comparable within a run queue: while a process is not queued or running,
+//  p->vruntime holds its lag relative to the min_vruntime of the queue it left.
+//
+// A process giving up the cpu in sched() switches directly to the leftmost process of
+//  the queue, so a reschedule costs one swtch instead of two. The scheduler thread only
+//  runs when the queue is empty (to steal or idle), or when the next process is locked.
+//
+// Real-time classes: SCHED_FIFO and SCHED_RR processes are queued in rq->rt, one FIFO list per
+//  priority, and are always picked before the fair queue. A woken real-time process is queued on
+//  the cpu running the lowest-priority work, which is asked to reschedule at once, see add_task().
+// RT throttling: the real-time processes of a cpu may use SCHED_RT_RUNTIME_US of every
+//  SCHED_RT_PERIOD_US. Past that, they only run when no fair process is waiting there,
+//  until the next period. So a runaway real-time process cannot starve the system.
+//
+// CPU affinity: a process only runs on the cpus of p->cpus_allowed. It is queued on an allowed
+//  cpu, and stealing and balancing only move it between allowed cpus. The harts of ISOLCPUS
+//  (a build option, there is no kernel command line) are left out of the default mask and of
+//  load balancing, so they only run processes bound to them, and stop their tick.
+//
+// Kernel preemption: a reschedule request (a tick that ends the timeslice, or an IPI) sets
+//  cpu->need_resched. The running process gives up the cpu at the next safe point:
+//  on its way back to the user, on return from a kernel interrupt, or when it releases its
+//  last lock in pop_off(). Code holding a spinlock runs with interrupts off (noff > 0), so the
+//  spinlocks are what disable preemption. preempt_disable() does it for lock-free code.
+// Long loops under a lock call cond_resched_lock(), which drops the lock when a tick is pending.
+
+#define BALANCE_INTERVAL (10)  // in ticks
+
+#define SCHED_LATENCY_US         (20000)
+#define SCHED_MIN_GRANULARITY_US (4000)
+#define SCHED_WAKEUP_GRAN_US     (4000)
+#define US_TO_CYCLES(us)         ((uint64)(us) * CPU_FREQ / 1000000)
+
+#define RR_TIMESLICE        (10)  // in ticks
+#define SCHED_RT_PERIOD_US  (1000000)
+#define SCHED_RT_RUNTIME_US (950000)
 
-// defined in proc.c
-extern struct proc *pool[NPROC];
+// weight of nice -20 .. 19, each nice level is ~10% of CPU time.
+static const int nice_to_weight[40] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548,  7620,  6100,  4904,  3906,
+    /*  -5 */ 3121,  2501,  1991,  1586,  1277,
+    /*   0 */ 1024,  820,   655,   526,   423,
+    /*   5 */ 335,   272,   215,   172,   137,
+    /*  10 */ 110,   87,    70,    56,    45,
+    /*  15 */ 36,    29,    23,    18,    15,
+};
+#define NICE_0_WEIGHT (1024)
+
+#define ALL_CPUS      ((1ull << NCPU) - 1)
+#define MIGRATE_SCAN  (32)  // queued fair processes looked at to find one allowed on the stealing cpu
+
+// Harts isolated at boot, a mask of cpuids given by `make ISOLCPUS=<mask>`.
+// Only the processes pinned there by sched_setaffinity() run on them. cpu 0 is never isolated.
+#ifndef ISOLCPUS
+#define ISOLCPUS (0)
+#endif
+static uint64 isolated_cpus;
 
 void sched_init() {
-    init_queue(&task_queue);
+    assert(NPROC <= RQ_CHUNKS * RQ_CHUNK);
+    for (int i = 0; i < NCPU; i++) {
+        spinlock_init(&getcpu(i)->rq.lock, "rq");
+        getcpu(i)->rq.cpu = i;
+    }
+    isolated_cpus = ISOLCPUS & ALL_CPUS & ~1ull;
+    if (isolated_cpus)
+        infof("isolated cpus: %p", isolated_cpus);
+}
+
+int cpu_isolated(int cpu) {
+    return (isolated_cpus >> cpu) & 1;
+}
+
+// The cpus where processes run unless they are pinned elsewhere.
+uint64 housekeeping_cpus() {
+    return ALL_CPUS & ~isolated_cpus;
+}
+
+static inline int cpu_allowed(struct proc *p, int cpu) {
+    return (p->cpus_allowed >> cpu) & 1;
+}
+
+// Make every run queue able to hold @nr_procs processes, called before the process table grows.
+int sched_grow(int nr_procs) {
+    int nr_chunks = (nr_procs + RQ_CHUNK - 1) / RQ_CHUNK;
+    for (int i = 0; i < NCPU; i++) {
+        struct rq *rq = &getcpu(i)->rq;
+        for (int c = 0; c < nr_chunks; c++) {
+            if (rq->heap[c])
+                continue;
+            void *__pa pa = kallocpage();
+            if (pa == NULL)
+                return -ENOMEM;
+            acquire(&rq->lock);
+            rq->heap[c] = (struct proc **)PA_TO_KVA(pa);
+            release(&rq->lock);
+        }
+    }
+    return 0;
+}
+
+static inline struct proc **heap_at(struct rq *rq, int i) {
+    return &rq->heap[i / RQ_CHUNK][i % RQ_CHUNK];
+}
+
+static inline int vruntime_before(struct proc *a, struct proc *b) {
+    return (int64)(a->vruntime - b->vruntime) < 0;
+}
+
+static void heap_swap(struct rq *rq, int i, int j) {
+    struct proc *t   = *heap_at(rq, i);
+    *heap_at(rq, i)  = *heap_at(rq, j);
+    *heap_at(rq, j)  = t;
+}
+
+static void sift_up(struct rq *rq, int i) {
+    for (; i > 0 && vruntime_before(*heap_at(rq, i), *heap_at(rq, (i - 1) / 2)); i = (i - 1) / 2) heap_swap(rq, i, (i - 1) / 2);
+}
+
+static void sift_down(struct rq *rq, int i) {
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < rq->nr_running && vruntime_before(*heap_at(rq, l), *heap_at(rq, min)))
+            min = l;
+        if (r < rq->nr_running && vruntime_before(*heap_at(rq, r), *heap_at(rq, min)))
+            min = r;
+        if (min == i)
+            break;
+        heap_swap(rq, i, min);
+        i = min;
+    }
+}
+
+static void enqueue(struct rq *rq, struct proc *p) {
+    assert(holding(&rq->lock));
+    assert(rq->nr_running < nr_procs);
+
+    int i           = rq->nr_running++;
+    *heap_at(rq, i) = p;
+    sift_up(rq, i);
+    rq->load += p->weight;
+}
+
+// Take the process at index @i of the heap.
+static struct proc *heap_remove(struct rq *rq, int i) {
+    assert(holding(&rq->lock));
+
+    struct proc *p  = *heap_at(rq, i);
+    *heap_at(rq, i) = *heap_at(rq, --rq->nr_running);
+    if (i < rq->nr_running) {
+        sift_down(rq, i);
+        sift_up(rq, i);
+    }
+    rq->load -= p->weight;
+    return p;
+}
+
+// Take the leftmost process, or NULL if the queue is empty.
+static struct proc *dequeue(struct rq *rq) {
+    assert(holding(&rq->lock));
+
+    if (rq->nr_running == 0)
+        return NULL;
+    return heap_remove(rq, 0);
+}
+
+static void update_min_vruntime(struct rq *rq, uint64 vruntime) {
+    assert(holding(&rq->lock));
+
+    if (rq->nr_running > 0 && (int64)((*heap_at(rq, 0))->vruntime - vruntime) < 0)
+        vruntime = (*heap_at(rq, 0))->vruntime;
+    if ((int64)(vruntime - rq->min_vruntime) > 0)
+        rq->min_vruntime = vruntime;
+}
+
+static inline int rt_task(struct proc *p) {
+    return p->policy != SCHED_NORMAL;
+}
+
+// The highest priority with a queued real-time process, or -1.
+static inline int rt_highest(struct rt_rq *rt) {
+    if (rt->bitmap[1])
+        return 127 - __builtin_clzll(rt->bitmap[1]);
+    if (rt->bitmap[0])
+        return 63 - __builtin_clzll(rt->bitmap[0]);
+    return -1;
+}
+
+// Queue a real-time process: in front of its peers if it has been preempted during its timeslice,
+//  behind them with a new timeslice otherwise.
+static void rt_enqueue(struct rq *rq, struct proc *p) {
+    assert(holding(&rq->lock));
+
+    struct rt_rq *rt = &rq->rt;
+    int prio         = p->rt_priority;
+    if (p->rt_slice != 0) {
+        p->rt_next     = rt->head[prio];
+        rt->head[prio] = p;
+        if (rt->tail[prio] == NULL)
+            rt->tail[prio] = p;
+    } else {
+        p->rt_slice = p->policy == SCHED_RR ? RR_TIMESLICE : -1;
+        p->rt_next  = NULL;
+        if (rt->tail[prio])
+            rt->tail[prio]->rt_next = p;
+        else
+            rt->head[prio] = p;
+        rt->tail[prio] = p;
+    }
+    rt->bitmap[prio / 64] |= 1ull << (prio % 64);
+    rt->nr_running++;
+}
+
+// Take the first real-time process of the highest priority, or NULL.
+static struct proc *rt_dequeue(struct rq *rq) {
+    assert(holding(&rq->lock));
+
+    struct rt_rq *rt = &rq->rt;
+    int prio         = rt_highest(rt);
+    if (prio < 0)
+        return NULL;
+    struct proc *p = rt->head[prio];
+    rt->head[prio] = p->rt_next;
+    if (rt->head[prio] == NULL) {
+        rt->tail[prio] = NULL;
+        rt->bitmap[prio / 64] &= ~(1ull << (prio % 64));
+    }
+    p->rt_next = NULL;
+    rt->nr_running--;
+    return p;
+}
+
+// Take the first real-time process allowed on @cpu, highest priority first, or NULL.
+static struct proc *rt_dequeue_allowed(struct rq *rq, int cpu) {
+    assert(holding(&rq->lock));
+
+    struct rt_rq *rt = &rq->rt;
+    for (int prio = RT_PRIO_MAX; prio >= RT_PRIO_MIN; prio--) {
+        if (!(rt->bitmap[prio / 64] & (1ull << (prio % 64))))
+            continue;
+        struct proc *prev = NULL;
+        for (struct proc **pp = &rt->head[prio]; *pp; prev = *pp, pp = &(*pp)->rt_next) {
+            struct proc *p = *pp;
+            if (!cpu_allowed(p, cpu))
+                continue;
+            *pp = p->rt_next;
+            if (rt->tail[prio] == p)
+                rt->tail[prio] = prev;
+            if (rt->head[prio] == NULL)
+                rt->bitmap[prio / 64] &= ~(1ull << (prio % 64));
+            p->rt_next = NULL;
+            rt->nr_running--;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Take one of the first fair processes allowed on @cpu, or NULL.
+static struct proc *dequeue_allowed(struct rq *rq, int cpu) {
+    assert(holding(&rq->lock));
+
+    for (int i = 0; i < MIN(rq->nr_running, MIGRATE_SCAN); i++) {
+        if (cpu_allowed(*heap_at(rq, i), cpu))
+            return heap_remove(rq, i);
+    }
+    return NULL;
+}
+
+// Start a new throttling period if the current one is over.
+static void rt_period_check(struct rq *rq) {
+    assert(holding(&rq->lock));
+
+    uint64 now = r_time();
+    if (now - rq->rt.period_start >= US_TO_CYCLES(SCHED_RT_PERIOD_US)) {
+        rq->rt.period_start = now;
+        rq->rt.time         = 0;
+        rq->rt.throttled    = 0;
+    }
+}
+
+// May the queued real-time processes run? Throttling only matters if fair processes are waiting.
+static inline int rt_runnable(struct rq *rq) {
+    return rq->rt.nr_running > 0 && (!rq->rt.throttled || rq->nr_running == 0);
+}
+
+// The process the scheduler would pick next, or NULL if the queue is empty.
+static struct proc *peek_task(struct rq *rq) {
+    assert(holding(&rq->lock));
+
+    if (rt_runnable(rq))
+        return rq->rt.head[rt_highest(&rq->rt)];
+    return rq->nr_running > 0 ? *heap_at(rq, 0) : NULL;
+}
+
+// Take the process peek_task() returns.
+static struct proc *pick_task(struct rq *rq) {
+    if (rt_runnable(rq))
+        return rt_dequeue(rq);
+    struct proc *p = dequeue(rq);
+    if (p)
+        update_min_vruntime(rq, p->vruntime);
+    return p;
+}
+
+/**
+ * @brief Should @prev keep the cpu, rather than let @next, the first queued process, run?
+ *
+ * A real-time process gives way to higher priorities, and to its peers once it has used
+ *  its timeslice. A fair process only keeps the cpu from real-time ones if they are throttled.
+ */
+static int keep_running(struct rq *rq, struct proc *prev, struct proc *next) {
+    if (rt_task(next)) {
+        if (!rt_task(prev))
+            return rq->rt.throttled;
+        return prev->rt_priority > next->rt_priority || (prev->rt_priority == next->rt_priority && prev->rt_slice != 0);
+    }
+    if (rt_task(prev))
+        return !rq->rt.throttled;
+    return !vruntime_before(next, prev);
+}
+
+static inline int rq_nr_running(struct rq *rq) {
+    return rq->nr_running + rq->rt.nr_running;
+}
+
+// The longest run queue other than @self, or NULL if they are all empty.
+static struct rq *busiest_rq(struct rq *self) {
+    struct rq *busiest = NULL;
+    for (int i = 0; i < NCPU; i++) {
+        struct rq *rq = &getcpu(i)->rq;
+        // it's ok to read an out-dated nr_running, dequeue() will tell.
+        if (rq != self && rq_nr_running(rq) > 0 && (busiest == NULL || rq_nr_running(rq) > rq_nr_running(busiest)))
+            busiest = rq;
+    }
+    return busiest;
+}
+
+// Move a process of @src allowed on the cpu of @dst, real-time ones first.
+// Returns 0 if there is none.
+static int migrate_task(struct rq *src, struct rq *dst) {
+    acquire(&src->lock);
+    struct proc *p = rt_dequeue_allowed(src, dst->cpu);
+    if (p == NULL)
+        p = dequeue_allowed(src, dst->cpu);
+    if (p && !rt_task(p))
+        p->vruntime -= src->min_vruntime;
+    release(&src->lock);
+    if (p == NULL)
+        return 0;
+
+    acquire(&dst->lock);
+    if (rt_task(p)) {
+        rt_enqueue(dst, p);
+    } else {
+        p->vruntime += dst->min_vruntime;
+        enqueue(dst, p);
+    }
+    release(&dst->lock);
+    return 1;
 }
 
-static struct proc *fetch_task() {
-    struct proc *proc = pop_queue(&task_queue);
+static struct proc *fetch_task(struct cpu *c) {
+    struct rq *rq = &c->rq;
+    struct proc *proc;
+
+    acquire(&rq->lock);
+    if (rq_nr_running(rq) == 0) {
+        release(&rq->lock);
+        // steal from any queue holding a process we may run.
+        int stolen = 0;
+        for (int i = 0; i < NCPU && !stolen; i++) {
+            struct rq *src = &getcpu(i)->rq;
+            // it's ok to read an out-dated nr_running, migrate_task() will tell.
+            if (src != rq && rq_nr_running(src) > 0)
+                stolen = migrate_task(src, rq);
+        }
+        if (!stolen)
+            return NULL;
+        rq->steals++;
+        acquire(&rq->lock);
+    }
+    rt_period_check(rq);
+    proc = pick_task(rq);
     if (proc != NULL)
         debugf("fetch task (pid=%d) from task queue", proc->pid);
+    release(&rq->lock);
     return proc;
 }
 
+static void load_balance(struct cpu *c) {
+    if (cpu_isolated(c->cpuid) || ticks - c->rq.last_balance < BALANCE_INTERVAL)
+        return;
+    c->rq.last_balance = ticks;
+
+    struct rq *busiest = busiest_rq(&c->rq);
+    if (busiest == NULL)
+        return;
+    for (int n = (rq_nr_running(busiest) - rq_nr_running(&c->rq)) / 2; n > 0; n--) {
+        if (!migrate_task(busiest, &c->rq))
+            break;
+        c->rq.balanced++;
+    }
+}
+
+// Let an idle cpu where @p is allowed steal it.
+static void kick_idle_cpu(struct proc *p) {
+    __sync_synchronize();
+    for (int i = 0; i < NCPU; i++) {
+        struct cpu *c = getcpu(i);
+        if (c != mycpu() && c->idle && cpu_allowed(p, i)) {
+            smp_send_reschedule(i);
+            return;
+        }
+    }
+}
+
+// Priority of the work on @c: -1 if idle, 0 for fair processes, or the highest real-time priority
+//  running or queued there. Read without locks, it is only a hint.
+static int cpu_prio(struct cpu *c) {
+    struct proc *curr = c->proc;
+    int prio          = rt_highest(&c->rq.rt);
+    if (curr && rt_task(curr))
+        prio = MAX(prio, curr->rt_priority);
+    else if (curr || c->rq.nr_running > 0)
+        prio = MAX(prio, 0);
+    return prio;
+}
+
+// A cpu for @p, which may not run on this one: the allowed online cpu with the fewest
+//  queued processes, or any allowed cpu if none is online yet.
+static struct cpu *select_allowed_cpu(struct proc *p) {
+    struct cpu *best = NULL;
+    for (int i = 0; i < NCPU; i++) {
+        struct cpu *c = getcpu(i);
+        if (!cpu_allowed(p, i))
+            continue;
+        if (best == NULL || (c->online && (!best->online || rq_nr_running(&c->rq) < rq_nr_running(&best->rq))))
+            best = c;
+    }
+    assert(best);
+    return best;
+}
+
+// Queue the real-time process @p on the allowed cpu running the lowest-priority work, preferably this one,
+//  and make that cpu reschedule if @p should run there now.
+static void add_rt_task(struct proc *p) {
+    struct cpu *self   = mycpu();
+    struct cpu *target = cpu_allowed(p, self->cpuid) ? self : NULL;
+    int target_prio    = target ? cpu_prio(self) : RT_PRIO_MAX + 1;
+    for (int i = 0; i < NCPU; i++) {
+        struct cpu *c = getcpu(i);
+        int prio;
+        if (c != self && c->online && cpu_allowed(p, i) && (prio = cpu_prio(c)) < target_prio) {
+            target      = c;
+            target_prio = prio;
+        }
+    }
+    if (target == NULL)
+        target = select_allowed_cpu(p);
+
+    p->rt_slice = 0;  // behind its peers
+    acquire(&target->rq.lock);
+    rt_enqueue(&target->rq, p);
+    release(&target->rq.lock);
+
+    if (target != self) {
+        if (target->online)
+            smp_send_reschedule(target->cpuid);
+    }
+    else if (self->proc && !keep_running(&self->rq, self->proc, p))
+        resched_curr(self);
+    else if (self->tick_stopped && self->proc)
+        set_next_timer();
+    debugf("add rt task (pid=%d) to cpu %d", p->pid, target->cpuid);
+}
+
+// Turn the lag of @p, which is about to join @rq, into a vruntime there.
+static inline void place_task(struct rq *rq, struct proc *p) {
+    // don't let a long sleeper starve everyone else.
+    int64 lag   = MAX((int64)p->vruntime, -(int64)US_TO_CYCLES(SCHED_LATENCY_US / 2));
+    p->vruntime = rq->min_vruntime + lag;
+}
+
+// Queue a process which is new or woken up on this cpu, or on another one if its affinity says so.
 void add_task(struct proc *p) {
     assert(p->state == RUNNABLE);
     assert(holding(&p->lock));
 
-    push_queue(&task_queue, p);
+    if (rt_task(p)) {
+        add_rt_task(p);
+        return;
+    }
+
+    struct cpu *self   = mycpu();
+    struct cpu *target = cpu_allowed(p, self->cpuid) ? self : select_allowed_cpu(p);
+    struct rq *rq      = &target->rq;
+    acquire(&rq->lock);
+    place_task(rq, p);
+    enqueue(rq, p);
+    release(&rq->lock);
+
+    if (target != self) {
+        if (target->online)
+            smp_send_reschedule(target->cpuid);
+        return;
+    }
+    // the running process now has to be preempted.
+    if (self->tick_stopped && self->proc)
+        set_next_timer();
+    // let an idle cpu steal it right away.
+    if (self->proc)
+        kick_idle_cpu(p);
     debugf("add task (pid=%d) to task queue", p->pid);
 }
 
+// Account the CPU time used by @p, running on @rq, since it has been switched to.
+static void update_curr(struct rq *rq, struct proc *p) {
+    assert(holding(&rq->lock));
+
+    uint64 now    = r_time();
+    uint64 delta  = now - p->exec_start;
+    p->exec_start = now;
+    p->sum_exec_runtime += delta;
+    if (!rt_task(p)) {
+        p->vruntime += delta * NICE_0_WEIGHT / p->weight;
+        return;
+    }
+    rq->rt.time += delta;
+    if (!rq->rt.throttled && rq->rt.time >= US_TO_CYCLES(SCHED_RT_RUNTIME_US)) {
+        rq->rt.throttled = 1;
+        rq->rt_throttled++;
+    }
+}
+
+/**
+ * @brief Called at a timer tick taken in user mode, or in the kernel on behalf of the current
+ *  process, see usertrap() and kernel_trap().
+ * @return whether the current process should yield the CPU.
+ */
+int sched_tick() {
+    struct proc *p = curr_proc();
+    struct rq *rq;
+    int resched = 0;
+
+    push_off();
+    rq = &mycpu()->rq;
+    acquire(&rq->lock);
+    rt_period_check(rq);
+
+    if (rt_task(p)) {
+        update_curr(rq, p);
+        if (p->rt_slice > 0)
+            p->rt_slice--;
+        struct proc *next = peek_task(rq);
+        resched           = next && !keep_running(rq, p, next);
+    } else if (rt_runnable(rq)) {
+        resched = 1;
+    } else if (rq->nr_running > 0) {
+        uint64 ran      = r_time() - p->exec_start;
+        uint64 load     = rq->load + p->weight;
+        uint64 period   = MAX(US_TO_CYCLES(SCHED_LATENCY_US), (rq->nr_running + 1) * US_TO_CYCLES(SCHED_MIN_GRANULARITY_US));
+        uint64 slice    = period * p->weight / load;
+        uint64 vruntime = p->vruntime + ran * NICE_0_WEIGHT / p->weight;
+
+        if (ran >= slice)
+            resched = 1;
+        else if ((int64)(vruntime - (*heap_at(rq, 0))->vruntime) > (int64)US_TO_CYCLES(SCHED_WAKEUP_GRAN_US))
+            resched = 1;
+    }
+    release(&rq->lock);
+    pop_off();
+    return resched;
+}
+
+/**
+ * @brief Account @p which has stopped running, and queue it again if it is still RUNNABLE.
+ *
+ * @return 1 if @p is RUNNABLE but no longer allowed on this cpu:
+ *  the caller must add_task() it once @rq is unlocked.
+ */
+static int put_prev_task(struct rq *rq, struct proc *p) {
+    assert(holding(&rq->lock));
+
+    int requeue = p->state == RUNNABLE && cpu_allowed(p, rq->cpu);
+    update_curr(rq, p);
+    if (rt_task(p)) {
+        if (requeue)
+            rt_enqueue(rq, p);
+    } else {
+        update_min_vruntime(rq, p->vruntime);
+        if (requeue) {
+            enqueue(rq, p);
+        } else {
+            // keep the lag only, see add_task().
+            p->vruntime -= rq->min_vruntime;
+        }
+    }
+    return p->state == RUNNABLE && !requeue;
+}
+
+// Satisfy a reschedule request of @c, and account how long it has waited.
+static void clear_need_resched(struct cpu *c) {
+    if (c->need_resched) {
+        uint64 latency = r_time() - c->resched_time;
+        c->rq.max_latency = MAX(c->rq.max_latency, latency);
+    }
+    c->need_resched = 0;
+}
+
+/**
+ * @brief Change the policy of @p, which must not be queued.
+ *
+ * @rq is the run queue @p runs on, or NULL if @p is not running.
+ *  A running fair process has an absolute vruntime, and real-time processes have no lag.
+ */
+static void set_scheduler(struct rq *rq, struct proc *p, int policy, int priority) {
+    assert(holding(&p->lock));
+
+    if (policy != SCHED_NORMAL) {
+        if (!rt_task(p))
+            p->vruntime = 0;
+    } else if (rt_task(p) && rq) {
+        acquire(&rq->lock);
+        p->vruntime = rq->min_vruntime;
+        release(&rq->lock);
+    }
+    p->policy        = policy;
+    p->rt_priority   = priority;
+    p->rt_slice      = policy == SCHED_RR ? RR_TIMESLICE : -1;
+    p->sched_pending = 0;
+}
+
+// Apply the policy change that sched_setscheduler() has left to @p, running on @c.
+static inline void set_pending_scheduler(struct cpu *c, struct proc *p) {
+    if (p->sched_pending)
+        set_scheduler(&c->rq, p, p->pending_policy, p->pending_rt_priority);
+}
+
+// Make @p, which has been taken from the run queue, the running process of @c.
+static void set_next_task(struct cpu *c, struct proc *p) {
+    assert(holding(&p->lock));
+    assert(p->state == RUNNABLE);
+
+    if (p->last_cpu >= 0 && p->last_cpu != c->cpuid)
+        c->rq.migrations++;
+    p->last_cpu = c->cpuid;
+    c->rq.nr_switches++;
+    p->weight     = nice_to_weight[p->nice + 20];
+    p->exec_start = r_time();
+    p->state      = RUNNING;
+    c->proc       = p;
+    // it may have been preempted or migrated in a restartable sequence, see rseq.c
+    if (p->rseq)
+        p->rseq_pending = 1;
+    set_pending_scheduler(c, p);
+    clear_need_resched(c);
+    set_next_timer();
+    // p may run on a kernel stack mapped after our TLB last saw that address.
+    if (c->kstack_gen != kstack_gen) {
+        c->kstack_gen = kstack_gen;
+        sfence_vma();
+    }
+}
+
 static int all_dead() {
     push_off();
     int alive = 0;
-    for (int i = 0; i < NPROC; i++) {
+    for (int i = 0; i < nr_procs; i++) {
         struct proc *p = pool[i];
         // it's ok to read an out-dated UNUSED state,
         //  so omit acquire&release here
@@ -58,11 +716,13 @@ void scheduler() {
     // After each cpu boots, it calls scheduler().
     // If this scheduler finds any possible process to run, it will switch to it.
     // 	And the scheduler context is saved on "mycpu()->sched_context"
+    c->online = 1;
 
     for (;;) {
         // intr may be on here.
 
-        p = fetch_task();
+        load_balance(c);
+        p = fetch_task(c);
         if (p == NULL) {
             // if we cannot find a process in the task_queue
             //  maybe some processes are SLEEPING and some are RUNNABLE
@@ -70,35 +730,104 @@ void scheduler() {
                 panic("[cpu %d] scheduler dead.", c->cpuid);
             } else {
                 // nothing to run; stop running on this core until an interrupt.
-                intr_on();
-                asm volatile("wfi");
-                intr_off();
-                continue;
+                set_next_timer();
+                // pairs with add_task(): either it sees us idle and kicks us,
+                //  or we find its process here.
+                //  Processes we are not allowed to run don't keep us awake.
+                c->idle = 1;
+                __sync_synchronize();
+                p = fetch_task(c);
+                if (p == NULL) {
+                    intr_on();
+                    asm volatile("wfi");
+                    intr_off();
+                }
+                c->idle = 0;
+                if (p == NULL)
+                    continue;
             }
         }
 
         acquire(&p->lock);
-        assert(p->state == RUNNABLE);
+        if (!cpu_allowed(p, c->cpuid)) {
+            // its affinity has changed while it was queued here.
+            if (!rt_task(p)) {
+                acquire(&c->rq.lock);
+                p->vruntime -= c->rq.min_vruntime;
+                release(&c->rq.lock);
+            }
+            add_task(p);
+            release(&p->lock);
+            continue;
+        }
         debugf("switch to proc %d(%d)", p->index, p->pid);
-        p->state = RUNNING;
-        c->proc  = p;
+        set_next_task(c, p);
         swtch(&c->sched_context, &p->context);
 
         // When we get back here, someone must have called swtch(..., &c->sched_context);
-        assert(c->proc == p);
+        //  not necessarily p: it may have switched directly to other processes, see sched().
+        p = c->proc;
         assert(!intr_get());        // scheduler should never have intr_on()
         assert(holding(&p->lock));  // whoever switch to us must acquire p->lock
         c->proc = NULL;
 
-        if (p->state == RUNNABLE) {
+        acquire(&c->rq.lock);
+        int moved = put_prev_task(&c->rq, p);
+        release(&c->rq.lock);
+        if (moved)
             add_task(p);
-        }
         release(&p->lock);
     }
 }
 
-// Switch to scheduler.  Must hold only p->lock
-// and have changed proc->state. Saves and restores
+/**
+ * @brief Pick the process @prev can switch to directly, without going through the scheduler.
+ *
+ * Only the first process of our own queue is considered, and only if its lock is free:
+ *  we already hold prev->lock, so we must not spin on another process lock.
+ * Processes not allowed on this cpu, @prev or the first one, are left to the scheduler.
+ *
+ * @return the next process with its lock held, @prev if it should keep running,
+ *  or NULL if the scheduler has to decide.
+ */
+static struct proc *pick_next_direct(struct cpu *c, struct proc *prev) {
+    struct rq *rq     = &c->rq;
+    struct proc *next = NULL;
+
+    if (prev->state == RUNNABLE && !cpu_allowed(prev, c->cpuid))
+        return NULL;
+
+    acquire(&rq->lock);
+    rt_period_check(rq);
+    struct proc *first = peek_task(rq);
+    if (first && cpu_allowed(first, c->cpuid)) {
+        update_curr(rq, prev);
+        if (prev->state == RUNNABLE && keep_running(rq, prev, first)) {
+            // the scheduler would pick prev again.
+            next = prev;
+        } else if (try_acquire(&first->lock)) {
+            put_prev_task(rq, prev);
+            next = pick_task(rq);
+            assert(next == first);
+        }
+    }
+    release(&rq->lock);
+    return next;
+}
+
+// Called by a process switched to directly: release the lock of the process that switched to it.
+void finish_switch() {
+    struct cpu *c     = mycpu();
+    struct proc *prev = c->switch_from;
+
+    if (prev) {
+        c->switch_from = NULL;
+        release(&prev->lock);
+    }
+}
+
+// Switch to the next process, or to the scheduler if sched() can't pick it by itself.
+// Must hold only p->lock and have changed proc->state. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
 // be proc->intena and proc->noff, but that would
@@ -117,10 +846,33 @@ void sched() {
     if (mycpu()->inkernel_trap)
         panic("sched should never be called in kernel trap context.");
     assert(!intr_get());
+    fpu_switch_out(p);
+    vec_switch_out(p);
 
-    interrupt_on = mycpu()->interrupt_on;
-    debugf("switch to scheduler %d(%d)", p->index, p->pid);
-    swtch(&p->context, &mycpu()->sched_context);
+    struct cpu *c     = mycpu();
+    struct proc *next = pick_next_direct(c, p);
+    interrupt_on      = c->interrupt_on;
+    if (next == p) {
+        p->state = RUNNING;
+        set_pending_scheduler(c, p);
+        clear_need_resched(c);
+        // others are queued: we may have been asked to reschedule with the tick stopped.
+        if (c->tick_stopped)
+            set_next_timer();
+        return;
+    } else if (next) {
+        // switch straight to next: it will release our lock, see finish_switch().
+        debugf("switch from %d(%d) to %d(%d)", p->index, p->pid, next->index, next->pid);
+        c->rq.direct_switches++;
+        set_next_task(c, next);
+        c->switch_from = p;
+        swtch(&p->context, &next->context);
+    } else {
+        debugf("switch to scheduler %d(%d)", p->index, p->pid);
+        swtch(&p->context, &c->sched_context);
+    }
+    // we may be running on another cpu now.
+    finish_switch();
     mycpu()->interrupt_on = interrupt_on;
 
     // if scheduler returns here: p->lock must be holding.
@@ -128,6 +880,142 @@ void sched() {
         panic("not holding p->lock after sched.swtch returns");
 }
 
+/**
+ * @brief Block the current process and switch straight to @next, which is SLEEPING.
+ *
+ * Used by synchronous IPC, see ipc.c: @next runs at once on this cpu in place of the current
+ *  process, without going through the run queue, so the current process donates the rest of
+ *  its timeslice. The tick still preempts @next if others have waited long enough.
+ * Must hold p->lock and next->lock, and nothing else. p must already be SLEEPING:
+ *  it is not queued again here.
+ *
+ * @return 0 once the current process is woken up again, with p->lock held (next->lock has been
+ *  released by whoever ran next), or -1 if @next can't run here right now: nothing is changed,
+ *  and the caller has to wake @next up as usual.
+ */
+int sched_handoff(struct proc *next) {
+    struct proc *p = curr_proc();
+    struct cpu *c  = mycpu();
+    int interrupt_on;
+
+    assert(holding(&p->lock));
+    assert(holding(&next->lock));
+    assert(p->state == SLEEPING && next->state == SLEEPING);
+    if (c->noff != 2)
+        panic("holding another locks");
+    if (c->inkernel_trap)
+        panic("sched should never be called in kernel trap context.");
+    // someone else is due to run here: let the scheduler decide.
+    if (c->need_resched || !cpu_allowed(next, c->cpuid))
+        return -1;
+
+    fpu_switch_out(p);
+    vec_switch_out(p);
+    acquire(&c->rq.lock);
+    int moved = put_prev_task(&c->rq, p);
+    assert(!moved);
+    if (!rt_task(next))
+        place_task(&c->rq, next);
+    release(&c->rq.lock);
+
+    debugf("handoff from %d(%d) to %d(%d)", p->index, p->pid, next->index, next->pid);
+    interrupt_on = c->interrupt_on;
+    c->rq.handoffs++;
+    next->state = RUNNABLE;
+    set_next_task(c, next);
+    c->switch_from = p;
+    swtch(&p->context, &next->context);
+
+    // we may be running on another cpu now.
+    finish_switch();
+    mycpu()->interrupt_on = interrupt_on;
+    assert(holding(&p->lock));
+    return 0;
+}
+
+// Ask the running process of @c to give up the cpu at its next preemption point.
+// Interrupts must be off.
+void resched_curr(struct cpu *c) {
+    if (!c->need_resched) {
+        c->need_resched = 1;
+        c->resched_time = r_time();
+    }
+}
+
+// Should a long loop holding locks let interrupts in? Interrupts must be off.
+// A pending tick may end the timeslice, so it counts as a reschedule request.
+int resched_pending() {
+    return mycpu()->need_resched || (r_sip() & (SIP_STIP | SIP_SSIP));
+}
+
+/**
+ * @brief Preempt the current process if it has been asked to and can be.
+ *
+ * Called with interrupts off and no lock held, where interrupts are about to be enabled.
+ * @return 1 if we have given up the cpu, and maybe come back on another one.
+ */
+int preempt_schedule() {
+    assert(!intr_get());
+    struct cpu *c  = mycpu();
+    struct proc *p = c->proc;
+
+    if (p == NULL || !c->need_resched || c->noff != 0 || c->inkernel_trap || p->preempt_count > 0)
+        return 0;
+    c->rq.preemptions++;
+    yield();
+    return 1;
+}
+
+// Called at the end of kernel_trap(), the interrupted kernel code holds no lock.
+void preempt_schedule_irq() {
+    // other processes will take traps while we are switched out.
+    uint64 sepc    = r_sepc();
+    uint64 sstatus = r_sstatus();
+    if (!preempt_schedule())
+        return;
+    // but FS and VS are per-hart state, keep them as they are now.
+    uint64 mask = SSTATUS_SPP | SSTATUS_SPIE | SSTATUS_SUM;
+    w_sepc(sepc);
+    w_sstatus((r_sstatus() & ~mask) | (sstatus & mask));
+}
+
+void preempt_disable() {
+    struct proc *p = curr_proc();
+    p->preempt_count++;
+}
+
+void preempt_enable() {
+    struct proc *p = curr_proc();
+    assert(p->preempt_count > 0);
+    if (--p->preempt_count == 0)
+        cond_resched();
+}
+
+// A preemption point for long loops which hold no lock.
+void cond_resched() {
+    int intr = intr_off();
+    preempt_schedule();
+    if (intr)
+        intr_on();
+}
+
+/**
+ * @brief A preemption point for long loops holding @lk, and no other lock.
+ *
+ * If a reschedule or an interrupt is pending, drop @lk: pop_off() lets the interrupt in
+ *  and gives up the cpu if needed. The caller must be ready to see the state protected
+ *  by @lk change.
+ * @return 1 if @lk has been dropped and taken again.
+ */
+int cond_resched_lock(spinlock_t *lk) {
+    assert(holding(lk));
+    if (mycpu()->noff != 1 || !resched_pending())
+        return 0;
+    release(lk);
+    acquire(lk);
+    return 1;
+}
+
 // Give up the CPU for one scheduling round.
 void yield() {
     struct proc *p = curr_proc();
@@ -138,3 +1026,130 @@ void yield() {
     sched();
     release(&p->lock);
 }
+
+int64 sys_schedstat(int cpu, uint64 __user stat) {
+    struct proc *p = curr_proc();
+    struct cpu_sched_stat st;
+
+    if (cpu < 0 || cpu >= NCPU)
+        return -EINVAL;
+
+    struct rq *rq   = &getcpu(cpu)->rq;
+    st.nr_running   = rq->nr_running;
+    st.load         = rq->load;
+    st.min_vruntime = rq->min_vruntime;
+    st.nr_switches = rq->nr_switches;
+    st.steals      = rq->steals;
+    st.migrations  = rq->migrations;
+    st.balanced    = rq->balanced;
+    st.direct_switches = rq->direct_switches;
+    st.preemptions     = rq->preemptions;
+    st.max_latency     = rq->max_latency;
+    st.nr_rt_running   = rq->rt.nr_running;
+    st.rt_throttled    = rq->rt_throttled;
+    st.handoffs        = rq->handoffs;
+    st.timer_irqs      = getcpu(cpu)->timer_irqs;
+
+    acquire(&p->mm->lock);
+    int ret = copy_to_user(p->mm, stat, (char *)&st, sizeof(st));
+    release(&p->mm->lock);
+    return ret;
+}
+
+// Initialize the scheduling state of a new process, @parent is NULL for init.
+void sched_proc_init(struct proc *p, struct proc *parent) {
+    p->vruntime         = 0;  // no lag
+    p->sum_exec_runtime = 0;
+    p->nice             = parent ? parent->nice : 0;
+    p->weight           = nice_to_weight[p->nice + 20];
+    p->preempt_count    = 0;
+    p->policy           = parent ? parent->policy : SCHED_NORMAL;
+    p->rt_priority      = parent ? parent->rt_priority : 0;
+    p->rt_slice         = 0;
+    p->sched_pending    = 0;
+    p->cpus_allowed     = parent ? parent->cpus_allowed : housekeeping_cpus();
+}
+
+// setpriority(pid, nice): pid 0 means the calling process.
+int64 sys_setpriority(int pid, int nice) {
+    if (nice < NICE_MIN || nice > NICE_MAX)
+        return -EINVAL;
+    if (pid == 0)
+        pid = curr_proc()->pid;
+
+    struct proc *p = findproc(pid);
+    if (p == NULL)
+        return -EINVAL;
+    p->nice = nice;
+    // a queued process keeps its weight until it is switched to, see scheduler().
+    if (p->state != RUNNABLE)
+        p->weight = nice_to_weight[nice + 20];
+    release(&p->lock);
+    return 0;
+}
+
+// sched_setscheduler(pid, policy, priority): pid 0 means the calling process.
+int64 sys_sched_setscheduler(int pid, int policy, int priority) {
+    if (policy == SCHED_NORMAL) {
+        if (priority != 0)
+            return -EINVAL;
+    } else if ((policy != SCHED_FIFO && policy != SCHED_RR) || priority < RT_PRIO_MIN || priority > RT_PRIO_MAX) {
+        return -EINVAL;
+    }
+    if (pid == 0)
+        pid = curr_proc()->pid;
+
+    struct proc *p = findproc(pid);
+    if (p == NULL)
+        return -EINVAL;
+    if (p->state == RUNNABLE || p->state == RUNNING) {
+        // a queued process sits in a queue of its current class, on a cpu we don't know,
+        //  and a running one is accounted by its cpu under rq->lock, see update_curr().
+        //  Its cpu applies the change when it next picks it, see set_next_task() and sched().
+        p->pending_policy      = policy;
+        p->pending_rt_priority = priority;
+        p->sched_pending       = 1;
+        if (p->state == RUNNING) {
+            push_off();
+            if (p->last_cpu == cpuid())
+                resched_curr(mycpu());
+            else
+                smp_send_reschedule(p->last_cpu);
+            pop_off();
+        }
+    } else {
+        set_scheduler(NULL, p, policy, priority);
+    }
+    release(&p->lock);
+    return 0;
+}
+
+// sched_setaffinity(pid, mask): pid 0 means the calling process.
+int64 sys_sched_setaffinity(int pid, uint64 mask) {
+    uint64 online = 0;
+    for (int i = 0; i < NCPU; i++) {
+        if (getcpu(i)->online)
+            online |= 1ull << i;
+    }
+    mask &= online;
+    if (mask == 0)
+        return -EINVAL;
+    if (pid == 0)
+        pid = curr_proc()->pid;
+
+    struct proc *p = findproc(pid);
+    if (p == NULL)
+        return -EINVAL;
+    p->cpus_allowed = mask;
+    // a queued process is moved when its cpu picks it, see scheduler().
+    if (p->state == RUNNING && !cpu_allowed(p, p->last_cpu)) {
+        push_off();
+        if (p->last_cpu == cpuid())
+            resched_curr(mycpu());
+        else
+            smp_send_reschedule(p->last_cpu);
+        pop_off();
+    }
+    release(&p->lock);
+    return 0;
+}
@@ -0,0 +1,71 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+// This file is shared by Kernel and User-space application.
+
+#include "types.h"
+
+// setpriority(pid, nice): nice value of a process, inherited by forked children.
+//  Each nice level is about 10% of CPU time.
+#define NICE_MIN (-20)
+#define NICE_MAX (19)
+
+// sched_setscheduler(pid, policy, priority): scheduling class of a process, inherited by forked children.
+//  A runnable SCHED_FIFO or SCHED_RR process always runs before SCHED_NORMAL ones, and before
+//  real-time processes of lower priority. SCHED_FIFO runs until it blocks or yields,
+//  SCHED_RR goes behind its peers of the same priority after each timeslice.
+//  Real-time processes get at most 95% of a cpu while normal processes are waiting, see sched.c.
+#define SCHED_NORMAL (0)  // fair share, priority must be 0
+#define SCHED_FIFO   (1)
+#define SCHED_RR     (2)
+#define RT_PRIO_MIN  (1)
+#define RT_PRIO_MAX  (99)
+
+// sched_setaffinity(pid, mask): bit i of mask allows the process on cpu i, inherited by forked children.
+//  Offline cpus are ignored, an empty mask is -EINVAL.
+//  By default processes run on every cpu but the isolated ones (ISOLCPUS at build time),
+//  which only run the processes explicitly bound to them.
+
+// schedstat(cpu, stat): per-CPU run queue counters.
+struct cpu_sched_stat {
+    uint64 nr_running;    // processes in the run queue
+    uint64 load;          // sum of their weights
+    uint64 min_vruntime;  // in cycles
+    uint64 nr_switches;  // processes switched to
+    uint64 steals;       // processes stolen from other CPUs when idle
+    uint64 migrations;   // processes that last ran on another CPU
+    uint64 balanced;     // processes pulled by periodic load balancing
+    uint64 direct_switches;  // of nr_switches, done by sched() without going through the scheduler
+    uint64 preemptions;      // processes preempted in kernel mode
+    uint64 max_latency;      // in cycles, longest delay from a reschedule request to the switch
+    uint64 nr_rt_running;    // real-time processes in the run queue, not counted in nr_running
+    uint64 rt_throttled;     // times real-time processes have used up their share of a period
+    uint64 handoffs;         // of nr_switches, IPC calls and replies switching straight to the partner
+    uint64 timer_irqs;       // timer interrupts taken, few while the tick is stopped
+};
+
+// kernel interfaces, see sched.c
+struct proc;
+struct cpu;
+struct spinlock;
+void sched_proc_init(struct proc *p, struct proc *parent);
+int sched_grow(int nr_procs);
+int sched_tick();
+void finish_switch();
+int sched_handoff(struct proc *next);
+void resched_curr(struct cpu *c);
+int resched_pending();
+int preempt_schedule();
+void preempt_schedule_irq();
+void preempt_disable();
+void preempt_enable();
+void cond_resched();
+int cpu_isolated(int cpu);
+uint64 housekeeping_cpus();
+int cond_resched_lock(struct spinlock *lk);
+int64 sys_schedstat(int cpu, uint64 stat);
+int64 sys_setpriority(int pid, int nice);
+int64 sys_sched_setscheduler(int pid, int policy, int priority);
+int64 sys_sched_setaffinity(int pid, uint64 mask);
+
+#endif  // __SCHED_H__
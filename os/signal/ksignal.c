@@ -96,6 +96,14 @@ if (act->sa_sigaction != SIG_IGN) {
     struct trapframe *tf = p->trapframe;
     uint64 user_sp = tf->sp;
 
+    // leave the restartable sequence we are in before saving the registers, see rseq.c
+    // don't take p->lock under mm->lock: the OOM killer takes them the other way.
+    if (rseq_signal_deliver(p) < 0) {
+        release(&p->mm->lock);
+        setkilled(p, -2);
+        return -1;
+    }
+
     // 分配空间：siginfo_t + ucontext，16字节对齐
     user_sp -= sizeof(siginfo_t) + sizeof(struct ucontext);
     user_sp &= ~0xf;
@@ -300,36 +308,32 @@ int sys_sigkill(int pid, int signo, int code) {
         return -1;
     }
 
-    // 2. 遍历进程表查找目标进程
-    struct proc *p;
-    for (int i = 0; i < NPROC; i++) {
-        p = pool[i];
-        // 3. 检查进程有效性（非UNUSED状态且PID匹配）
-        if (p->state != UNUSED && p->pid == pid) {
-            // 4. 特殊处理SIGKILL信号（不可阻塞/忽略）
-            if (signo == SIGKILL) {
-                setkilled(p, -10 - signo);  // 强制终止进程
-                return 0;
-            }
-
-            // //5. 检查信号是否被忽略
-            // if (p->signal.handlers[signo].sa_sigaction == SIG_IGN) {
-            //     return 0;
-            // }
-
-            // 6. 添加到pending信号集
-            sigaddset(&p->signal.sigpending, signo);
+    // 2. 查找目标进程（返回时持有 p->lock）
+    struct proc *p = findproc(pid);
+    // 3. 未找到目标进程
+    if (p == NULL) {
+        return -1;
+    }
 
-            // 7. 唤醒睡眠中的进程（模拟wakeup行为）
-            if (p->state == SLEEPING) {
-                wakeup(p);
-                p->state = RUNNABLE;
-            }
+    if (signo == SIGKILL) {
+        // 4. 特殊处理SIGKILL信号（不可阻塞/忽略）
+        p->killed = -10 - signo;  // 强制终止进程
+    } else {
+        // //5. 检查信号是否被忽略
+        // if (p->signal.handlers[signo].sa_sigaction == SIG_IGN) {
+        //     return 0;
+        // }
+
+        // 6. 添加到pending信号集
+        sigaddset(&p->signal.sigpending, signo);
+    }
 
-            return 0;
-        }
+    // 7. 唤醒睡眠中的进程，和 kill() 一样
+    if (p->state == SLEEPING) {
+        p->state = RUNNABLE;
+        add_task(p);
     }
+    release(&p->lock);
 
-    // 8. 未找到目标进程
-    return -1;
+    return 0;
 }
@@ -1,6 +1,7 @@
 #include "defs.h"
 #include "log.h"
 #include "proc.h"
+#include "sbi.h"
 #include "string.h"
 
 static struct cpu cpus[NCPU];
@@ -15,4 +16,112 @@ struct cpu* mycpu() {
 struct cpu* getcpu(int i) {
     assert(i >= 0 && i < NCPU);
     return &cpus[i];
-}
\ No newline at end of file
+}
+// Inter-Processor Interrupts.
+//
+// An IPI is a supervisor software interrupt sent through SBI. The reason is
+//  or-ed into the target's cpu->ipi_pending before the interrupt is sent,
+//  and the target clears SSIP before it takes the reasons, so none is lost.
+
+#define IPI_RESCHEDULE (1 << 0)
+#define IPI_CALL_FUNC  (1 << 1)
+
+// smp_call_function() is serialized by call_lock.
+static int64 call_lock;
+static struct {
+    void (*func)(void *);
+    void *info;
+    volatile int pending;  // cpus which have not run func yet
+} call_data;
+
+static void send_ipi(int cpu, int reason) {
+    struct cpu *c = getcpu(cpu);
+    __sync_fetch_and_or(&c->ipi_pending, reason);
+    sbi_send_ipi(1ul << c->mhart_id, 0);
+}
+
+// Called at SupervisorSoft interrupts.
+void handle_ipi() {
+    struct cpu *c = mycpu();
+
+    w_sip(r_sip() & ~SIP_SSIP);
+    uint64 pending = __sync_lock_test_and_set(&c->ipi_pending, 0);
+
+    if (pending & IPI_CALL_FUNC) {
+        call_data.func(call_data.info);
+        __sync_fetch_and_sub(&call_data.pending, 1);
+    }
+    if (pending & IPI_RESCHEDULE)
+        resched_curr(c);
+}
+
+// Other online cpus in @cpumask.
+static uint64 remote_cpus(uint64 cpumask) {
+    uint64 mask = 0;
+    for (int i = 0; i < NCPU; i++) {
+        if ((cpumask & (1ull << i)) && i != cpuid() && getcpu(i)->online)
+            mask |= 1ull << i;
+    }
+    return mask;
+}
+
+// Make @cpu go through scheduler() soon: an idle cpu wakes up from wfi,
+//  and a busy cpu yields when it returns to the user.
+void smp_send_reschedule(int cpu) {
+    send_ipi(cpu, IPI_RESCHEDULE);
+}
+
+/**
+ * @brief Run func(info) on the other online cpus in @cpumask, and wait for them.
+ *
+ * @func runs in interrupt context, it must not sleep or take locks that
+ *  the caller may hold.
+ */
+void smp_call_function(uint64 cpumask, void (*func)(void *), void *info) {
+    push_off();
+    cpumask = remote_cpus(cpumask);
+    if (cpumask == 0) {
+        pop_off();
+        return;
+    }
+
+    // serve the calls sent to us while we are waiting, or two callers could deadlock.
+    while (__sync_lock_test_and_set(&call_lock, 1) != 0) {
+        if (mycpu()->ipi_pending)
+            handle_ipi();
+    }
+
+    call_data.func    = func;
+    call_data.info    = info;
+    call_data.pending = __builtin_popcountll(cpumask);
+    __sync_synchronize();
+    for (int i = 0; i < NCPU; i++) {
+        if (cpumask & (1ull << i))
+            send_ipi(i, IPI_CALL_FUNC);
+    }
+    while (call_data.pending > 0)
+        ;
+
+    __sync_lock_release(&call_lock);
+    pop_off();
+}
+
+static void do_sfence_vma(void *info) {
+    sfence_vma();
+}
+
+// Flush the TLB of all harts, after a kernel mapping has been changed.
+void flush_tlb_remote() {
+    push_off();
+    sfence_vma();
+
+    uint64 cpumask   = remote_cpus(~0ull);
+    uint64 hart_mask = 0;
+    for (int i = 0; i < NCPU; i++) {
+        if (cpumask & (1ull << i))
+            hart_mask |= 1ul << getcpu(i)->mhart_id;
+    }
+    if (hart_mask && sbi_remote_sfence_vma(hart_mask, 0, 0, 0) != 0)
+        smp_call_function(cpumask, do_sfence_vma, NULL);
+    pop_off();
+}
@@ -2,13 +2,26 @@
 
 #include "console.h"
 #include "defs.h"
+#include "compact.h"
+#include "hwprobe.h"
+#include "ipc.h"
+#include "ksm.h"
+#include "rseq.h"
+#include "oom.h"
+#include "sched.h"
+#include "wss.h"
 #include "ktest/ktest.h"
 #include "loader.h"
 #include "timer.h"
 #include "trap.h"
 
 int64 sys_fork() {
-    return fork();
+    int64 ret;
+    uint64 oom = oom_begin();
+    do {
+        ret = fork();
+    } while (oom_retry(ret, &oom));
+    return ret;
 }
 
 int64 sys_exec(uint64 __user path, uint64 __user argv) {
@@ -46,7 +59,10 @@ int64 sys_exec(uint64 __user path, uint64 __user argv) {
 
     debugf("sys_exec %s\n", kpath);
 
-    ret = exec(kpath, arg);
+    uint64 oom = oom_begin();
+    do {
+        ret = exec(kpath, arg);
+    } while (oom_retry(ret, &oom));
 
     kfree(&kstrbuf, kpath);
     for (int i = 0; arg[i]; i++) {
@@ -105,29 +121,146 @@ int64 sys_sleep(int64 n) {
     struct proc *p = curr_proc();
 
     acquire(&tickslock);
+    tick_update_locked();
     uint64 ticks0 = ticks;
-    while (ticks - ticks0 < n) {
-        if (iskilled(p)) {
-            release(&tickslock);
-            return -1;
+    release(&tickslock);
+    if (n <= 0)
+        return 0;
+    return tick_sleep(ticks0 + n);
+}
+
+int64 sys_clock_gettime(int clockid, uint64 __user tp) {
+    struct proc *p = curr_proc();
+    struct timespec ts;
+    int ret;
+
+    if (clockid != CLOCK_REALTIME && clockid != CLOCK_MONOTONIC)
+        return -EINVAL;
+    cycles_to_timespec(clock_monotonic(), &ts);
+
+    acquire(&p->mm->lock);
+    ret = copy_to_user(p->mm, tp, (char *)&ts, sizeof(ts));
+    release(&p->mm->lock);
+    return ret;
+}
+
+int64 sys_gettimeofday(uint64 __user tv) {
+    struct proc *p = curr_proc();
+    struct timespec ts;
+    TimeVal val;
+    int ret;
+
+    cycles_to_timespec(clock_monotonic(), &ts);
+    val.sec  = ts.tv_sec;
+    val.usec = ts.tv_nsec / NSEC_PER_USEC;
+
+    acquire(&p->mm->lock);
+    ret = copy_to_user(p->mm, tv, (char *)&val, sizeof(val));
+    release(&p->mm->lock);
+    return ret;
+}
+
+int64 sys_nanosleep(uint64 __user req, uint64 __user rem) {
+    struct proc *p = curr_proc();
+    struct timespec ts;
+    int ret;
+
+    acquire(&p->mm->lock);
+    ret = copy_from_user(p->mm, (char *)&ts, req, sizeof(ts));
+    release(&p->mm->lock);
+    if (ret < 0)
+        return ret;
+    if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= NSEC_PER_SEC)
+        return -EINVAL;
+
+    // saturate: a sleep too long for the clock lasts until we are killed.
+    uint64 now     = get_cycle();
+    uint64 len     = timespec_to_cycles(&ts);
+    uint64 expires = len < ~0ull - now ? now + len : ~0ull;
+    uint64 slack   = ns_to_cycles(p->timer_slack_ns);
+    if (hrtimer_sleep(expires, slack < ~0ull - expires ? expires + slack : ~0ull) == 0)
+        return 0;
+
+    // killed: tell the user how much is left.
+    if (rem) {
+        now = get_cycle();
+        cycles_to_timespec(now < expires ? expires - now : 0, &ts);
+        acquire(&p->mm->lock);
+        copy_to_user(p->mm, rem, (char *)&ts, sizeof(ts));
+        release(&p->mm->lock);
+    }
+    return -1;
+}
+
+// Set the timer slack of the current process if @ns >= 0, return the previous one.
+int64 sys_timer_slack(int64 ns) {
+    struct proc *p = curr_proc();
+
+    acquire(&p->lock);
+    int64 old = p->timer_slack_ns;
+    if (ns >= 0)
+        p->timer_slack_ns = ns;
+    release(&p->lock);
+    return old;
+}
+
+int64 sys_riscv_hwprobe(uint64 upairs, uint64 count) {
+    struct mm *mm = curr_proc()->mm;
+    struct riscv_hwprobe pair;
+    int ret;
+
+    for (uint64 i = 0; i < count; i++) {
+        uint64 addr = upairs + i * sizeof(pair);
+        acquire(&mm->lock);
+        ret = copy_from_user(mm, (char *)&pair, addr, sizeof(pair));
+        release(&mm->lock);
+        if (ret < 0)
+            return ret;
+
+        switch (pair.key) {
+            case RISCV_HWPROBE_KEY_BASE_BEHAVIOR:
+                pair.value = RISCV_HWPROBE_BASE_BEHAVIOR_IMA;
+                break;
+            case RISCV_HWPROBE_KEY_IMA_EXT_0:
+                pair.value = RISCV_HWPROBE_IMA_FD | (vlenb ? RISCV_HWPROBE_IMA_V : 0);
+                break;
+            case RISCV_HWPROBE_KEY_VLENB:
+                pair.value = vlenb;
+                break;
+            default:
+                pair.key   = -1;
+                pair.value = 0;
         }
-        sleep(&ticks, &tickslock);
+
+        acquire(&mm->lock);
+        ret = copy_to_user(mm, addr, (char *)&pair, sizeof(pair));
+        release(&mm->lock);
+        if (ret < 0)
+            return ret;
     }
-    release(&tickslock);
     return 0;
 }
 
 int64 sys_yield() {
+    // a real-time process goes behind its peers of the same priority.
+    struct proc *p = curr_proc();
+    acquire(&p->lock);
+    if (p->policy != SCHED_NORMAL)
+        p->rt_slice = 0;
+    release(&p->lock);
     yield();
     return 0;
 }
 
-int64 sys_sbrk(int64 n) {
+static int64 do_sbrk(int64 n) {
     int64 ret;
     struct proc *p = curr_proc();
 
+    // only we change our mm and brk: hold just the mm lock, so that mm_remap() can be preempted.
     acquire(&p->lock);
-    acquire(&p->mm->lock);
+    struct mm *mm = p->mm;
+    acquire(&mm->lock);
+    release(&p->lock);
 
     struct vma *vma_brk = p->vma_brk;
     int64 old_brk       = p->brk;
@@ -148,8 +281,7 @@ int64 sys_sbrk(int64 n) {
         }
     }
 
-    release(&p->mm->lock);
-    release(&p->lock);
+    release(&mm->lock);
 
     if (ret == 0) {
         return old_brk;
@@ -157,6 +289,15 @@ int64 sys_sbrk(int64 n) {
     return ret;
 }
 
+int64 sys_sbrk(int64 n) {
+    int64 ret;
+    uint64 oom = oom_begin();
+    do {
+        ret = do_sbrk(n);
+    } while (oom_retry(ret, &oom));
+    return ret;
+}
+
 int64 sys_mmap() {
     panic("unimplemented");
 }
@@ -203,6 +344,18 @@ void syscall() {
         case SYS_yield:
             ret = sys_yield();
             break;
+        case SYS_gettimeofday:
+            ret = sys_gettimeofday(args[0]);
+            break;
+        case SYS_clock_gettime:
+            ret = sys_clock_gettime(args[0], args[1]);
+            break;
+        case SYS_nanosleep:
+            ret = sys_nanosleep(args[0], args[1]);
+            break;
+        case SYS_timer_slack:
+            ret = sys_timer_slack(args[0]);
+            break;
         case SYS_sbrk:
             ret = sys_sbrk(args[0]);
             break;
@@ -215,6 +368,42 @@ void syscall() {
         case SYS_write:
             ret = sys_write(args[0], args[1], args[2]);
             break;
+        case SYS_ksmctl:
+            ret = sys_ksmctl(args[0], args[1]);
+            break;
+        case SYS_wssctl:
+            ret = sys_wssctl(args[0], args[1]);
+            break;
+        case SYS_compactctl:
+            ret = sys_compactctl(args[0], args[1]);
+            break;
+        case SYS_oom_score_adj:
+            ret = sys_oom_score_adj(args[0], args[1]);
+            break;
+        case SYS_schedstat:
+            ret = sys_schedstat(args[0], args[1]);
+            break;
+        case SYS_setpriority:
+            ret = sys_setpriority(args[0], args[1]);
+            break;
+        case SYS_sched_setscheduler:
+            ret = sys_sched_setscheduler(args[0], args[1], args[2]);
+            break;
+        case SYS_sched_setaffinity:
+            ret = sys_sched_setaffinity(args[0], args[1]);
+            break;
+        case SYS_rseq:
+            ret = sys_rseq(args[0], args[1], args[2], args[3]);
+            break;
+        case SYS_riscv_hwprobe:
+            ret = sys_riscv_hwprobe(args[0], args[1]);
+            break;
+        case SYS_ipc_call:
+            ret = sys_ipc_call(args[0]);
+            break;
+        case SYS_ipc_reply_wait:
+            ret = sys_ipc_reply_wait(args[0]);
+            break;
         case SYS_ktest:
             ret = ktest_syscall(args);
             break;
@@ -19,6 +19,9 @@
 #define SYS_write 23
 
 #define SYS_gettimeofday 24
+#define SYS_clock_gettime 25
+#define SYS_nanosleep 26
+#define SYS_timer_slack 27
 #define SYS_ktest 99
 
 #define SYS_sigaction 30
@@ -26,3 +29,19 @@
 #define SYS_sigprocmask 32
 #define SYS_sigkill 33
 #define SYS_sigpending 34
+
+#define SYS_ksmctl 40
+#define SYS_wssctl 41
+#define SYS_compactctl 42
+#define SYS_oom_score_adj 43
+
+#define SYS_schedstat 50
+#define SYS_setpriority 51
+#define SYS_sched_setscheduler 52
+#define SYS_sched_setaffinity 53
+#define SYS_rseq 54
+
+#define SYS_riscv_hwprobe 60
+
+#define SYS_ipc_call 70
+#define SYS_ipc_reply_wait 71
@@ -1,28 +1,364 @@
 #include "timer.h"
 
+#include "defs.h"
 #include "riscv.h"
 #include "sbi.h"
+#include "trap.h"
 
 extern int on_vf2_board;
 
+// Dynamic ticks:
+//  `ticks` is derived from the monotonic `time` CSR, so it stays correct however
+//  rarely the timer fires. A hart only takes a periodic tick when it needs one:
+//  to preempt its current process when other processes are queued on it. Otherwise the
+//  tick is stopped, and the timer is programmed for the earliest timer pending on this
+//  hart, bounded by MAX_IDLE_TICKS.
+//  Background scanners run in kscand, a process like the others, so an isolated hart
+//  running its one bound process takes no tick at all.
+//
+// Timer wheel:
+//  Each hart keeps its pending timers in a hierarchical wheel of WHEEL_LEVELS levels.
+//  Slots of level L are (1 << (L * WHEEL_BITS)) ticks wide. A timer is put at the lowest level
+//  which covers its expiry, and moved down (cascaded) when the wheel reaches its slot,
+//  so adding, deleting and firing a timer are all O(1).
+//
+// High-resolution timers:
+//  nanosleep() needs a finer resolution than ticks. hrtimers are kept in a per-hart list
+//  sorted by their hard expiry, which the hart's timer is programmed for. When it fires,
+//  every hrtimer whose soft expiry has passed is run, that's how timer slack coalesces them.
+
+#define TICK_CYCLES    (CPU_FREQ / TICKS_PER_SEC)
+#define MAX_IDLE_TICKS (100)
+
+#define WHEEL_BITS   (6)
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS (4)
+#define WHEEL_MAX    ((1ull << (WHEEL_LEVELS * WHEEL_BITS)) - 1)  // farthest expiry from clk
+
+struct timer_base {
+    spinlock_t lock;
+    uint64 clk;          // next tick to process
+    uint64 next_expiry;  // earliest pending expiry, may be early but never late
+    int nr_timers;
+    struct timer_list *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+    struct hrtimer *hrtimers;  // sorted by expires
+    uint64 hr_next;            // expires of the first hrtimer, may be early but never late
+};
+
+static struct timer_base timer_bases[NCPU];
+
+static uint64 boot_time;  // `time` at boot, ticks are counted from it
+
 /// read the `mtime` regiser
 uint64 get_cycle() {
     return r_time();
 }
 
+static void program_timer(uint64 when) {
+    if (on_vf2_board) {
+        set_timer(when);
+    } else {
+        w_stimecmp(when);
+    }
+}
+
 /// Enable timer interrupt
 void timer_init() {
+    __sync_bool_compare_and_swap(&boot_time, 0, r_time());
+    struct timer_base *base = &timer_bases[cpuid()];
+    spinlock_init(&base->lock, "timer_base");
+    base->next_expiry = ~0ull;
+    base->hr_next     = ~0ull;
     // Enable supervisor timer interrupt
     w_sie(r_sie() | SIE_STIE);
     set_next_timer();
 }
 
-// /// Set the next timer interrupt
+// Bring `ticks` up to date.
+// tickslock must be held.
+void tick_update_locked() {
+    assert(holding(&tickslock));
+
+    uint64 now = (r_time() - boot_time) / TICK_CYCLES;
+    if (now > ticks)
+        ticks = now;
+}
+
+static void enqueue_timer(struct timer_base *base, struct timer_list *t) {
+    assert(holding(&base->lock));
+
+    // an expired timer fires at the next tick, a far one is cascaded again when its slot comes.
+    uint64 when  = MIN(MAX(t->expires, base->clk), base->clk + WHEEL_MAX);
+    uint64 delta = when - base->clk;
+    int level    = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ull << ((level + 1) * WHEEL_BITS))) level++;
+
+    struct timer_list **slot = &base->wheel[level][(when >> (level * WHEEL_BITS)) & WHEEL_MASK];
+    t->next                  = *slot;
+    if (*slot)
+        (*slot)->pprev = &t->next;
+    t->pprev = slot;
+    *slot    = t;
+}
+
+static void detach_timer(struct timer_list *t) {
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next  = NULL;
+    t->pprev = NULL;
+}
+
+// Add @t to the wheel of this hart. t->expires and t->func must be set.
+void add_timer(struct timer_list *t) {
+    push_off();
+    struct timer_base *base = &timer_bases[cpuid()];
+    acquire(&base->lock);
+    t->base = base;
+    enqueue_timer(base, t);
+    base->nr_timers++;
+    if (t->expires < base->next_expiry)
+        base->next_expiry = t->expires;
+    release(&base->lock);
+    pop_off();
+}
+
+// Returns 1 if @t was pending, 0 if it has already fired.
+int del_timer(struct timer_list *t) {
+    struct timer_base *base = t->base;
+    int pending             = 0;
+
+    acquire(&base->lock);
+    if (t->pprev) {
+        detach_timer(t);
+        base->nr_timers--;
+        pending = 1;
+    }
+    release(&base->lock);
+    return pending;
+}
+
+// Move the timers of one slot of @level to the levels below.
+static void cascade(struct timer_base *base, int level, int index) {
+    struct timer_list *t = base->wheel[level][index];
+    base->wheel[level][index] = NULL;
+    while (t) {
+        struct timer_list *next = t->next;
+        enqueue_timer(base, t);
+        t = next;
+    }
+}
+
+// Earliest expiry in the wheel: the first non-empty slot of each level holds the earliest timers of that level.
+static uint64 next_expiry_locked(struct timer_base *base) {
+    uint64 next = ~0ull;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift  = level * WHEEL_BITS;
+        uint64 pos = base->clk >> shift;
+        for (int i = (level == 0 ? 0 : 1); i <= WHEEL_SIZE; i++) {
+            struct timer_list *t = base->wheel[level][(pos + i) & WHEEL_MASK];
+            if (t == NULL)
+                continue;
+            for (; t; t = t->next) next = MIN(next, t->expires);
+            break;
+        }
+    }
+    return next;
+}
+
+// Fire the timers of this hart which expire at or before @now.
+static void run_timers(struct timer_base *base, uint64 now) {
+    acquire(&base->lock);
+    if (base->nr_timers == 0 && base->clk <= now)
+        base->clk = now + 1;
+
+    while (base->clk <= now) {
+        int index = base->clk & WHEEL_MASK;
+        // cascade the higher levels when the lower one wraps around.
+        for (int level = 1; level < WHEEL_LEVELS && (base->clk >> ((level - 1) * WHEEL_BITS) & WHEEL_MASK) == 0; level++)
+            cascade(base, level, (base->clk >> (level * WHEEL_BITS)) & WHEEL_MASK);
+
+        struct timer_list *t;
+        while ((t = base->wheel[0][index]) != NULL) {
+            void (*func)(struct timer_list *) = t->func;
+            detach_timer(t);
+            base->nr_timers--;
+            // once detached, @t may be gone as soon as we release the lock.
+            release(&base->lock);
+            func(t);
+            acquire(&base->lock);
+        }
+        base->clk++;
+    }
+    base->next_expiry = next_expiry_locked(base);
+    release(&base->lock);
+}
+
+static void process_timeout(struct timer_list *t) {
+    wakeup(t);
+}
+
+/**
+ * @brief Sleep until `ticks` reaches @deadline.
+ *
+ * Returns 0, or -1 if the current process has been killed.
+ */
+int tick_sleep(uint64 deadline) {
+    struct proc *p = curr_proc();
+    struct timer_list t;
+
+    t.expires = deadline;
+    t.func    = process_timeout;
+    add_timer(&t);
+
+    // we may run on another hart after the first sleep, but the timer stays on its wheel.
+    struct timer_base *base = t.base;
+    acquire(&base->lock);
+    while (t.pprev != NULL && !iskilled(p)) sleep(&t, &base->lock);
+    release(&base->lock);
+    // killed, the timer may still be pending on any level of the wheel.
+    del_timer(&t);
+    return iskilled(p) ? -1 : 0;
+}
+
+// Time since boot, in cycles of the `time` CSR.
+uint64 clock_monotonic() {
+    return r_time() - boot_time;
+}
+
+// Saturates at ~0: a time too far away must never come, not wrap around to the past.
+uint64 timespec_to_cycles(const struct timespec *ts) {
+    if ((uint64)ts->tv_sec >= ~0ull / CPU_FREQ - 1)
+        return ~0ull;
+    // round up, we never sleep too short.
+    return ts->tv_sec * CPU_FREQ + (ts->tv_nsec * CPU_FREQ + NSEC_PER_SEC - 1) / NSEC_PER_SEC;
+}
+
+// Doesn't overflow for any @ns.
+uint64 ns_to_cycles(uint64 ns) {
+    return ns / NSEC_PER_SEC * CPU_FREQ + ns % NSEC_PER_SEC * CPU_FREQ / NSEC_PER_SEC;
+}
+
+void cycles_to_timespec(uint64 cycles, struct timespec *ts) {
+    ts->tv_sec  = cycles / CPU_FREQ;
+    ts->tv_nsec = (cycles % CPU_FREQ) * NSEC_PER_SEC / CPU_FREQ;
+}
+
+// Start @t on this hart. t->softexpires, t->expires and t->func must be set.
+void hrtimer_start(struct hrtimer *t) {
+    push_off();
+    struct timer_base *base = &timer_bases[cpuid()];
+    acquire(&base->lock);
+    t->base = base;
+
+    struct hrtimer **pp = &base->hrtimers;
+    while (*pp && (*pp)->expires <= t->expires) pp = &(*pp)->next;
+    t->next = *pp;
+    if (*pp)
+        (*pp)->pprev = &t->next;
+    t->pprev = pp;
+    *pp      = t;
+    base->hr_next = base->hrtimers->expires;
+
+    release(&base->lock);
+    pop_off();
+}
+
+static void detach_hrtimer(struct hrtimer *t) {
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next  = NULL;
+    t->pprev = NULL;
+}
+
+// Returns 1 if @t was pending, 0 if it has already fired.
+int hrtimer_cancel(struct hrtimer *t) {
+    struct timer_base *base = t->base;
+    int pending             = 0;
+
+    acquire(&base->lock);
+    if (t->pprev) {
+        detach_hrtimer(t);
+        pending = 1;
+    }
+    release(&base->lock);
+    return pending;
+}
+
+// Run the hrtimers of this hart whose soft expiry has passed.
+static void run_hrtimers(struct timer_base *base) {
+    acquire(&base->lock);
+    for (;;) {
+        uint64 now        = r_time();
+        struct hrtimer *t = base->hrtimers;
+        while (t && t->softexpires > now) t = t->next;
+        if (t == NULL)
+            break;
+
+        void (*func)(struct hrtimer *) = t->func;
+        detach_hrtimer(t);
+        release(&base->lock);
+        func(t);
+        acquire(&base->lock);
+    }
+    base->hr_next = base->hrtimers ? base->hrtimers->expires : ~0ull;
+    release(&base->lock);
+}
+
+static void hrtimer_wakeup(struct hrtimer *t) {
+    wakeup(t);
+}
+
+/**
+ * @brief Sleep until the `time` CSR reaches some time in [@softexpires, @expires].
+ *
+ * Returns 0, or -1 if the current process has been killed.
+ */
+int hrtimer_sleep(uint64 softexpires, uint64 expires) {
+    struct proc *p = curr_proc();
+    struct hrtimer t;
+
+    t.softexpires = softexpires;
+    t.expires     = expires;
+    t.func        = hrtimer_wakeup;
+    hrtimer_start(&t);
+
+    struct timer_base *base = t.base;
+    acquire(&base->lock);
+    while (t.pprev != NULL && !iskilled(p)) sleep(&t, &base->lock);
+    if (t.pprev)
+        detach_hrtimer(&t);
+    release(&base->lock);
+    return iskilled(p) ? -1 : 0;
+}
+
+/// Program the timer of this hart for the next tick, or stop the tick if it does not need one.
 void set_next_timer() {
-    const uint64 timebase = CPU_FREQ / TICKS_PER_SEC;
-    if (on_vf2_board) {
-        set_timer(get_cycle() + timebase);
-    } else {
-        w_stimecmp(r_time() + timebase);
+    struct cpu *c = mycpu();
+    uint64 now    = (r_time() - boot_time) / TICK_CYCLES;
+    uint64 next   = now + 1;
+    int need_tick = c->rq.nr_running + c->rq.rt.nr_running > 0;
+
+    if (!need_tick) {
+        // timers are only added on this hart by its running process,
+        //  scheduler() calls us again before the next one runs.
+        uint64 expiry = timer_bases[cpuid()].next_expiry;
+        next          = MAX(next, MIN(expiry, now + MAX_IDLE_TICKS));
     }
-}
\ No newline at end of file
+    c->tick_stopped = !need_tick;
+    program_timer(MIN(boot_time + next * TICK_CYCLES, timer_bases[cpuid()].hr_next));
+}
+
+/// Called at timer interrupts, on every hart.
+void timer_tick() {
+    mycpu()->timer_irqs++;
+    acquire(&tickslock);
+    tick_update_locked();
+    uint64 now = ticks;
+    release(&tickslock);
+    run_timers(&timer_bases[cpuid()], now);
+    run_hrtimers(&timer_bases[cpuid()]);
+    set_next_timer();
+}
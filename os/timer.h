@@ -1,6 +1,7 @@
 #ifndef TIMER_H
 #define TIMER_H
 
+#include "clock.h"
 #include "types.h"
 
 #define TICKS_PER_SEC (100)
@@ -10,10 +11,43 @@
 uint64 get_cycle();
 void timer_init();
 void set_next_timer();
+void timer_tick();
+void tick_update_locked();
+int tick_sleep(uint64 deadline);
 
-typedef struct {
-    uint64 sec;   // 自 Unix 纪元起的秒数
-    uint64 usec;  // 微秒数
-} TimeVal;
+// A timer fires once, at the first tick >= expires, on the hart it was added on.
+// func runs in interrupt context without any lock held.
+struct timer_base;
+struct timer_list {
+    uint64 expires;  // in ticks
+    void (*func)(struct timer_list *);
+    struct timer_list *next;
+    struct timer_list **pprev;  // NULL if not pending
+    struct timer_base *base;
+};
+
+void add_timer(struct timer_list *t);
+int del_timer(struct timer_list *t);
+
+// A high-resolution timer fires on the hart it was started on, at any time in
+//  [softexpires, expires], so that nearby timers can share one interrupt.
+// Both are values of the `time` CSR.
+struct hrtimer {
+    uint64 softexpires;
+    uint64 expires;
+    void (*func)(struct hrtimer *);
+    struct hrtimer *next;
+    struct hrtimer **pprev;  // NULL if not pending
+    struct timer_base *base;
+};
+
+void hrtimer_start(struct hrtimer *t);
+int hrtimer_cancel(struct hrtimer *t);
+int hrtimer_sleep(uint64 softexpires, uint64 expires);
+
+uint64 clock_monotonic();
+uint64 timespec_to_cycles(const struct timespec *ts);
+uint64 ns_to_cycles(uint64 ns);
+void cycles_to_timespec(uint64 cycles, struct timespec *ts);
 
 #endif  // TIMER_H
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include "console.h"
 #include "debug.h"
 #include "defs.h"
+#include "ksm.h"
+#include "wss.h"
 #include "loader.h"
 #include "plic.h"
 #include "syscall.h"
@@ -31,18 +33,16 @@ static int handle_intr(void) {
     uint64 code  = cause & SCAUSE_EXCEPTION_CODE_MASK;
     if (code == SupervisorTimer) {
         tracef("time interrupt!");
-        if (cpuid() == 0) {
-            acquire(&tickslock);
-            ticks++;
-            wakeup(&ticks);
-            release(&tickslock);
-        }
-        set_next_timer();
+        timer_tick();
         return 1;
     } else if (code == SupervisorExternal) {
         tracef("s-external interrupt from usertrap!");
         plic_handle();
         return 2;
+    } else if (code == SupervisorSoft) {
+        tracef("inter-processor interrupt!");
+        handle_ipi();
+        return 3;
     } else {
         return 0;
     }
@@ -70,10 +70,14 @@ void kernel_trap(struct ktrapframe *ktf) {
             panic("other CPU has panicked");
         }
         // handle interrupt
-        if (handle_intr() == 0) {
+        int which_dev = handle_intr();
+        if (which_dev == 0) {
             errorf("unhandled interrupt: %d", cause);
             goto kernel_panic;
         }
+        // a tick in a long kernel path may end the timeslice too.
+        if (which_dev == 1 && mycpu()->proc && sched_tick())
+            resched_curr(mycpu());
     } else {
         // kernel exception, unexpected.
         goto kernel_panic;
@@ -84,6 +88,8 @@ void kernel_trap(struct ktrapframe *ktf) {
 
     mycpu()->inkernel_trap--;
 
+    // the interrupted code had interrupts on: it holds no lock and may be preempted.
+    preempt_schedule_irq();
     return;
 
 kernel_panic:
@@ -110,6 +116,8 @@ void set_kerneltrap() {
 void trap_init() {
     set_kerneltrap();
     spinlock_init(&tickslock, "user-time");
+    // Enable supervisor software interrupt, for IPIs.
+    w_sie(r_sie() | SIE_SSIE);
 }
 
 // UserTrap begins
@@ -126,6 +134,17 @@ static void handle_pgfault(void) {
     acquire(&mm->lock);
     release(&p->lock);
     pte = walk(mm, addr, 0);
+
+    // write to a page merged by KSM: give the process its own copy.
+    if (cause == StorePageFault && pte != NULL && (*pte & PTE_V) && (*pte & PTE_U) && (*pte & PTE_KSM)) {
+        uint64 pa = ksm_unmerge(mm, pte);
+        release(&mm->lock);
+        if (pa == 0) {
+            infof("out of memory when un-merging KSM page %p, killed.", addr);
+            setkilled(p, -2);
+        }
+        return;
+    }
     release(&mm->lock);
 
     //	docs: Volume II: RISC-V Privileged Architectures V1.10, Page 61,
@@ -191,6 +210,8 @@ void usertrap() {
         intr_off();
     } else if (cause == LoadPageFault || cause == StorePageFault || cause == InstructionPageFault) {
         handle_pgfault();
+    } else if (cause == IllegalInstruction && (fpu_handle_trap(p) || vec_handle_trap(p, r_stval()))) {
+        // the first FP or vector instruction since we were switched in, retry it.
     } else {
         unknown_trap();
     }
@@ -199,8 +220,14 @@ void usertrap() {
     if ((killed = iskilled(p)) != 0)
         exit(killed);
 
-    // if it's a timer intr, call yield to give up CPU.
-    if (which_dev == 1)
+    // if it's a timer intr, give up the CPU when the timeslice is used up.
+    if (which_dev == 1) {
+        wss_tick(p);
+        if (sched_tick())
+            resched_curr(mycpu());
+    }
+    // or if it has been asked to, by a tick here or in the syscall, or by an IPI.
+    if (mycpu()->need_resched)
         yield();
 
     // prepare for return to user mode
@@ -223,7 +250,14 @@ void usertrapret() {
     if (intr_get())
         panic("usertrapret entered with intr on");
 
-    struct trapframe *trapframe = curr_proc()->trapframe;
+    struct proc *p              = curr_proc();
+    struct trapframe *trapframe = p->trapframe;
+
+    // abort the restartable sequence we may have been preempted in, and update our cpu id.
+    if (p->rseq_pending && rseq_handle_resume(p) < 0) {
+        infof("bad rseq area of process %d, killed.", p->pid);
+        exit(-2);
+    }
 
     // set up trapframe values that uservec will need when
     // the process next traps into the kernel.
@@ -239,6 +273,8 @@ void usertrapret() {
     uint64 x = r_sstatus();
     x &= ~SSTATUS_SPP;  // clear SPP to 0 for user mode
     x |= SSTATUS_SPIE;  // enable interrupts in user mode
+    x = fpu_user_sstatus(curr_proc(), x);
+    x = vec_user_sstatus(curr_proc(), x);
     w_sstatus(x);
 
     // tell trampoline.S the user page table to switch to.
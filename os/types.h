@@ -25,5 +25,7 @@ typedef long int64;
 #define EINVAL 2
 #define ECHILD 3
 #define ENOENT 4
+#define EBUSY  5
+#define EINTR  6
 
 #endif  // TYPES_H
\ No newline at end of file
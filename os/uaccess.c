@@ -11,7 +11,7 @@ int copy_to_user(struct mm *mm, uint64 __user dstva, char *src, uint64 len) {
 
     while (len > 0) {
         va0 = PGROUNDDOWN(dstva);
-        pa0 = walkaddr(mm, va0);
+        pa0 = walkaddr_write(mm, va0);
         if (pa0 == 0)
             return -EINVAL;
         n = PGSIZE - (dstva - va0);
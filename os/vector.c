@@ -0,0 +1,211 @@
+#include "vector.h"
+
+#include "defs.h"
+#include "trap.h"
+
+// Lazy vector context switching.
+//
+// This works like fpu.c, with sstatus.VS in place of FS and cpu->vec_owner in place of
+//  cpu->fpu_owner. The differences:
+//  - The register file is 32 * VLEN bits, up to a page. It is only allocated on the first
+//    vector instruction of a process, so processes that never use V pay nothing for it.
+//  - An IllegalInstruction trap is only taken as a first use if the instruction is a vector one.
+//
+// The kernel is built without V: the save/restore code enables it with `.option arch, +v`.
+
+#define VTYPE_VILL (1ull << 63)
+
+uint64 vlenb;
+
+static inline uint64 vs_state() {
+    return r_sstatus() & SSTATUS_VS;
+}
+
+static inline void set_vs(uint64 vs) {
+    w_sstatus((r_sstatus() & ~SSTATUS_VS) | vs);
+}
+
+// Probe V on the boot hart: sstatus.VS is read-only zero if there are no vector registers.
+void vec_init() {
+    uint64 sstatus = r_sstatus();
+    set_vs(SSTATUS_VS_INIT);
+    if (vs_state() != SSTATUS_VS_OFF)
+        asm volatile(".option push\n .option arch, +v\n csrr %0, vlenb\n .option pop" : "=r"(vlenb));
+    w_sstatus(sstatus);
+
+    if (vlenb * 32 > PGSIZE) {
+        warnf("vector: VLEN %d bits is too large, V is disabled", vlenb * 8);
+        vlenb = 0;
+    }
+    if (vlenb)
+        infof("vector: VLEN %d bits", vlenb * 8);
+}
+
+// VS must not be Off.
+static void vec_save(struct vstate *st) {
+    char *v = st->vregs;
+    asm volatile(
+        ".option push\n .option arch, +v\n"
+        "csrr %0, vstart\n csrr %1, vtype\n csrr %2, vl\n csrr %3, vcsr\n"
+        ".option pop"
+        : "=r"(st->vstart), "=r"(st->vtype), "=r"(st->vl), "=r"(st->vcsr));
+    // whole register stores ignore vtype and vl, but start at vstart.
+    asm volatile(
+        ".option push\n .option arch, +v\n"
+        "csrw vstart, zero\n"
+        "vs8r.v v0, (%0)\n add %0, %0, %1\n"
+        "vs8r.v v8, (%0)\n add %0, %0, %1\n"
+        "vs8r.v v16, (%0)\n add %0, %0, %1\n"
+        "vs8r.v v24, (%0)\n"
+        ".option pop"
+        : "+r"(v)
+        : "r"(vlenb * 8)
+        : "memory");
+}
+
+// VS must not be Off.
+static void vec_restore(struct vstate *st) {
+    char *v = st->vregs;
+    asm volatile(
+        ".option push\n .option arch, +v\n"
+        "csrw vstart, zero\n"
+        "vl8re8.v v0, (%0)\n add %0, %0, %1\n"
+        "vl8re8.v v8, (%0)\n add %0, %0, %1\n"
+        "vl8re8.v v16, (%0)\n add %0, %0, %1\n"
+        "vl8re8.v v24, (%0)\n"
+        ".option pop"
+        : "+r"(v)
+        : "r"(vlenb * 8)
+        : "memory");
+    // vl <= VLMAX of the saved vtype, so vsetvl gives back the same vl.
+    asm volatile(
+        ".option push\n .option arch, +v\n"
+        "vsetvl zero, %0, %1\n csrw vstart, %2\n csrw vcsr, %3\n"
+        ".option pop" ::"r"(st->vl),
+        "r"(st->vtype), "r"(st->vstart), "r"(st->vcsr));
+}
+
+// Is @insn, the faulting instruction from stval, a vector instruction?
+// Some harts leave stval zero on IllegalInstruction, then we have to assume it is.
+static int is_vector_insn(uint64 insn) {
+    if (insn == 0)
+        return 1;
+
+    uint32 opcode = insn & 0x7f;
+    uint32 funct3 = (insn >> 12) & 0x7;
+    uint32 csr    = (insn >> 20) & 0xfff;
+    switch (opcode) {
+        case 0x57:  // OP-V, including vsetvl{i}
+            return 1;
+        case 0x07:  // LOAD-FP and STORE-FP: width 0, 5, 6, 7 are vector loads/stores
+        case 0x27:
+            return funct3 == 0 || funct3 >= 5;
+        case 0x73:  // SYSTEM: accesses to vstart, vxsat, vxrm, vcsr, vl, vtype, vlenb
+            return funct3 != 0 && funct3 != 4 &&
+                   ((0x008 <= csr && csr <= 0x00a) || csr == 0x00f || (0xc20 <= csr && csr <= 0xc22));
+        default:
+            return 0;
+    }
+}
+
+// A new process, or one that has called exec, has no vector state.
+void vec_init_proc(struct proc *p) {
+    memset(&p->vstate, 0, sizeof(p->vstate));
+    p->vec_cpu = -1;
+}
+
+// Drop the vector state of @p, on exec or when the slot is freed.
+void vec_free(struct proc *p) {
+    push_off();
+    struct cpu *c = mycpu();
+    if (c->vec_owner == p) {
+        // its registers may be Dirty on this hart, they must not be saved into the freed page.
+        c->vec_owner = NULL;
+        set_vs(SSTATUS_VS_OFF);
+    }
+    pop_off();
+    if (p->vstate.vregs)
+        kfreepage((void *)KVA_TO_PA(p->vstate.vregs));
+    vec_init_proc(p);
+}
+
+// Called by fork() on the parent @p, the child @np inherits its vector state.
+int vec_fork(struct proc *p, struct proc *np) {
+    if (p->vstate.vregs == NULL)
+        return 0;
+
+    void *__pa pa = kallocpage();
+    if (pa == NULL)
+        return -ENOMEM;
+    void *__kva vregs = (void *)PA_TO_KVA(pa);
+
+    push_off();
+    if (vs_state() == SSTATUS_VS_DIRTY && mycpu()->vec_owner == p) {
+        vec_save(&p->vstate);
+        set_vs(SSTATUS_VS_CLEAN);
+    }
+    pop_off();
+    np->vstate       = p->vstate;
+    np->vstate.vregs = vregs;
+    np->vec_cpu      = -1;
+    memmove(vregs, p->vstate.vregs, vlenb * 32);
+    return 0;
+}
+
+// Called when @p gives up this hart. Its registers stay live, we only save them if they are dirty.
+void vec_switch_out(struct proc *p) {
+    assert(holding(&p->lock));
+
+    if (vs_state() == SSTATUS_VS_DIRTY) {
+        assert(mycpu()->vec_owner == p);
+        vec_save(&p->vstate);
+        set_vs(SSTATUS_VS_CLEAN);
+    }
+}
+
+// The sstatus @p returns to the user with: V is enabled only if its state is live on this hart.
+uint64 vec_user_sstatus(struct proc *p, uint64 sstatus) {
+    struct cpu *c = mycpu();
+
+    if (c->vec_owner == p && p->vec_cpu == c->cpuid) {
+        if ((sstatus & SSTATUS_VS) == SSTATUS_VS_OFF)
+            sstatus |= SSTATUS_VS_CLEAN;
+        return sstatus;
+    }
+    return (sstatus & ~SSTATUS_VS) | SSTATUS_VS_OFF;
+}
+
+/**
+ * @brief Handle an IllegalInstruction trap from the user, which may be its first vector instruction.
+ *
+ * @param insn the faulting instruction, from stval.
+ * @return 1 if V has been enabled and the instruction should be retried, 0 otherwise.
+ */
+int vec_handle_trap(struct proc *p, uint64 insn) {
+    if (vlenb == 0 || vs_state() != SSTATUS_VS_OFF || !is_vector_insn(insn))
+        return 0;
+
+    if (p->vstate.vregs == NULL) {
+        void *__pa pa = kallocpage();
+        if (pa == NULL) {
+            infof("vector: no memory for the vector registers of %d", p->pid);
+            return 0;
+        }
+        void *__kva vregs = (void *)PA_TO_KVA(pa);
+        memset(vregs, 0, vlenb * 32);
+        p->vstate.vregs = vregs;
+        p->vstate.vtype = VTYPE_VILL;
+    }
+
+    push_off();
+    struct cpu *c = mycpu();
+    set_vs(SSTATUS_VS_CLEAN);
+    // never leak the registers of the previous owner.
+    vec_restore(&p->vstate);
+    // loading the registers has made them Dirty.
+    set_vs(SSTATUS_VS_CLEAN);
+    c->vec_owner = p;
+    p->vec_cpu   = c->cpuid;
+    pop_off();
+    return 1;
+}
@@ -0,0 +1,27 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include "types.h"
+
+// Vector registers of a user process, see vector.c
+struct vstate {
+    uint64 vstart;
+    uint64 vtype;
+    uint64 vl;
+    uint64 vcsr;
+    void *vregs;  // kernel address of v0-v31, 32 * vlenb bytes in one page. NULL if V has not been used since exec.
+};
+
+// VLEN in bytes, 0 if this machine has no usable V extension.
+extern uint64 vlenb;
+
+struct proc;
+void vec_init();
+void vec_init_proc(struct proc *p);
+void vec_free(struct proc *p);
+int vec_fork(struct proc *p, struct proc *np);
+void vec_switch_out(struct proc *p);
+uint64 vec_user_sstatus(struct proc *p, uint64 sstatus);
+int vec_handle_trap(struct proc *p, uint64 insn);
+
+#endif  // VECTOR_H
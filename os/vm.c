@@ -2,13 +2,112 @@
 
 #include "defs.h"
 #include "kalloc.h"
+#include "ksm.h"
+#include "workqueue.h"
 
 static allocator_t mm_allocator;
 static allocator_t vma_allocator;
 
+// Per-CPU caches of page-table pages, to make exec and exit cheaper:
+//  skeletons: root page tables with the path to the trampoline already built,
+//             the trampoline mapped and the trapframe PTE cleared.
+//  quicklist: zero-filled page-table pages.
+// The lock is only contended by mm_cache_drain().
+// Cached pages are reported as free pages, see mm_cache_nrpages().
+#define MM_SKELETON_MAX  (8)
+#define PGT_QUICKLIST_MAX (64)
+#define SKELETON_NRPAGES (3)  // root, level-1 and level-0 tables
+
+struct pgt_cache {
+    spinlock_t lock;
+    pagetable_t __kva skeletons[MM_SKELETON_MAX];
+    pagetable_t __kva quicklist[PGT_QUICKLIST_MAX];
+    int nr_skeletons;
+    int nr_quicklist;
+};
+static struct pgt_cache pgt_cache[NCPU];
+
+// Address spaces of exited processes, freed in batches by mm_reap() on the workqueue.
+#define MM_REAP_BATCH (16)
+
+static spinlock_t reap_lock;
+static struct mm *reap_list;
+static struct work reap_work;
+static void mm_reap(struct work *w);
+
+static void freepgt(pagetable_t pgt, int level, int keep_skeleton);
+
 void uvm_init() {
     allocator_init(&mm_allocator, "mm", sizeof(struct mm), 16384);
     allocator_init(&vma_allocator, "vma", sizeof(struct vma), 16384);
+    for (int i = 0; i < NCPU; i++) spinlock_init(&pgt_cache[i].lock, "pgt_cache");
+    spinlock_init(&reap_lock, "mm_reap");
+    INIT_WORK(&reap_work, mm_reap);
+}
+
+static struct pgt_cache *this_pgt_cache() {
+    push_off();
+    struct pgt_cache *c = &pgt_cache[cpuid()];
+    acquire(&c->lock);
+    pop_off();
+    return c;
+}
+
+// Allocate a zero-filled page-table page.
+static pagetable_t __kva pgtable_alloc() {
+    struct pgt_cache *c = this_pgt_cache();
+    pagetable_t pgt     = c->nr_quicklist ? c->quicklist[--c->nr_quicklist] : NULL;
+    release(&c->lock);
+    if (pgt)
+        return pgt;
+
+    void *__pa pa = kzallocpage();
+    if (!pa)
+        return NULL;
+    return (pagetable_t)PA_TO_KVA(pa);
+}
+
+// Free a page-table page, all its entries must be zero.
+static void pgtable_free(pagetable_t __kva pgt) {
+    struct pgt_cache *c = this_pgt_cache();
+    if (c->nr_quicklist < PGT_QUICKLIST_MAX) {
+        c->quicklist[c->nr_quicklist++] = pgt;
+        pgt                             = NULL;
+    }
+    release(&c->lock);
+    if (pgt)
+        kfreepage((void *)KVA_TO_PA(pgt));
+}
+
+// Free all the page-table pages in the caches. Returns the number of pages freed.
+int mm_cache_drain() {
+    int freed = 0;
+    for (int i = 0; i < NCPU; i++) {
+        struct pgt_cache *c = &pgt_cache[i];
+        acquire(&c->lock);
+        while (c->nr_quicklist) {
+            kfreepage((void *)KVA_TO_PA(c->quicklist[--c->nr_quicklist]));
+            freed++;
+        }
+        while (c->nr_skeletons) {
+            pagetable_t root = c->skeletons[--c->nr_skeletons];
+            pagetable_t l1   = (pagetable_t)PA_TO_KVA(PTE2PA(root[PX(2, TRAMPOLINE)]));
+            pagetable_t l0   = (pagetable_t)PA_TO_KVA(PTE2PA(l1[PX(1, TRAMPOLINE)]));
+            kfreepage((void *)KVA_TO_PA(l0));
+            kfreepage((void *)KVA_TO_PA(l1));
+            kfreepage((void *)KVA_TO_PA(root));
+            freed += SKELETON_NRPAGES;
+        }
+        release(&c->lock);
+    }
+    return freed;
+}
+
+// Number of pages held by the caches.
+int64 mm_cache_nrpages() {
+    int64 nr = 0;
+    for (int i = 0; i < NCPU; i++) nr += pgt_cache[i].nr_quicklist + pgt_cache[i].nr_skeletons * SKELETON_NRPAGES;
+    return nr;
 }
 
 // Return the address of the PTE in page table pagetable
@@ -38,11 +137,9 @@ pte_t *walk(struct mm *mm, uint64 va, int alloc) {
         } else {
             if (!alloc)
                 return 0;
-            void *pa = kallocpage();
-            if (!pa)
+            pagetable = pgtable_alloc();
+            if (!pagetable)
                 return 0;
-            pagetable = (pagetable_t)PA_TO_KVA(pa);
-            memset(pagetable, 0, PGSIZE);
             *pte = PA2PTE(KVA_TO_PA(pagetable)) | PTE_V;
         }
     }
@@ -77,6 +174,19 @@ uint64 __pa walkaddr(struct mm *mm, uint64 va) {
     return pa;
 }
 
+// Like walkaddr(), but the returned page is about to be written by the kernel.
+// Break KSM sharing first, so that the write never reaches a shared frame.
+uint64 __pa walkaddr_write(struct mm *mm, uint64 va) {
+    uint64 pa = walkaddr(mm, va);
+    if (pa == 0)
+        return 0;
+
+    pte_t *pte = walk(mm, va, 0);
+    if (*pte & PTE_KSM)
+        pa = ksm_unmerge(mm, pte);
+    return pa;
+}
+
 // Look up a virtual address, return the physical address. return address is bitwise OR-ed with offset.
 uint64 useraddr(struct mm *mm, uint64 va) {
     uint64 page = walkaddr(mm, PGROUNDDOWN(va));
@@ -97,14 +207,24 @@ struct mm *mm_create(struct trapframe *tf) {
     mm->vma    = NULL;
     mm->refcnt = 1;
 
-    void *pa = kallocpage();
-    if (!pa) {
+    struct pgt_cache *c = this_pgt_cache();
+    mm->pgt             = c->nr_skeletons ? c->skeletons[--c->nr_skeletons] : NULL;
+    release(&c->lock);
+    acquire(&mm->lock);
+
+    if (mm->pgt) {
+        // the trampoline is already there.
+        pte_t *pte = walk(mm, TRAPFRAME, 0);
+        assert(pte && *pte == 0);
+        *pte = PA2PTE(KVA_TO_PA(tf)) | PTE_A | PTE_D | PTE_R | PTE_W | PTE_V;
+        return mm;
+    }
+
+    mm->pgt = pgtable_alloc();
+    if (!mm->pgt) {
         warnf("kallocpage failed for root page table");
         goto free_mm;
     }
-    mm->pgt = (pagetable_t)PA_TO_KVA(pa);
-    memset(mm->pgt, 0, PGSIZE);
-    acquire(&mm->lock);
 
     // map trapframe and trampoline in the new mm
     if (mm_mappageat(mm, TRAMPOLINE, KIVA_TO_PA(trampoline), PTE_A | PTE_R | PTE_X) < 0)
@@ -117,7 +237,7 @@ struct mm *mm_create(struct trapframe *tf) {
 
 free_mm:
     if (mm->pgt)
-        kfreepage((void *)KVA_TO_PA(mm->pgt));
+        freepgt(mm->pgt, 2, false);
     release(&mm->lock);
     kfree(&mm_allocator, mm);
     return NULL;
@@ -132,6 +252,14 @@ struct vma *mm_create_vma(struct mm *mm) {
     return vma;
 }
 
+// Release the physical page mapped by a user PTE.
+static void free_user_page(pte_t pte) {
+    if (pte & PTE_KSM)
+        ksm_put_page(PTE2PA(pte));
+    else
+        kfreepage((void *)PTE2PA(pte));
+}
+
 static void freevma(struct vma *vma, int free_phy_page) {
     assert(holding(&vma->owner->lock));
     assert(PGALIGNED(vma->vm_start) && PGALIGNED(vma->vm_end));
@@ -141,11 +269,12 @@ static void freevma(struct vma *vma, int free_phy_page) {
         pte_t *pte = walk(mm, va, false);
         if (pte && (*pte & PTE_V)) {
             if (free_phy_page)
-                kfreepage((void *)PTE2PA(*pte));
+                free_user_page(*pte);
             *pte = 0;
         } else {
             debugf("free unmapped address %p", va);
         }
+        cond_resched_lock(&mm->lock);
     }
     sfence_vma();
 }
@@ -165,15 +294,22 @@ void mm_free_vmas(struct mm *mm) {
 
 /**
  * @brief Free the page table, recursively. But do not free the PA stored in PTE.
+ *
+ * If @keep_skeleton, the tables on the path to the trampoline are kept,
+ *  and only the trampoline stays mapped.
  */
-static void freepgt(pagetable_t pgt) {
+static void freepgt(pagetable_t pgt, int level, int keep_skeleton) {
     for (int i = 0; i < 512; i++) {
-        if ((pgt[i] & PTE_V) && (pgt[i] & PTE_RWX) == 0) {
-            freepgt((pagetable_t)PA_TO_KVA(PTE2PA(pgt[i])));
+        if (pgt[i] == 0)
+            continue;
+        int on_path = keep_skeleton && i == PX(level, TRAMPOLINE);
+        if ((pgt[i] & PTE_V) && (pgt[i] & PTE_RWX) == 0)
+            freepgt((pagetable_t)PA_TO_KVA(PTE2PA(pgt[i])), level - 1, on_path);
+        if (!on_path)
             pgt[i] = 0;
-        }
     }
-    kfreepage((void *)KVA_TO_PA(pgt));
+    if (!keep_skeleton)
+        pgtable_free(pgt);
 }
 
 /**
@@ -184,12 +320,52 @@ void mm_free(struct mm *mm) {
     assert(mm->refcnt > 0);
 
     mm_free_vmas(mm);
-    freepgt(mm->pgt);
+
+    freepgt(mm->pgt, 2, true);
+    struct pgt_cache *c = this_pgt_cache();
+    int cached          = c->nr_skeletons < MM_SKELETON_MAX;
+    if (cached)
+        c->skeletons[c->nr_skeletons++] = mm->pgt;
+    release(&c->lock);
+    if (!cached)
+        freepgt(mm->pgt, 2, false);
 
     release(&mm->lock);
     kfree(&mm_allocator, mm);
 }
 
+// Free up to MM_REAP_BATCH queued mms, and queue ourselves again if more are left.
+static void mm_reap(struct work *w) {
+    acquire(&reap_lock);
+    struct mm *batch = reap_list, **tail = &reap_list;
+    for (int n = 0; *tail && n < MM_REAP_BATCH; n++) tail = &(*tail)->reap_next;
+    reap_list = *tail;
+    *tail     = NULL;
+    int more  = reap_list != NULL;
+    release(&reap_lock);
+
+    while (batch) {
+        struct mm *mm = batch;
+        batch         = mm->reap_next;
+        acquire(&mm->lock);
+        mm_free(mm);
+        cond_resched();
+    }
+    if (more)
+        queue_work(&reap_work);
+}
+
+// Free @mm later on the workqueue, to keep the teardown out of exit() and exec().
+// Nobody may use @mm any more, its page table must not be in any satp.
+// Can be called with any lock held.
+void mm_free_async(struct mm *mm) {
+    acquire(&reap_lock);
+    mm->reap_next = reap_list;
+    reap_list     = mm;
+    release(&reap_lock);
+    queue_work(&reap_work);
+}
+
 static int vma_check_overlap(struct mm *mm, uint64 start, uint64 end, struct vma *exclude) {
     assert(holding(&mm->lock));
 
@@ -308,9 +484,9 @@ int mm_remap(struct vma *vma, uint64 start, uint64 end, uint64 pte_flags) {
                 goto err;
             }
             if (*pte & PTE_V) {
-                // mapping exists, update flags.
+                // mapping exists, update flags. KSM pages stay read-only until un-merged.
                 uint64 pte_woflags = *pte & ~PTE_RWX;
-                *pte               = pte_woflags | pte_flags;
+                *pte               = pte_woflags | ((*pte & PTE_KSM) ? (pte_flags & ~PTE_W) : pte_flags);
             } else {
                 // mapping does not exist, create it.
                 void *pa = kallocpage();
@@ -321,6 +497,8 @@ int mm_remap(struct vma *vma, uint64 start, uint64 end, uint64 pte_flags) {
                 *pte = PA2PTE(pa) | pte_flags | PTE_V;
             }
         }
+        // scanners only look inside the VMA, which we have not changed yet.
+        cond_resched_lock(&mm->lock);
     }
 
     // then, we are free from trying to allocate new physical pages.
@@ -329,13 +507,14 @@ int mm_remap(struct vma *vma, uint64 start, uint64 end, uint64 pte_flags) {
             // this mapping should be removed
             pte = walk(mm, va, 0);
             if (pte && (*pte & PTE_V)) {
-                kfreepage((void *)PTE2PA(*pte));
+                free_user_page(*pte);
                 *pte = 0;
             } else {
                 errorf("remap: mapping should exist, va = %p", va);
                 return -EINVAL;
             }
         }
+        cond_resched_lock(&mm->lock);
     }
     sfence_vma();
 
@@ -358,7 +537,7 @@ err:
             pte = walk(mm, va, 0);
             if (pte && (*pte & PTE_V)) {
                 uint64 pte_woflags = *pte & ~PTE_RWX;
-                *pte               = pte_woflags | vma->pte_flags;
+                *pte               = pte_woflags | ((*pte & PTE_KSM) ? (vma->pte_flags & ~PTE_W) : vma->pte_flags);
             } else {
                 panic_never_reach();
             }
@@ -400,6 +579,7 @@ int mm_mappageat(struct mm *mm, uint64 va, uint64 __pa pa, uint64 flags) {
 
 // Used in fork.
 // Copy the pagetable page and all the user pages.
+// If the two mm locks are the only ones held, they may be dropped to let the cpu go.
 // Return 0 on success, negative on error.
 int mm_copy(struct mm *old, struct mm *new) {
     assert(holding(&old->lock));
@@ -422,6 +602,13 @@ int mm_copy(struct mm *old, struct mm *new) {
             void *__kva pa_old = (void *)PA_TO_KVA(walkaddr(old, va));
             void *__kva pa_new = (void *)PA_TO_KVA(walkaddr(new, va));
             memmove(pa_new, pa_old, PGSIZE);
+            // like cond_resched_lock() for both locks. @new is not visible to anyone else yet.
+            if (mycpu()->noff == 2 && resched_pending()) {
+                release(&new->lock);
+                release(&old->lock);
+                acquire(&old->lock);
+                acquire(&new->lock);
+            }
         }
         vma = vma->next;
     }
@@ -432,6 +619,21 @@ err:
     return -ENOMEM;
 }
 
+// Number of user pages mapped in the VMAs of @mm.
+uint64 mm_rss(struct mm *mm) {
+    assert(holding(&mm->lock));
+
+    uint64 rss = 0;
+    for (struct vma *vma = mm->vma; vma; vma = vma->next) {
+        for (uint64 va = vma->vm_start; va < vma->vm_end; va += PGSIZE) {
+            pte_t *pte = walk(mm, va, 0);
+            if (pte && (*pte & PTE_V))
+                rss++;
+        }
+    }
+    return rss;
+}
+
 struct vma *mm_find_vma(struct mm *mm, uint64 va) {
     assert(holding(&mm->lock));
 
@@ -43,17 +43,21 @@ struct mm {
     pagetable_t __kva pgt;
     struct vma* vma;
     int refcnt;
+    struct mm* reap_next;  // in the reaper list, see mm_free_async()
 };
 
 // kvm.c
 void kvm_init();
 void kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm);
+int kvm_map_page(uint64 va, uint64 __pa pa, int perm);
+uint64 __pa kvm_unmap_page(uint64 va);
 
 // vm.c
 void uvm_init();
 
 pte_t* walk(struct mm* mm, uint64 va, int alloc);
 uint64 __pa walkaddr(struct mm* mm, uint64 va);
+uint64 __pa walkaddr_write(struct mm* mm, uint64 va);
 uint64 useraddr(struct mm* mm, uint64 va);
 
 struct trapframe;
@@ -61,11 +65,15 @@ struct mm *mm_create(struct trapframe* tf);
 struct vma* mm_create_vma(struct mm* mm);
 void mm_free_vmas(struct mm* mm);
 void mm_free(struct mm* mm);
+void mm_free_async(struct mm* mm);
 int mm_mappages(struct vma* vma);
 int mm_remap(struct vma *vma, uint64 start, uint64 end, uint64 pte_flags);
 int mm_mappageat(struct mm *mm, uint64 va, uint64 __pa pa, uint64 flags);
 int mm_copy(struct mm* old, struct mm* new);
 struct vma* mm_find_vma(struct mm* mm, uint64 va);
+uint64 mm_rss(struct mm* mm);
+int mm_cache_drain();
+int64 mm_cache_nrpages();
 
 // uaccess.c
 int copy_to_user(struct mm* mm, uint64 __user dstva, char* src, uint64 len);
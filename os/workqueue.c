@@ -0,0 +1,114 @@
+#include "workqueue.h"
+
+#include "defs.h"
+#include "kthread.h"
+
+// Per-cpu workqueues.
+//
+// queue_work() appends a work item to the queue of the current cpu, and wakes its worker kthread,
+//  which runs the items one by one in process context: they may sleep and be preempted.
+// It can be called with any lock held: waking the worker only takes the worker's p->lock,
+//  and a worker never takes another lock while holding its own p->lock.
+//
+// Each worker is bound to its cpu. Work queued on an isolated cpu goes to a housekeeping one,
+//  so the isolated cpu keeps running only its own processes.
+
+struct worker_pool {
+    spinlock_t lock;
+    struct work *head;
+    struct work **tail;
+    int busy;              // the worker is running an item
+    struct proc *worker;
+} __attribute__((aligned(64)));
+
+static struct worker_pool pools[NCPU];
+
+static void wake_worker(struct worker_pool *pool) {
+    struct proc *w = pool->worker;
+
+    acquire(&w->lock);
+    if (w->state == SLEEPING && w->sleep_chan == pool) {
+        w->state = RUNNABLE;
+        add_task(w);
+    }
+    release(&w->lock);
+}
+
+static void worker_main(void *arg) {
+    struct worker_pool *pool = arg;
+
+    for (;;) {
+        acquire(&pool->lock);
+        while (pool->head == NULL) sleep(pool, &pool->lock);
+        struct work *w = pool->head;
+        pool->head     = w->next;
+        if (pool->head == NULL)
+            pool->tail = &pool->head;
+        // w->next has been read: it may be queued again, here or on another cpu.
+        __sync_lock_release(&w->pending);
+        pool->busy = 1;
+        release(&pool->lock);
+
+        w->func(w);
+
+        acquire(&pool->lock);
+        pool->busy = 0;
+        int idle   = pool->head == NULL;
+        release(&pool->lock);
+        if (idle)
+            wakeup(&pool->busy);
+    }
+}
+
+void workqueue_init() {
+    for (int i = 0; i < NCPU; i++) {
+        struct worker_pool *pool = &pools[i];
+        spinlock_init(&pool->lock, "workqueue");
+        pool->tail   = &pool->head;
+        pool->worker = kthread_create_on(worker_main, pool, 0, i);
+        if (pool->worker == NULL)
+            panic("workqueue_init");
+    }
+}
+
+/**
+ * @brief Queue @w on the workqueue of @cpu.
+ *
+ * @return 1 if queued, 0 if @w is already pending.
+ */
+int queue_work_on(int cpu, struct work *w) {
+    struct worker_pool *pool = &pools[cpu];
+
+    // a work item may be queued from any cpu, and so to any pool:
+    //  claim it before linking it, pool->lock only protects this pool.
+    if (__sync_lock_test_and_set(&w->pending, 1) != 0)
+        return 0;
+
+    acquire(&pool->lock);
+    w->next     = NULL;
+    *pool->tail = w;
+    pool->tail  = &w->next;
+    release(&pool->lock);
+
+    wake_worker(pool);
+    return 1;
+}
+
+int queue_work(struct work *w) {
+    push_off();
+    int cpu = cpuid();
+    pop_off();
+    if (cpu_isolated(cpu))
+        cpu = __builtin_ctzll(housekeeping_cpus());
+    return queue_work_on(cpu, w);
+}
+
+// Wait until all work queued so far has run. Must be called without any lock held.
+void flush_workqueues() {
+    for (int i = 0; i < NCPU; i++) {
+        struct worker_pool *pool = &pools[i];
+        acquire(&pool->lock);
+        while (pool->head || pool->busy) sleep(&pool->busy, &pool->lock);
+        release(&pool->lock);
+    }
+}
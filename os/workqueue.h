@@ -0,0 +1,25 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include "types.h"
+
+// Deferred work, run by the worker kthread of a cpu, see workqueue.c
+struct work {
+    void (*func)(struct work *w);
+    struct work *next;
+    int pending;  // queued and not started yet, set atomically by queue_work_on()
+};
+
+#define INIT_WORK(w, f)    \
+    do {                   \
+        (w)->func    = (f); \
+        (w)->next    = NULL; \
+        (w)->pending = 0;    \
+    } while (0)
+
+void workqueue_init();
+int queue_work(struct work *w);
+int queue_work_on(int cpu, struct work *w);
+void flush_workqueues();
+
+#endif  // WORKQUEUE_H
@@ -0,0 +1,183 @@
+#include "wss.h"
+
+#include "defs.h"
+#include "kthread.h"
+#include "trap.h"
+
+// Idle page tracking.
+//
+// Sampling a process walks all its VMAs: a page with PTE_A set is young (idle age 0),
+//  otherwise its idle age grows by one. PTE_A is then cleared, and it will be set again
+//  by the hardware, or by handle_pgfault() on boards like VF2 that trap on missing A bits.
+//
+// Idle ages are kept per physical frame. PTE_AGE_VALID marks PTEs whose frame age belongs to
+//  this mapping, so a freshly mapped page does not inherit the age of the frame's previous user.
+// KSM frames are mapped by several processes, whose samples would mix in one frame age:
+//  merged pages are left out of the working set until they are un-merged.
+//
+// A process is sampled either by kscand (if it is not RUNNING, see ksm.c for why),
+//  or by its own hart at a timer tick.
+
+static uint8 idle_age[PHYS_MEM_SIZE >> PGSHIFT];
+
+static uint64 period = 0;  // in ticks, 0: disabled.
+
+// only accessed by the hart owning `scanning`.
+static int64 scanning = 0;
+static uint64 last_scan_tick;
+
+void wss_init(struct proc *p) {
+    memset(&p->wss, 0, sizeof(p->wss));
+}
+
+static inline uint8 *frame_age(uint64 __pa pa) {
+    assert_str(RISCV_DDR_BASE <= pa && pa < RISCV_DDR_BASE + PHYS_MEM_SIZE, "invalid frame %p", pa);
+    return &idle_age[(pa - RISCV_DDR_BASE) >> PGSHIFT];
+}
+
+static inline int age_bucket(uint8 age) {
+    int b = 0;
+    while (age && b < WSS_NR_BUCKETS - 1) {
+        age >>= 1;
+        b++;
+    }
+    return b;
+}
+
+// Sample and clear PTE_A of every user page of @p.
+static void wss_sample(struct proc *p) {
+    assert(holding(&p->lock));
+
+    struct mm *mm = p->mm;
+    acquire(&mm->lock);
+
+    memset(p->wss.hist, 0, sizeof(p->wss.hist));
+    for (struct vma *vma = mm->vma; vma; vma = vma->next) {
+        for (uint64 va = vma->vm_start; va < vma->vm_end; va += PGSIZE) {
+            pte_t *pte = walk(mm, va, 0);
+            if (pte == NULL || !(*pte & PTE_V) || !(*pte & PTE_U) || (*pte & PTE_KSM))
+                continue;
+
+            uint8 *age = frame_age(PTE2PA(*pte));
+            if (!(*pte & PTE_AGE_VALID) || (*pte & PTE_A))
+                *age = 0;
+            else if (*age < 255)
+                (*age)++;
+            *pte = (*pte & ~PTE_A) | PTE_AGE_VALID;
+
+            p->wss.hist[age_bucket(*age)]++;
+        }
+    }
+    release(&mm->lock);
+
+    p->wss.last_sample = ticks;
+    p->wss.nr_samples++;
+}
+
+static int wss_due(struct proc *p) {
+    return period != 0 && p->mm != NULL && ticks - p->wss.last_sample >= period;
+}
+
+// Called at a timer tick from user mode, on the hart running @p.
+void wss_tick(struct proc *p) {
+    if (period == 0)
+        return;
+
+    acquire(&p->lock);
+    if (wss_due(p)) {
+        wss_sample(p);
+        // flush our stale TLB entries. userret also does this before returning to user.
+        sfence_vma();
+    }
+    release(&p->lock);
+}
+
+int wss_scan_active() {
+    return period != 0;
+}
+
+// Called by kscand. Sample the processes that are due, at most once per tick.
+void wss_scan_tick() {
+    if (period == 0 || ticks == last_scan_tick)
+        return;
+    if (__sync_lock_test_and_set(&scanning, 1) != 0)
+        return;
+    last_scan_tick = ticks;
+
+    for (int i = 0; i < nr_procs; i++) {
+        struct proc *p = pool[i];
+        acquire(&p->lock);
+        if ((p->state == RUNNABLE || p->state == SLEEPING) && wss_due(p))
+            wss_sample(p);
+        release(&p->lock);
+    }
+
+    __sync_lock_release(&scanning);
+}
+
+static int wss_get_proc(struct wss_stat *st) {
+    struct proc *p = findproc(st->pid);
+    if (p == NULL)
+        return -EINVAL;
+
+    st->period      = period;
+    st->last_sample = p->wss.last_sample;
+    st->nr_samples  = p->wss.nr_samples;
+    uint64 sum      = 0;
+    for (int b = 0; b < WSS_NR_BUCKETS; b++) {
+        sum += p->wss.hist[b];
+        st->wss[b] = sum;
+    }
+    st->rss = sum;
+    release(&p->lock);
+    return 0;
+}
+
+static void wss_get_hist(struct wss_hist *h) {
+    memset(h, 0, sizeof(*h));
+    h->period = period;
+    for (int i = 0; i < nr_procs; i++) {
+        struct proc *p = pool[i];
+        acquire(&p->lock);
+        if (p->state != UNUSED && p->state != ZOMBIE && p->wss.nr_samples > 0) {
+            h->nr_procs++;
+            for (int b = 0; b < WSS_NR_BUCKETS; b++) h->pages[b] += p->wss.hist[b];
+        }
+        release(&p->lock);
+    }
+}
+
+int64 sys_wssctl(int cmd, uint64 arg) {
+    struct proc *p = curr_proc();
+    struct wss_stat st;
+    struct wss_hist h;
+    int ret;
+
+    switch (cmd) {
+        case WSS_CMD_SET_PERIOD:
+            period = arg;
+            if (period)
+                kscand_wake();
+            return 0;
+        case WSS_CMD_GET_PROC:
+            acquire(&p->mm->lock);
+            ret = copy_from_user(p->mm, (char *)&st, arg, sizeof(st));
+            release(&p->mm->lock);
+            if (ret < 0)
+                return ret;
+            if ((ret = wss_get_proc(&st)) < 0)
+                return ret;
+            acquire(&p->mm->lock);
+            ret = copy_to_user(p->mm, arg, (char *)&st, sizeof(st));
+            release(&p->mm->lock);
+            return ret;
+        case WSS_CMD_GET_HIST:
+            wss_get_hist(&h);
+            acquire(&p->mm->lock);
+            ret = copy_to_user(p->mm, arg, (char *)&h, sizeof(h));
+            release(&p->mm->lock);
+            return ret;
+        default:
+            return -EINVAL;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef __WSS_H__
+#define __WSS_H__
+
+// This file is shared by Kernel and User-space application.
+
+#include "types.h"
+
+// Working-set estimation by idle page tracking:
+//  every `period` ticks, the PTE_A bits of a process's pages are sampled and cleared.
+//  A page's idle age is the number of periods since it was last accessed.
+//  Pages merged by KSM are shared, and not counted.
+//
+// Idle ages are grouped in buckets: 0, 1, 2-3, 4-7, 8-15, 16-31, 32-63, 64+.
+#define WSS_NR_BUCKETS 8
+
+// commands of wssctl(cmd, arg)
+#define WSS_CMD_SET_PERIOD 1  // arg: sample period in ticks, 0 disables tracking
+#define WSS_CMD_GET_PROC   2  // arg: struct wss_stat __user *, pid filled by the caller
+#define WSS_CMD_GET_HIST   3  // arg: struct wss_hist __user *
+
+struct wss_stat {
+    int pid;                     // in: which process
+    uint64 period;               // sample period in ticks
+    uint64 last_sample;          // tick of the last sample
+    uint64 nr_samples;           // how many times the process has been sampled
+    uint64 rss;                  // resident user pages at the last sample
+    uint64 wss[WSS_NR_BUCKETS];  // wss[i]: pages accessed within the last 2^i periods, wss[WSS_NR_BUCKETS - 1] == rss
+};
+
+struct wss_hist {
+    uint64 period;                 // sample period in ticks
+    uint64 nr_procs;               // processes included in the histogram
+    uint64 pages[WSS_NR_BUCKETS];  // system-wide user pages per idle-age bucket
+};
+
+// per-process state, embedded in struct proc. Protected by p->lock.
+struct wss {
+    uint64 last_sample;
+    uint64 nr_samples;
+    uint64 hist[WSS_NR_BUCKETS];  // pages per idle-age bucket at the last sample
+};
+
+// kernel interfaces, see wss.c
+struct proc;
+void wss_init(struct proc *p);
+void wss_scan_tick();
+int wss_scan_active();
+void wss_tick(struct proc *p);
+int64 sys_wssctl(int cmd, uint64 arg);
+
+#endif  // __WSS_H__
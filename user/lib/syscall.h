@@ -4,6 +4,15 @@
 #include "../../os/types.h"
 #include "../../os/syscall_ids.h"
 #include "../../os/signal/signal.h"
+#include "../../os/ksm.h"
+#include "../../os/wss.h"
+#include "../../os/compact.h"
+#include "../../os/oom.h"
+#include "../../os/sched.h"
+#include "../../os/clock.h"
+#include "../../os/hwprobe.h"
+#include "../../os/ipc.h"
+#include "../../os/rseq.h"
 
 // we only put syscall prototypes here, usys.pl will generate the actual syscall entry code
 int fork();
@@ -16,6 +25,10 @@ int getppid();
 
 int sleep(int ticks);
 void yield();
+int gettimeofday(TimeVal *tv);
+int clock_gettime(int clockid, struct timespec *tp);
+int nanosleep(const struct timespec *req, struct timespec *rem);
+int64 timer_slack(int64 ns);
 
 void *sbrk(int increment);
 
@@ -23,6 +36,18 @@ int read(int fd, void *buf, int count);
 int write(int fd, void *buf, int count);
 
 int ktest(int type, void * arg, uint64 len);
+int ksmctl(int cmd, uint64 arg);
+int wssctl(int cmd, uint64 arg);
+int compactctl(int cmd, uint64 arg);
+int oom_score_adj(int pid, int adj);
+int schedstat(int cpu, struct cpu_sched_stat *stat);
+int setpriority(int pid, int nice);
+int sched_setscheduler(int pid, int policy, int priority);
+int sched_setaffinity(int pid, uint64 mask);
+int rseq(struct rseq *rseq, uint32 len, int flags, uint32 sig);
+int riscv_hwprobe(struct riscv_hwprobe *pairs, uint64 count);
+int ipc_call(int pid, struct ipc_msg *msg);
+int ipc_reply_wait(int client, struct ipc_msg *msg);
 
 int sigaction(int signo, const sigaction_t *act, sigaction_t *oldact);
 void sigreturn();
@@ -14,6 +14,20 @@ sub entry {
     print " ecall\n";
     print " ret\n";
 }
+
+# IPC: the struct ipc_msg in a1 is passed in a1..a4 (IPC_NR_MR words),
+#  and the registers the kernel returns are stored back to it.
+sub ipc_entry {
+    my $name = shift;
+    print ".global $name\n";
+    print "${name}:\n";
+    print " mv t0, a1\n";
+    print " ld a" . ($_ + 1) . ", " . ($_ * 8) . "(t0)\n" for 0 .. 3;
+    print " li a7, SYS_${name}\n";
+    print " ecall\n";
+    print " sd a" . ($_ + 1) . ", " . ($_ * 8) . "(t0)\n" for 0 .. 3;
+    print " ret\n";
+}
 	
 entry("fork");
 entry("exec");
@@ -29,7 +43,22 @@ entry("mmap");
 entry("read");
 entry("write");
 entry("gettimeofday");
+entry("clock_gettime");
+entry("nanosleep");
+entry("timer_slack");
 entry("ktest");
+entry("ksmctl");
+entry("wssctl");
+entry("compactctl");
+entry("oom_score_adj");
+entry("schedstat");
+entry("setpriority");
+entry("sched_setscheduler");
+entry("sched_setaffinity");
+entry("rseq");
+entry("riscv_hwprobe");
+ipc_entry("ipc_call");
+ipc_entry("ipc_reply_wait");
 
 # signals:
 entry("sigaction");
@@ -0,0 +1,107 @@
+#include "../lib/user.h"
+
+// IPC test: a forked server answers calls from the test and its children.
+// A call carries an operation in mr[0]. The server replies with the caller's pid in mr[0]
+// and the complement of mr[1..3], so every message register is checked both ways.
+
+#define OP_ECHO 1
+#define OP_SLOW 2  // sleep mr[1] ticks before replying: callers queue up meanwhile
+#define OP_HOLD 3  // reply only 20 ticks later, the caller is killed meanwhile
+#define OP_EXIT 4  // sleep mr[1] ticks and exit without replying
+
+static void server() {
+    struct ipc_msg m;
+    int client = 0;
+
+    for (;;) {
+        int from = ipc_reply_wait(client, &m);
+        assert(from > 0);
+        client = from;
+        switch (m.mr[0]) {
+            case OP_SLOW:
+                sleep(m.mr[1]);
+                break;
+            case OP_HOLD:
+                sleep(20);
+                break;
+            case OP_EXIT:
+                sleep(m.mr[1]);
+                exit(0);
+        }
+        m.mr[0] = from;
+        for (int i = 1; i < IPC_NR_MR; i++) m.mr[i] = ~m.mr[i];
+    }
+}
+
+static int call(int srv, uint64 op, uint64 arg) {
+    struct ipc_msg m = {{op, arg, 0x1111222233334444ull ^ getpid(), 0x5555666677778888ull}};
+    int ret = ipc_call(srv, &m);
+    if (ret < 0)
+        return ret;
+    if (m.mr[0] != getpid() || m.mr[1] != ~arg || m.mr[2] != ~(0x1111222233334444ull ^ getpid()) ||
+        m.mr[3] != ~0x5555666677778888ull) {
+        printf("ipctest: %d: bad reply %p %p %p %p\n", getpid(), m.mr[0], m.mr[1], m.mr[2], m.mr[3]);
+        exit(1);
+    }
+    return 0;
+}
+
+// fork a child calling @srv, which exits with 0 if the call returns @expected.
+static int spawn_call(int srv, uint64 op, uint64 arg, int expected) {
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0)
+        exit(call(srv, op, arg) == expected ? 0 : 1);
+    return pid;
+}
+
+static void wait_status(int pid, int expected) {
+    int xstatus;
+    assert_eq(wait(pid, &xstatus), pid);
+    assert_eq(xstatus, expected);
+}
+
+int main() {
+    int srv = fork();
+    assert(srv >= 0);
+    if (srv == 0)
+        server();
+
+    // round trips, and calls that can't be made.
+    for (int i = 0; i < 100; i++) assert_eq(call(srv, OP_ECHO, i * 0x0101010101010101ull), 0);
+    assert_eq(call(getpid(), OP_ECHO, 0), -EINVAL);
+    assert_eq(call(0, OP_ECHO, 0), -EINVAL);
+    printf("ipctest: round trip passed\n");
+
+    // a second caller is queued while the server is busy with the first one.
+    int a = spawn_call(srv, OP_SLOW, 20, 0);
+    sleep(5);
+    int b = spawn_call(srv, OP_ECHO, 42, 0);
+    assert_eq(call(srv, OP_ECHO, 43), 0);
+    wait_status(a, 0);
+    wait_status(b, 0);
+    printf("ipctest: queued caller passed\n");
+
+    // a caller killed while waiting for its reply gives up the call: the reply is dropped,
+    // and the server goes on with the next one.
+    int c = spawn_call(srv, OP_HOLD, 0, 1);
+    sleep(5);
+    kill(c);
+    wait_status(c, -1);
+    assert_eq(call(srv, OP_ECHO, 44), 0);
+    printf("ipctest: killed caller passed\n");
+
+    // the server exits: both the caller it has received and the queued one fail.
+    a = spawn_call(srv, OP_EXIT, 20, -ENOENT);
+    sleep(5);
+    b = spawn_call(srv, OP_ECHO, 45, -ENOENT);
+    wait_status(a, 0);
+    wait_status(b, 0);
+    assert_eq(call(srv, OP_ECHO, 46), -ENOENT);  // a zombie can't be called
+    wait_status(srv, 0);
+    assert_eq(call(srv, OP_ECHO, 47), -EINVAL);
+    printf("ipctest: server exit passed\n");
+
+    printf("ipctest passed\n");
+    return 0;
+}
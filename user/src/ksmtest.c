@@ -0,0 +1,59 @@
+#include "../../os/riscv.h"
+#include "../lib/user.h"
+
+// KSM test: forked children keep identical copies of a buffer,
+// the scanner should merge them, and writes should un-merge them.
+
+#define NPAGES    64
+#define NCHILDREN 3
+
+static void getstat(struct ksm_stat *st) {
+    assert_eq(ksmctl(KSM_CMD_GET_STAT, (uint64)st), 0);
+}
+
+int main() {
+    struct ksm_stat st;
+    char *buf = sbrk(NPAGES * PGSIZE);
+    for (int i = 0; i < NPAGES * PGSIZE; i++) buf[i] = i % 251;
+
+    assert_eq(ksmctl(KSM_CMD_SET_PAGES_TO_SCAN, 1024), 0);
+    assert_eq(ksmctl(KSM_CMD_SET_RUN, 1), 0);
+
+    for (int c = 0; c < NCHILDREN; c++) {
+        int pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            sleep(50);
+            // write to every page, they must be un-merged and still hold our data.
+            for (int i = 0; i < NPAGES; i++) buf[i * PGSIZE] = c;
+            for (int i = 0; i < NPAGES * PGSIZE; i++) {
+                char expected = (i % PGSIZE == 0) ? c : i % 251;
+                if (buf[i] != expected) {
+                    printf("ksmtest: child %d: corrupted at %d\n", c, i);
+                    exit(1);
+                }
+            }
+            exit(0);
+        }
+    }
+
+    sleep(20);
+    getstat(&st);
+    printf("ksmtest: shared %d, sharing %d, saved %d, scanned %d, full scans %d\n",
+           (int)st.pages_shared, (int)st.pages_sharing, (int)st.pages_saved, (int)st.pages_scanned, (int)st.full_scans);
+    assert(st.pages_saved > 0);
+
+    int failed = 0;
+    for (int c = 0; c < NCHILDREN; c++) {
+        int xstatus;
+        wait(-1, &xstatus);
+        failed |= xstatus;
+    }
+    assert_eq(ksmctl(KSM_CMD_SET_RUN, 0), 0);
+
+    getstat(&st);
+    printf("ksmtest: after exit: shared %d, sharing %d, saved %d\n", (int)st.pages_shared, (int)st.pages_sharing, (int)st.pages_saved);
+    assert_eq(failed, 0);
+    printf("ksmtest passed\n");
+    return 0;
+}
@@ -82,6 +82,44 @@ void exec_nomem(char *s) {
     assert_eq(remaining, freemem);
 }
 
+// fork a child holding @npages pages, with @adj as its oom_score_adj.
+static int oom_hog(int npages, int adj) {
+    int freemem = getfreemem();
+    int pid     = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        assert_eq(oom_score_adj(0, adj), 0);
+        char *buf = sbrk(npages * PGSIZE);
+        assert(buf != (char *)-1);
+        for (int i = 0; i < npages; i++) buf[i * PGSIZE] = i;
+        for (;;) sleep(100);
+    }
+    while (getfreemem() > freemem - npages) sleep(1);
+    return pid;
+}
+
+// running out of memory in sbrk kills the largest process that may be killed, and retries.
+void oomkill(char *s) {
+    int freemem = getfreemem();
+    int xstatus;
+
+    int victim    = oom_hog(freemem / 4, 0);
+    int protected = oom_hog(freemem / 3, OOM_SCORE_ADJ_MIN);
+
+    // only fits once the victim is gone.
+    char *buf = sbrk(freemem / 2 * PGSIZE);
+    if (buf == (char *)-1) {
+        printf("%s: sbrk failed\n", s);
+        exit(1);
+    }
+    assert_eq(wait(victim, &xstatus), victim);
+    assert_eq(xstatus, -10 - SIGKILL);
+
+    kill(protected);
+    assert_eq(wait(protected, &xstatus), protected);
+    assert_eq(xstatus, -1);
+}
+
 // test if child is killed (status = -1)
 void killstatus(char *s) {
     int xst;
@@ -198,6 +236,301 @@ void forkfork(char *s) {
     }
 }
 
+// concurrent exits on every hart: their address spaces are all queued to the
+// reaper at once, from different cpus, many more than the reaper frees in one batch
+// (see mm_reap()). none of them may be lost or freed twice.
+void exitreap(char *s) {
+    enum { N = 8, ROUNDS = 10, WAVE = 20 };
+    // waits for the reaper, see KTEST_GET_NRFREEPGS.
+    int freemem = getfreemem();
+
+    for (int i = 0; i < N; i++) {
+        int pid = fork();
+        if (pid < 0) {
+            printf("%s: fork failed\n", s);
+            exit(1);
+        }
+        if (pid == 0) {
+            for (int j = 0; j < ROUNDS; j++) {
+                // a wave of exits, which are all reaped after wait() returns.
+                for (int k = 0; k < WAVE; k++) {
+                    int pid1 = fork();
+                    if (pid1 < 0)
+                        exit(1);
+                    if (pid1 == 0) {
+                        char *a = sbrk(4 * PGSIZE);
+                        for (int l = 0; l < 4; l++) a[l * PGSIZE] = l;
+                        exit(0);
+                    }
+                }
+                for (int k = 0; k < WAVE; k++) wait(-1, 0);
+            }
+            exit(0);
+        }
+    }
+
+    int xstatus;
+    for (int i = 0; i < N; i++) {
+        wait(-1, &xstatus);
+        if (xstatus != 0) {
+            printf("%s: fork in child failed\n", s);
+            exit(1);
+        }
+    }
+    assert_eq(getfreemem(), freemem);
+}
+
+// FP state. We only use fs0, fs1, fs11 and fcsr, which the compiler never
+// touches in this file: it emits no FP code.
+static void fp_set(uint64 v, uint64 fcsr) {
+    asm volatile("fmv.d.x fs0, %0\n fmv.d.x fs1, %1\n fmv.d.x fs11, %2\n fscsr %3" ::"r"(v), "r"(~v), "r"(v * 3), "r"(fcsr));
+}
+
+static int fp_check(uint64 v, uint64 fcsr) {
+    uint64 a, b, c, f;
+    asm volatile("fmv.x.d %0, fs0\n fmv.x.d %1, fs1\n fmv.x.d %2, fs11\n frcsr %3" : "=r"(a), "=r"(b), "=r"(c), "=r"(f));
+    return a == v && b == ~v && c == v * 3 && f == fcsr;
+}
+
+// rounding mode in frm, some exception flags in fflags.
+#define FP_FCSR(i) ((((i) % 5) << 5) | ((i) & 0x1f))
+
+// FP registers are per process: several processes keep their own values
+// across many switches between them, on the same hart or not.
+void fpswitch(char *s) {
+    enum { N = 4, ROUNDS = 200 };
+
+    for (int i = 0; i < N; i++) {
+        int pid = fork();
+        if (pid < 0) {
+            printf("%s: fork failed\n", s);
+            exit(1);
+        }
+        if (pid == 0) {
+            uint64 v = 0x0101010101010101ull * (i + 1);
+            fp_set(v, FP_FCSR(i + 1));
+            for (int j = 0; j < ROUNDS; j++) {
+                if (j % 2)
+                    yield();
+                else
+                    sleep(1);
+                if (!fp_check(v, FP_FCSR(i + 1))) {
+                    printf("%s: child %d lost its FP registers after %d switches\n", s, i, j);
+                    exit(1);
+                }
+            }
+            exit(0);
+        }
+    }
+
+    int xstatus;
+    for (int i = 0; i < N; i++) {
+        wait(-1, &xstatus);
+        if (xstatus != 0)
+            exit(1);
+    }
+}
+
+// a forked child inherits the FP registers of its parent, exec drops them.
+void fpforkexec(char *s) {
+    uint64 v = 0x123456789abcdef0ull;
+    int xstatus;
+
+    fp_set(v, FP_FCSR(3));
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        if (!fp_check(v, FP_FCSR(3))) {
+            printf("%s: child did not inherit the FP registers\n", s);
+            exit(1);
+        }
+        // our own changes must not leak to the parent.
+        fp_set(~v, FP_FCSR(4));
+        sleep(1);
+        exit(fp_check(~v, FP_FCSR(4)) ? 0 : 1);
+    }
+    wait(pid, &xstatus);
+    assert_eq(xstatus, 0);
+    if (!fp_check(v, FP_FCSR(3))) {
+        printf("%s: parent lost its FP registers\n", s);
+        exit(1);
+    }
+
+    // the new program starts with zeroed FP registers, see main().
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        char *argv[] = {"proctest", "fpzero", NULL};
+        exec("proctest", argv);
+        exit(1);
+    }
+    wait(pid, &xstatus);
+    assert_eq(xstatus, 0);
+}
+
+// Vector state, when the hart has V. Built for rv64g, we enable V around our own vector code.
+// We only use v1, v2, v31, vl, vtype and vcsr, with SEW=64 and LMUL=1.
+#define VTYPE_E64M1 0xd8  // e64, m1, ta, ma
+#define VTYPE_VILL  (1ull << 63)
+
+// VLEN / 8, 0 if we can't use V.
+static uint64 vec_vlenb() {
+    struct riscv_hwprobe pairs[] = {
+        {RISCV_HWPROBE_KEY_IMA_EXT_0, 0},
+        {RISCV_HWPROBE_KEY_VLENB,     0},
+    };
+    assert_eq(riscv_hwprobe(pairs, 2), 0);
+    return (pairs[0].value & RISCV_HWPROBE_IMA_V) ? pairs[1].value : 0;
+}
+
+static void vec_set(uint64 v, uint64 vcsr) {
+    asm volatile(".option push\n .option arch, +v\n"
+                 "vsetvli t0, zero, e64, m1, ta, ma\n"
+                 "vmv.v.x v1, %0\n vmv.v.x v2, %1\n vmv.v.x v31, %2\n csrw vcsr, %3\n"
+                 ".option pop" ::"r"(v),
+                 "r"(~v), "r"(v * 3), "r"(vcsr)
+                 : "t0");
+}
+
+// v1, v2 and v31 hold @v, ~v and v * 3 in all the @vl elements.
+static int vec_check_regs(uint64 v, uint64 vl) {
+    uint64 a[16], b[16], c[16];  // VLEN is at most PGSIZE * 8 / 32 bits, see vector.c
+    asm volatile(".option push\n .option arch, +v\n"
+                 "vse64.v v1, (%0)\n vse64.v v2, (%1)\n vse64.v v31, (%2)\n"
+                 ".option pop" ::"r"(a),
+                 "r"(b), "r"(c)
+                 : "memory");
+    for (int i = 0; i < vl; i++) {
+        if (a[i] != v || b[i] != ~v || c[i] != v * 3)
+            return 0;
+    }
+    return 1;
+}
+
+static void vec_csrs(uint64 *vl, uint64 *vtype, uint64 *vcsr) {
+    asm volatile(".option push\n .option arch, +v\n"
+                 "csrr %0, vl\n csrr %1, vtype\n csrr %2, vcsr\n"
+                 ".option pop"
+                 : "=r"(*vl), "=r"(*vtype), "=r"(*vcsr));
+}
+
+static int vec_check(uint64 v, uint64 vcsr) {
+    uint64 vl, vtype, cs;
+    vec_csrs(&vl, &vtype, &cs);
+    return vl == vec_vlenb() / 8 && vtype == VTYPE_E64M1 && cs == vcsr && vec_check_regs(v, vl);
+}
+
+// a fresh process has zeroed vector registers, and no vtype.
+static int vec_check_zero() {
+    uint64 vl, vtype, cs;
+    vec_csrs(&vl, &vtype, &cs);
+    if (vl != 0 || vtype != VTYPE_VILL || cs != 0)
+        return 0;
+    asm volatile(".option push\n .option arch, +v\n vsetvli t0, zero, e64, m1, ta, ma\n .option pop" ::: "t0");
+    return vec_check_regs(0, vec_vlenb() / 8);
+}
+
+// riscv_hwprobe() reports V along with its VLEN, and flags the keys it doesn't know.
+void hwprobe(char *s) {
+    struct riscv_hwprobe pairs[] = {
+        {RISCV_HWPROBE_KEY_BASE_BEHAVIOR, 0   },
+        {RISCV_HWPROBE_KEY_IMA_EXT_0,     0   },
+        {RISCV_HWPROBE_KEY_VLENB,         0   },
+        {12345,                           1234},
+    };
+
+    assert_eq(riscv_hwprobe(pairs, 4), 0);
+    assert_eq(pairs[0].value, RISCV_HWPROBE_BASE_BEHAVIOR_IMA);
+    assert(pairs[1].value & RISCV_HWPROBE_IMA_FD);
+    assert_eq(pairs[3].key, -1);
+    assert_eq(pairs[3].value, 0);
+    uint64 vlenb = pairs[2].value;
+    if (pairs[1].value & RISCV_HWPROBE_IMA_V) {
+        // VLEN is a power of two, and at least 128 bits with V.
+        assert(vlenb >= 16 && (vlenb & (vlenb - 1)) == 0);
+        assert(vlenb * 32 <= PGSIZE);
+    } else {
+        assert_eq(vlenb, 0);
+    }
+    assert_eq(riscv_hwprobe((struct riscv_hwprobe *)0x10, 1), -EINVAL);
+}
+
+// vector registers are per process, like the FP ones, see fpswitch.
+void vecswitch(char *s) {
+    enum { N = 4, ROUNDS = 200 };
+
+    if (vec_vlenb() == 0)
+        return;
+    for (int i = 0; i < N; i++) {
+        int pid = fork();
+        if (pid < 0) {
+            printf("%s: fork failed\n", s);
+            exit(1);
+        }
+        if (pid == 0) {
+            uint64 v = 0x0101010101010101ull * (i + 1);
+            vec_set(v, i + 1);
+            for (int j = 0; j < ROUNDS; j++) {
+                if (j % 2)
+                    yield();
+                else
+                    sleep(1);
+                if (!vec_check(v, i + 1)) {
+                    printf("%s: child %d lost its vector registers after %d switches\n", s, i, j);
+                    exit(1);
+                }
+            }
+            exit(0);
+        }
+    }
+
+    int xstatus;
+    for (int i = 0; i < N; i++) {
+        wait(-1, &xstatus);
+        if (xstatus != 0)
+            exit(1);
+    }
+}
+
+// a forked child inherits the vector registers of its parent, exec drops them.
+void vecforkexec(char *s) {
+    uint64 v = 0x123456789abcdef0ull;
+    int xstatus;
+
+    if (vec_vlenb() == 0)
+        return;
+    vec_set(v, 3);
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        if (!vec_check(v, 3)) {
+            printf("%s: child did not inherit the vector registers\n", s);
+            exit(1);
+        }
+        // our own changes must not leak to the parent.
+        vec_set(~v, 4);
+        sleep(1);
+        exit(vec_check(~v, 4) ? 0 : 1);
+    }
+    wait(pid, &xstatus);
+    assert_eq(xstatus, 0);
+    if (!vec_check(v, 3)) {
+        printf("%s: parent lost its vector registers\n", s);
+        exit(1);
+    }
+
+    // the new program starts with zeroed vector registers, see main().
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        char *argv[] = {"proctest", "veczero", NULL};
+        exec("proctest", argv);
+        exit(1);
+    }
+    wait(pid, &xstatus);
+    assert_eq(xstatus, 0);
+}
+
 void sbrkbasic(char *s) {
     enum { TOOMUCH = 1024 * 1024 * 1024 };
     int i, pid, xstatus;
@@ -317,6 +650,23 @@ void sbrkmuch(char *s) {
     }
 }
 
+// kallocblock() finds or makes free 2MiB blocks, migrating our pages out of the way.
+void allocblock(char *s) {
+    enum { NPAGES = 2048 };
+    char *buf = sbrk(NPAGES * PGSIZE);
+    assert(buf != (char *)-1);
+    for (int i = 0; i < NPAGES; i++) buf[i * PGSIZE] = i % 251;
+
+    for (int round = 0; round < 4; round++) assert_eq(ktest(KTEST_ALLOC_BLOCKS, (void *)4, 0), 4);
+
+    for (int i = 0; i < NPAGES; i++) {
+        if (buf[i * PGSIZE] != i % 251) {
+            printf("%s: page %d corrupted\n", s, i);
+            exit(1);
+        }
+    }
+}
+
 // does uninitialized data start out zero?
 char uninit[10000];
 void bsstest(char *s) {
@@ -363,12 +713,20 @@ struct test {
 } proctests[] = {
     {exec_badarg, "exec_badarg"},
     {exec_nomem,  "exec_nomem" },
+    {oomkill,     "oomkill"    },
     {killstatus,  "killstatus" },
     {exitwait,    "exitwait"   },
     {reparent,    "reparent"   },
     {forkfork,    "forkfork"   },
+    {exitreap,    "exitreap"   },
+    {fpswitch,    "fpswitch"   },
+    {fpforkexec,  "fpforkexec" },
+    {hwprobe,     "hwprobe"    },
+    {vecswitch,   "vecswitch"  },
+    {vecforkexec, "vecforkexec"},
     {sbrkbasic,   "sbrkbasic"  },
     {sbrkmuch,    "sbrkmuch"   },
+    {allocblock,  "allocblock" },
     {bsstest,     "bsstest"    },
     {nowrite,     "nowrite"    },
     {NULL,        NULL         },
@@ -433,6 +791,13 @@ int drivetests(int quick, int continuous, char *whichone) {
 }
 
 int main(int argc, char *argv[]) {
+    // exec'd by fpforkexec.
+    if (argc > 1 && strcmp(argv[1], "fpzero") == 0)
+        return fp_check(0, 0) ? 0 : 1;
+    // exec'd by vecforkexec.
+    if (argc > 1 && strcmp(argv[1], "veczero") == 0)
+        return vec_check_zero() ? 0 : 1;
+
     printf("=== TESTSUITE ===\nproctest\n\n");
     drivetests(0, 0, NULL);
     return 0;
@@ -0,0 +1,109 @@
+#include "../lib/user.h"
+
+// Restartable sequences test: registration, cpu ids, and a critical section aborted by preemption.
+
+#define RSEQ_SIG 0x53053053
+
+// int rseq_spin(struct rseq *rs, struct rseq_cs *cs): enter the critical section described by cs,
+// which spins forever. Returns 1 from its abort handler, preceded by the signature.
+int rseq_spin(volatile struct rseq *rs, struct rseq_cs *cs);
+extern char rseq_spin_start[], rseq_spin_end[], rseq_spin_abort[];
+asm(".pushsection .text\n"
+    ".globl rseq_spin, rseq_spin_start, rseq_spin_end, rseq_spin_abort\n"
+    "rseq_spin:\n"
+    "    sd a1, 8(a0)\n"  // rs->rseq_cs = cs
+    "rseq_spin_start:\n"
+    "    j rseq_spin_start\n"
+    "rseq_spin_end:\n"
+    "    li a0, 0\n"
+    "    ret\n"
+    "    .word 0x53053053\n"  // RSEQ_SIG
+    "rseq_spin_abort:\n"
+    "    li a0, 1\n"
+    "    ret\n"
+    ".popsection\n");
+
+static volatile struct rseq rs;
+static struct rseq_cs cs;
+
+// keep a busy process on @cpu, so that a process running there is preempted.
+static int spawn_spinner(int cpu) {
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        assert_eq(sched_setaffinity(0, 1ull << cpu), 0);
+        for (;;);
+    }
+    return pid;
+}
+
+static void pin(int cpu) {
+    assert_eq(sched_setaffinity(0, 1ull << cpu), 0);
+    assert_eq(rs.cpu_id, cpu);
+    assert_eq(rs.cpu_id_start, cpu);
+}
+
+static void kill_spinner(int pid) {
+    kill(pid);
+    assert_eq(wait(pid, NULL), pid);
+}
+
+int main() {
+    cs.version            = 0;
+    cs.start_ip           = (uint64)rseq_spin_start;
+    cs.post_commit_offset = rseq_spin_end - rseq_spin_start;
+    cs.abort_ip           = (uint64)rseq_spin_abort;
+
+    // bad registrations.
+    struct rseq *area = (struct rseq *)&rs;
+    assert_eq(rseq((struct rseq *)((char *)area + 8), sizeof(struct rseq), 0, RSEQ_SIG), -EINVAL);
+    assert_eq(rseq(area, sizeof(struct rseq) - 1, 0, RSEQ_SIG), -EINVAL);
+    assert_eq(rseq(area, sizeof(struct rseq), 2, RSEQ_SIG), -EINVAL);
+    assert_eq(rseq(area, sizeof(struct rseq), RSEQ_FLAG_UNREGISTER, RSEQ_SIG), -EINVAL);
+
+    // the cpu id is filled in on our way back from the registration.
+    rs.cpu_id = 1000;
+    assert_eq(rseq(area, sizeof(struct rseq), 0, RSEQ_SIG), 0);
+    assert(rs.cpu_id != 1000 && rs.cpu_id != RSEQ_CPU_ID_UNINITIALIZED);
+    assert_eq(rs.cpu_id_start, rs.cpu_id);
+    assert_eq(rseq(area, sizeof(struct rseq), 0, RSEQ_SIG), -EBUSY);
+    assert_eq(rseq(area, sizeof(struct rseq), 0, RSEQ_SIG + 1), -EINVAL);
+    printf("rseqtest: registration passed\n");
+
+    // and kept up to date when we move.
+    int cpu = rs.cpu_id;
+    for (int i = 0; i < 64; i++) {
+        if (sched_setaffinity(0, 1ull << i) == 0)
+            assert_eq(rs.cpu_id, i);
+    }
+    pin(cpu);
+    printf("rseqtest: cpu id passed\n");
+
+    // preempted in the critical section, we resume at the abort handler, and rseq_cs is cleared.
+    int spinner = spawn_spinner(cpu);
+    for (int i = 0; i < 3; i++) {
+        assert_eq(rseq_spin(&rs, &cs), 1);
+        assert_eq(rs.rseq_cs, 0);
+    }
+    printf("rseqtest: abort passed\n");
+
+    // a forked child inherits the registration, and our cpu. Registered with another
+    // signature, it is killed when aborted.
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        assert_eq(rseq(area, sizeof(struct rseq), RSEQ_FLAG_UNREGISTER, RSEQ_SIG), 0);
+        assert_eq(rs.cpu_id, RSEQ_CPU_ID_UNINITIALIZED);
+        assert_eq(rseq(area, sizeof(struct rseq), 0, RSEQ_SIG + 1), 0);
+        rseq_spin(&rs, &cs);
+        exit(0);
+    }
+    int xstatus;
+    assert_eq(wait(pid, &xstatus), pid);
+    assert_eq(xstatus, -2);
+    kill_spinner(spinner);
+    printf("rseqtest: bad signature passed\n");
+
+    printf("rseqtest passed\n");
+    return 0;
+}
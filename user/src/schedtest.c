@@ -0,0 +1,439 @@
+#include "../../os/riscv.h"
+#include "../../os/timer.h"
+#include "../lib/user.h"
+
+// Scheduler tests. Most of them pin the processes they compare on one cpu.
+
+#define TEST_CPU 0
+
+static uint64 now_us() {
+    struct timespec ts;
+    assert_eq(clock_gettime(CLOCK_MONOTONIC, &ts), 0);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64 max_gap_us;  // of the last spin_us()
+
+/**
+ * Busy loop until we have run for @us microseconds.
+ * Returns how many times we have been switched out for more than @gap_us meanwhile.
+ */
+static int spin_us(uint64 us, uint64 gap_us) {
+    uint64 ran = 0, last = now_us();
+    int gaps   = 0;
+    max_gap_us = 0;
+    while (ran < us) {
+        uint64 t = now_us();
+        if (t - last > gap_us)
+            gaps++;
+        else
+            ran += t - last;
+        if (t - last > max_gap_us)
+            max_gap_us = t - last;
+        last = t;
+    }
+    return gaps;
+}
+
+static void pin(int cpu) {
+    assert_eq(sched_setaffinity(0, 1ull << cpu), 0);
+}
+
+// an online cpu other than TEST_CPU.
+static int other_cpu() {
+    for (int cpu = 0; cpu < 64; cpu++) {
+        if (cpu != TEST_CPU && sched_setaffinity(0, 1ull << cpu) == 0)
+            return cpu;
+    }
+    printf("schedtest: needs two cpus\n");
+    exit(1);
+}
+
+#define START_TICKS (10)
+
+// fork a child which takes @policy and @priority, and runs @f after START_TICKS.
+static int spawn(int policy, int priority, int (*f)()) {
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        assert_eq(sched_setscheduler(0, policy, priority), 0);
+        sleep(START_TICKS);
+        exit(f());
+    }
+    return pid;
+}
+
+// Hold the cpu until the children we have just spawned are all waiting to start,
+//  so that they are queued in the order of their class. We stay above them.
+static void start_children() {
+    sleep(2);
+    assert_eq(sched_setscheduler(0, SCHED_FIFO, RT_PRIO_MAX), 0);
+    spin_us(START_TICKS * 1000000 / 100 + 100000, 1000000);
+}
+
+static int spin_5ms() {
+    spin_us(5000, 1000000);
+    return 0;
+}
+
+static int spin_forever() {
+    for (;;);
+    return 0;
+}
+
+static int spin_5ms_late() {
+    sleep(START_TICKS);
+    return spin_5ms();
+}
+
+// real-time processes queued on a cpu run by priority, and a SCHED_FIFO one runs to completion.
+void fifo_order(char *s) {
+    enum { N = 4 };
+    int prio[N] = {10, 30, 20, 40};
+    int pids[N], xstatus;
+
+    pin(TEST_CPU);
+    for (int i = 0; i < N; i++) pids[i] = spawn(SCHED_FIFO, prio[i], spin_5ms);
+    // above our children: we see each of them exit at once.
+    start_children();
+
+    int expected[N] = {pids[3], pids[1], pids[2], pids[0]};
+    for (int i = 0; i < N; i++) {
+        int pid = wait(-1, &xstatus);
+        if (pid != expected[i]) {
+            printf("%s: exit %d is pid %d, expected %d\n", s, i, pid, expected[i]);
+            exit(1);
+        }
+    }
+}
+
+static int spin_rr() {
+    // about 4 timeslices each: we must be switched out in between.
+    return spin_us(400000, 5000) > 0 ? 0 : 1;
+}
+
+// SCHED_RR processes of the same priority take turns.
+void rr_turns(char *s) {
+    int pids[2], xstatus;
+
+    pin(TEST_CPU);
+    for (int i = 0; i < 2; i++) pids[i] = spawn(SCHED_RR, 10, spin_rr);
+    start_children();
+    for (int i = 0; i < 2; i++) {
+        assert_eq(wait(pids[i], &xstatus), pids[i]);
+        assert_eq(xstatus, 0);
+    }
+}
+
+// a runaway real-time process leaves some time to the normal processes of its cpu.
+void rt_throttle(char *s) {
+    struct cpu_sched_stat st;
+    int xstatus;
+
+    assert_eq(schedstat(TEST_CPU, &st), 0);
+    uint64 throttled = st.rt_throttled;
+
+    // we watch from another cpu. The normal child starts once the runaway one runs.
+    int cpu = other_cpu();
+    pin(TEST_CPU);
+    int runaway = spawn(SCHED_FIFO, 10, spin_forever);
+    int normal  = spawn(SCHED_NORMAL, 0, spin_5ms_late);
+    pin(cpu);
+
+    assert_eq(wait(normal, &xstatus), normal);
+    assert_eq(xstatus, 0);
+    kill(runaway);
+    assert_eq(wait(runaway, &xstatus), runaway);
+
+    assert_eq(schedstat(TEST_CPU, &st), 0);
+    assert(st.rt_throttled > throttled);
+}
+
+// a running process changing its own class is requeued in the new one before returning to user.
+void setscheduler_self(char *s) {
+    int xstatus;
+
+    pin(TEST_CPU);
+    int normal = spawn(SCHED_NORMAL, 0, spin_5ms);
+    sleep(2);
+    // once we are real-time, the normal child can't preempt us when it wakes up.
+    assert_eq(sched_setscheduler(0, SCHED_FIFO, 10), 0);
+    assert_eq(spin_us(START_TICKS * 1000000 / 100 + 100000, 5000), 0);
+    assert_eq(wait(normal, &xstatus), normal);
+    assert_eq(xstatus, 0);
+
+    assert_eq(sched_setscheduler(0, SCHED_NORMAL, 1), -EINVAL);
+    assert_eq(sched_setscheduler(0, SCHED_FIFO, RT_PRIO_MAX + 1), -EINVAL);
+    assert_eq(sched_setscheduler(0, 3, 10), -EINVAL);
+}
+
+static int spin_report_gap() {
+    spin_us(300000, 1000);
+    return max_gap_us / 1000;
+}
+
+// a long syscall gives up the cpu when its timeslice is over, not only on its way back to user.
+void kernel_preempt(char *s) {
+    enum { NPAGES = 4096, ROUNDS = 8 };
+    struct cpu_sched_stat st0, st1;
+    uint64 longest = 0;
+    int xstatus;
+
+    pin(TEST_CPU);
+    assert_eq(schedstat(TEST_CPU, &st0), 0);
+    int pid = spawn(SCHED_NORMAL, 0, spin_report_gap);
+    sleep(START_TICKS);
+
+    // sbrk maps and fills the pages in one loop, see mm_remap().
+    for (int i = 0; i < ROUNDS; i++) {
+        uint64 t = now_us();
+        assert(sbrk(NPAGES * PGSIZE) != (void *)-1);
+        t       = now_us() - t;
+        longest = t > longest ? t : longest;
+        assert(sbrk(-NPAGES * PGSIZE) != (void *)-1);
+    }
+    assert_eq(wait(pid, &xstatus), pid);
+    assert_eq(schedstat(TEST_CPU, &st1), 0);
+    printf("%s: longest sbrk %dms, longest wait of the other process %dms, max latency %dus\n", s,
+           (int)(longest / 1000), xstatus, (int)(st1.max_latency * 1000000 / CPU_FREQ));
+
+    // timeslices are 10ms here, a tick may come 10ms late.
+    assert(xstatus < 50);
+    assert(st1.max_latency < CPU_FREQ / 10);
+    if (longest > 50000)
+        assert(st1.preemptions > st0.preemptions);
+}
+
+// sum of the cross-cpu counters of all cpus.
+static uint64 moves() {
+    struct cpu_sched_stat st;
+    uint64 n = 0;
+    for (int cpu = 0; schedstat(cpu, &st) == 0; cpu++) n += st.steals + st.balanced + st.migrations;
+    return n;
+}
+
+static int nr_cpus() {
+    int n = 0;
+    for (int cpu = 0; cpu < 64; cpu++) n += sched_setaffinity(0, 1ull << cpu) == 0;
+    assert_eq(sched_setaffinity(0, ~0ull), 0);
+    return n;
+}
+
+// each cpu queues its own processes, and an idle cpu takes some from a busy one.
+void percpu_queues(char *s) {
+    enum { N = 4 };
+    struct cpu_sched_stat st0, st1;
+    int pids[N], xstatus;
+
+    assert_eq(schedstat(-1, &st0), -EINVAL);
+    assert_eq(schedstat(64, &st0), -EINVAL);
+
+    int ncpus = nr_cpus();
+    pin(TEST_CPU);
+    assert_eq(schedstat(TEST_CPU, &st0), 0);
+    for (int i = 0; i < N; i++) pids[i] = spawn(SCHED_NORMAL, 0, spin_forever);
+    sleep(START_TICKS + 5);
+
+    // we are running, they are all queued.
+    assert_eq(schedstat(TEST_CPU, &st1), 0);
+    printf("%s: %d cpus, %d queued, load %d\n", s, ncpus, (int)st1.nr_running, (int)st1.load);
+    assert(st1.nr_running >= N);
+    assert(st1.load > 0);
+    assert(st1.nr_switches > st0.nr_switches);
+    assert(st1.min_vruntime >= st0.min_vruntime);
+
+    // let them go anywhere: idle cpus steal them, and the balancer evens out the rest.
+    uint64 n = moves();
+    for (int i = 0; i < N; i++) assert_eq(sched_setaffinity(pids[i], ~0ull), 0);
+    sleep(30);
+    assert_eq(schedstat(TEST_CPU, &st1), 0);
+    if (ncpus > 1) {
+        assert(moves() > n);
+        assert(st1.nr_running < N);
+    }
+
+    for (int i = 0; i < N; i++) {
+        kill(pids[i]);
+        assert_eq(wait(pids[i], &xstatus), pids[i]);
+    }
+}
+
+static uint64 deadline_us;
+
+// Busy loop until deadline_us, returns for how many ms we have run meanwhile.
+static int spin_until_deadline() {
+    uint64 ran = 0, last = now_us();
+    while (last < deadline_us) {
+        uint64 t = now_us();
+        if (t - last <= 1000)
+            ran += t - last;
+        last = t;
+    }
+    return ran / 1000;
+}
+
+// normal processes sharing a cpu get time in proportion to the weights of their nice values.
+void nice_weight(char *s) {
+    int pids[2], ran[2];
+
+    assert_eq(setpriority(0, NICE_MAX + 1), -EINVAL);
+    assert_eq(setpriority(0, NICE_MIN - 1), -EINVAL);
+    assert_eq(setpriority(-1, 0), -EINVAL);
+
+    pin(TEST_CPU);
+    // they compete for 600ms once started.
+    deadline_us = now_us() + START_TICKS * 1000000 / 100 + 600000;
+    for (int i = 0; i < 2; i++) pids[i] = spawn(SCHED_NORMAL, 0, spin_until_deadline);
+    // nice 5 weighs a third of nice 0. It is taken at once, the child is sleeping.
+    assert_eq(setpriority(pids[1], 5), 0);
+    for (int i = 0; i < 2; i++) assert_eq(wait(pids[i], &ran[i]), pids[i]);
+
+    printf("%s: nice 0 ran %dms, nice 5 ran %dms\n", s, ran[0], ran[1]);
+    assert(ran[1] > 0);
+    assert(ran[0] > 2 * ran[1]);
+}
+
+static int sleep_often() {
+    for (int i = 0; i < 50; i++) sleep(1);
+    return 0;
+}
+
+// a process which blocks, or is preempted, switches straight to the next one queued on its cpu.
+void direct_switch(char *s) {
+    struct cpu_sched_stat st0, st1;
+    int xstatus;
+
+    pin(TEST_CPU);
+    assert_eq(schedstat(TEST_CPU, &st0), 0);
+    int spinner = spawn(SCHED_NORMAL, 0, spin_forever);
+    int sleeper = spawn(SCHED_NORMAL, 0, sleep_often);
+    assert_eq(wait(sleeper, &xstatus), sleeper);
+    assert_eq(xstatus, 0);
+    kill(spinner);
+    assert_eq(wait(spinner, &xstatus), spinner);
+    assert_eq(schedstat(TEST_CPU, &st1), 0);
+
+    uint64 direct = st1.direct_switches - st0.direct_switches;
+    printf("%s: %d switches, %d direct\n", s, (int)(st1.nr_switches - st0.nr_switches), (int)direct);
+    // each sleep switches to the spinner, unless its lock happens to be busy.
+    assert(direct >= 40);
+    assert(st1.nr_switches - st0.nr_switches >= direct);
+}
+
+static int yield_and_move() {
+    for (int i = 0; i < 500; i++) {
+        // cpus 0 to 3 in turn, or anywhere if one is offline.
+        if (i % 50 == 0 && sched_setaffinity(0, 1ull << (i / 50 % 4)) != 0) {
+            assert_eq(sched_setaffinity(0, ~0ull), 0);
+        }
+        if (i % 10 == 0)
+            sleep(1);
+        else
+            yield();
+    }
+    return 0;
+}
+
+// processes switching to each other while others move between cpus: the locks handed over
+//  by direct switches are always released.
+void switch_stress(char *s) {
+    enum { N = 8 };
+    int pids[N], xstatus;
+
+    for (int i = 0; i < N; i++) pids[i] = spawn(SCHED_NORMAL, 0, yield_and_move);
+    for (int i = 0; i < N; i++) {
+        assert_eq(wait(pids[i], &xstatus), pids[i]);
+        assert_eq(xstatus, 0);
+    }
+}
+
+#define RSEQ_SIG 0x53053053
+
+static volatile struct rseq rs;  // tells us our cpu
+
+// a process follows its mask to another cpu, running or not, and bad masks are refused.
+void affinity(char *s) {
+    int cpus[64], n = 0, xstatus;
+    uint64 online = 0;
+
+    for (int cpu = 0; cpu < 64; cpu++) {
+        if (sched_setaffinity(0, 1ull << cpu) == 0) {
+            cpus[n++] = cpu;
+            online |= 1ull << cpu;
+        }
+    }
+    assert_eq(sched_setaffinity(0, 0), -EINVAL);
+    if (~online)
+        assert_eq(sched_setaffinity(0, ~online), -EINVAL);
+    assert_eq(sched_setaffinity(-1, online), -EINVAL);
+    assert_eq(sched_setaffinity(0, online), 0);
+
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        assert_eq(rseq((struct rseq *)&rs, sizeof(struct rseq), 0, RSEQ_SIG), 0);
+        // spin on each cpu in turn, as the parent moves us.
+        for (int i = 0; i < n; i++) {
+            uint64 t = now_us();
+            while (rs.cpu_id != cpus[i]) {
+                if (now_us() - t > 1000000) {
+                    printf("%s: still on cpu %d, not %d\n", s, rs.cpu_id, cpus[i]);
+                    exit(1);
+                }
+            }
+        }
+        // moved while sleeping, we wake up on the new cpu.
+        sleep(20);
+        exit(rs.cpu_id == cpus[0] ? 0 : 1);
+    }
+    for (int i = 0; i < n; i++) {
+        assert_eq(sched_setaffinity(pid, 1ull << cpus[i]), 0);
+        sleep(10);
+    }
+    assert_eq(sched_setaffinity(pid, 1ull << cpus[0]), 0);
+    assert_eq(wait(pid, &xstatus), pid);
+    assert_eq(xstatus, 0);
+}
+
+struct test {
+    void (*f)(char *);
+    char *s;
+} schedtests[] = {
+    {fifo_order,        "fifo_order"       },
+    {rr_turns,          "rr_turns"         },
+    {rt_throttle,       "rt_throttle"      },
+    {setscheduler_self, "setscheduler_self"},
+    {kernel_preempt,    "kernel_preempt"   },
+    {percpu_queues,     "percpu_queues"    },
+    {nice_weight,       "nice_weight"      },
+    {direct_switch,     "direct_switch"    },
+    {switch_stress,     "switch_stress"    },
+    {affinity,          "affinity"         },
+    {NULL,              NULL               },
+};
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+
+    for (struct test *t = schedtests; t->s; t++) {
+        if (argc > 1 && strcmp(argv[1], t->s) != 0)
+            continue;
+        printf("test %s: ", t->s);
+        int pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            t->f(t->s);
+            exit(0);
+        }
+        int xstatus;
+        wait(pid, &xstatus);
+        printf(xstatus == 0 ? "OK\n" : "FAILED\n");
+        failed |= xstatus != 0;
+    }
+    if (failed) {
+        printf("SOME TESTS FAILED\n");
+        return 1;
+    }
+    printf("schedtest passed\n");
+    return 0;
+}
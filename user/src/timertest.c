@@ -0,0 +1,238 @@
+#include "../lib/user.h"
+
+// Timer tests: sleeps of every length, and the timers behind them.
+
+static uint64 now_us() {
+    struct timespec ts;
+    assert_eq(clock_gettime(CLOCK_MONOTONIC, &ts), 0);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int nanosleep_us(uint64 us) {
+    struct timespec ts = {us / 1000000, us % 1000000 * 1000};
+    return nanosleep(&ts, NULL);
+}
+
+// nanosleep() never returns early, and not much later than its timer slack.
+void nanosleep_basic(char *s) {
+    uint64 lengths[] = {100, 1000, 15000, 120000};
+    struct timespec ts;
+
+    for (int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        uint64 t = now_us();
+        assert_eq(nanosleep_us(lengths[i]), 0);
+        t = now_us() - t;
+        if (t < lengths[i] || t > lengths[i] + TIMER_SLACK_DEFAULT_NS / 1000 + 20000) {
+            printf("%s: slept %dus for %dus\n", s, (int)t, (int)lengths[i]);
+            exit(1);
+        }
+    }
+
+    ts.tv_sec  = 0;
+    ts.tv_nsec = NSEC_PER_SEC;
+    assert_eq(nanosleep(&ts, NULL), -EINVAL);
+    ts.tv_sec  = -1;
+    ts.tv_nsec = 0;
+    assert_eq(nanosleep(&ts, NULL), -EINVAL);
+}
+
+// a sleep too long for the clock doesn't wrap around to an expiry in the past.
+void nanosleep_huge(char *s) {
+    int64 secs[] = {0x7fffffffffffffffll, 0x7fffffffffffffffll / 12500000, 1ll << 40};
+    int xstatus;
+
+    for (int i = 0; i < sizeof(secs) / sizeof(secs[0]); i++) {
+        int pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            struct timespec ts = {secs[i], NSEC_PER_SEC - 1};
+            nanosleep(&ts, NULL);
+            exit(1);  // woken up before we are killed
+        }
+        sleep(5);
+        kill(pid);
+        assert_eq(wait(pid, &xstatus), pid);
+        assert_eq(xstatus, -1);
+    }
+}
+
+// the timer slack is per process, and any slack lets a sleep end.
+void timer_slack_basic(char *s) {
+    assert_eq(timer_slack(-1), TIMER_SLACK_DEFAULT_NS);
+    assert_eq(timer_slack(1000000), TIMER_SLACK_DEFAULT_NS);
+    assert_eq(timer_slack(-1), 1000000);
+
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        // inherited, and changed for us only.
+        assert_eq(timer_slack(0x7fffffffffffffffll), 1000000);
+        uint64 t = now_us();
+        assert_eq(nanosleep_us(10000), 0);
+        exit(now_us() - t >= 10000 ? 0 : 1);
+    }
+    int xstatus;
+    assert_eq(wait(pid, &xstatus), pid);
+    assert_eq(xstatus, 0);
+    assert_eq(timer_slack(-1), 1000000);
+}
+
+// timer interrupts taken by @cpu while we sleep @n ticks.
+static uint64 timer_irqs_during(int cpu, int n) {
+    struct cpu_sched_stat st0, st1;
+    assert_eq(schedstat(cpu, &st0), 0);
+    sleep(n);
+    assert_eq(schedstat(cpu, &st1), 0);
+    return st1.timer_irqs - st0.timer_irqs;
+}
+
+static int spawn_spinner(int cpu) {
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        assert_eq(sched_setaffinity(0, 1ull << cpu), 0);
+        for (;;);
+    }
+    return pid;
+}
+
+// a hart takes a tick only when it has a process to preempt: not when idle, nor running a single one.
+void tickless(char *s) {
+    enum { N = 100 };  // ticks, the longest a stopped tick waits
+    int cpu = 1, pids[2];
+
+    // we watch from cpu 0.
+    while (cpu < 64 && sched_setaffinity(0, 1ull << cpu) != 0) cpu++;
+    if (cpu == 64)
+        return;
+    assert_eq(sched_setaffinity(0, 1), 0);
+
+    uint64 idle = timer_irqs_during(cpu, N);
+    pids[0]     = spawn_spinner(cpu);
+    sleep(5);
+    uint64 single = timer_irqs_during(cpu, N);
+    pids[1]       = spawn_spinner(cpu);
+    sleep(5);
+    uint64 busy = timer_irqs_during(cpu, N);
+    for (int i = 0; i < 2; i++) {
+        kill(pids[i]);
+        assert_eq(wait(pids[i], NULL), pids[i]);
+    }
+
+    printf("%s: timer interrupts in %d ticks: idle %d, one process %d, two processes %d\n", s, N, (int)idle, (int)single,
+           (int)busy);
+    assert(idle < N / 4);
+    assert(single < N / 4);
+    assert(busy > N / 2);
+}
+
+// sleep(@n) and exit with 0 if it took n ticks, give or take one.
+static int spawn_sleeper(int n) {
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        uint64 t = now_us();
+        if (sleep(n) != 0)
+            exit(1);
+        t = now_us() - t;
+        if (t < (n - 1) * 10000ull || t > (n + 1) * 10000ull + 5000) {
+            printf("sleep(%d) took %dus\n", n, (int)t);
+            exit(1);
+        }
+        exit(0);
+    }
+    return pid;
+}
+
+// Sleeps of lengths on both sides of the 64-tick slots of the first level of the wheel.
+//  The longer ones are cascaded down to the first level before they fire.
+static int wheel_lengths[] = {1, 2, 63, 64, 65, 100, 127, 128, 129, 200};
+#define NR_WHEEL_LENGTHS (sizeof(wheel_lengths) / sizeof(wheel_lengths[0]))
+
+// concurrent sleeps on the wheel of one hart all fire on time.
+void wheel_cascade(char *s) {
+    int pids[NR_WHEEL_LENGTHS], xstatus;
+
+    // the timer stays on the wheel of the hart we sleep on: put them all on one.
+    assert_eq(sched_setaffinity(0, 1), 0);
+    for (int i = 0; i < NR_WHEEL_LENGTHS; i++) pids[i] = spawn_sleeper(wheel_lengths[i]);
+    for (int i = 0; i < NR_WHEEL_LENGTHS; i++) {
+        assert_eq(wait(pids[i], &xstatus), pids[i]);
+        assert_eq(xstatus, 0);
+    }
+}
+
+// killed sleepers take their timers off the wheel, whatever their level,
+//  and the timers sharing their slots still fire on time.
+void wheel_del(char *s) {
+    int lengths[] = {65, 130, 5000, 300000};
+    int sleepers[NR_WHEEL_LENGTHS], killed[sizeof(lengths) / sizeof(lengths[0])][2], xstatus;
+
+    assert_eq(sched_setaffinity(0, 1), 0);
+    for (int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        killed[i][0] = spawn_sleeper(lengths[i]);
+        killed[i][1] = spawn_sleeper(lengths[i]);
+    }
+    for (int i = 0; i < NR_WHEEL_LENGTHS; i++) sleepers[i] = spawn_sleeper(wheel_lengths[i]);
+    sleep(2);
+    // every other one of each pair, so we unlink both heads and tails of the slots.
+    for (int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        kill(killed[i][i % 2]);
+        assert_eq(wait(killed[i][i % 2], &xstatus), killed[i][i % 2]);
+        assert_eq(xstatus, -1);
+    }
+    for (int i = 0; i < NR_WHEEL_LENGTHS; i++) {
+        assert_eq(wait(sleepers[i], &xstatus), sleepers[i]);
+        assert_eq(xstatus, 0);
+    }
+    for (int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        int pid = killed[i][1 - i % 2];
+        if (lengths[i] <= 130) {
+            assert_eq(wait(pid, &xstatus), pid);
+            assert_eq(xstatus, 0);
+        } else {
+            kill(pid);
+            assert_eq(wait(pid, &xstatus), pid);
+            assert_eq(xstatus, -1);
+        }
+    }
+}
+
+struct test {
+    void (*f)(char *);
+    char *s;
+} timertests[] = {
+    {nanosleep_basic,   "nanosleep_basic"  },
+    {nanosleep_huge,    "nanosleep_huge"   },
+    {timer_slack_basic, "timer_slack_basic"},
+    {tickless,          "tickless"         },
+    {wheel_cascade,     "wheel_cascade"    },
+    {wheel_del,         "wheel_del"        },
+    {NULL,              NULL               },
+};
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+
+    for (struct test *t = timertests; t->s; t++) {
+        if (argc > 1 && strcmp(argv[1], t->s) != 0)
+            continue;
+        printf("test %s: ", t->s);
+        int pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            t->f(t->s);
+            exit(0);
+        }
+        int xstatus;
+        wait(pid, &xstatus);
+        printf(xstatus == 0 ? "OK\n" : "FAILED\n");
+        failed |= xstatus != 0;
+    }
+    if (failed) {
+        printf("SOME TESTS FAILED\n");
+        return 1;
+    }
+    printf("timertest passed\n");
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include "../../os/riscv.h"
+#include "../lib/user.h"
+
+// Working-set test: pages we keep touching are young, pages we left are old,
+// and pages merged by KSM don't get the age of their other sharers.
+
+#define NPAGES  64
+#define NHOT    8
+#define PERIOD  2  // ticks
+#define ROUNDS  20 // periods
+
+static char *buf;
+
+static void getstat(int pid, struct wss_stat *st) {
+    st->pid = pid;
+    assert_eq(wssctl(WSS_CMD_GET_PROC, (uint64)st), 0);
+}
+
+// read the first @n pages of buf for ROUNDS periods.
+static int touch(int n) {
+    int sum = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < n; i++) sum += ((volatile char *)buf)[i * PGSIZE];
+        sleep(PERIOD);
+    }
+    return sum;
+}
+
+static void hot_and_cold() {
+    struct wss_stat st;
+
+    for (int i = 0; i < NPAGES * PGSIZE; i++) buf[i] = i % 251;
+    touch(NHOT);
+    getstat(getpid(), &st);
+    printf("wsstest: rss %d, wss %d %d %d %d %d %d %d %d\n", (int)st.rss, (int)st.wss[0], (int)st.wss[1], (int)st.wss[2],
+           (int)st.wss[3], (int)st.wss[4], (int)st.wss[5], (int)st.wss[6], (int)st.wss[7]);
+
+    assert(st.nr_samples > ROUNDS / 2);
+    assert_eq(st.wss[WSS_NR_BUCKETS - 1], st.rss);
+    assert(st.rss >= NPAGES);
+    assert(st.wss[1] >= NHOT);
+    // the cold pages have been idle for more than 3 periods.
+    assert(st.wss[2] + NPAGES - NHOT <= st.rss);
+}
+
+static void ksm_sharers() {
+    struct ksm_stat ks;
+    struct wss_stat st;
+
+    // the same contents in the child and in us, so KSM merges them.
+    for (int i = 0; i < NPAGES * PGSIZE; i++) buf[i] = (i / PGSIZE) * 7 + 1;
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        // never touched again.
+        for (;;) sleep(100);
+    }
+
+    assert_eq(ksmctl(KSM_CMD_SET_PAGES_TO_SCAN, 1024), 0);
+    assert_eq(ksmctl(KSM_CMD_SET_RUN, 1), 0);
+    for (int t = 0; t < 100; t++) {
+        assert_eq(ksmctl(KSM_CMD_GET_STAT, (uint64)&ks), 0);
+        if (ks.pages_sharing >= 2 * NPAGES)
+            break;
+        sleep(2);
+    }
+    assert(ks.pages_sharing >= 2 * NPAGES);
+
+    // we keep reading the merged pages: the child must not see them young,
+    //  nor count them at all while they are shared.
+    touch(NPAGES);
+    getstat(pid, &st);
+    printf("wsstest: child rss %d, young %d\n", (int)st.rss, (int)st.wss[2]);
+    assert(st.nr_samples > 0);
+    assert(st.rss < NPAGES);
+    assert(st.wss[2] < NPAGES / 2);
+
+    assert_eq(ksmctl(KSM_CMD_SET_RUN, 0), 0);
+    kill(pid);
+    assert_eq(wait(pid, NULL), pid);
+    assert_eq(wssctl(WSS_CMD_GET_PROC, (uint64)&st), -EINVAL);
+}
+
+int main() {
+    buf = sbrk(NPAGES * PGSIZE);
+    assert(buf != (char *)-1);
+    assert_eq(wssctl(WSS_CMD_SET_PERIOD, PERIOD), 0);
+
+    hot_and_cold();
+    ksm_sharers();
+
+    assert_eq(wssctl(WSS_CMD_SET_PERIOD, 0), 0);
+    assert_eq(wssctl(42, 0), -EINVAL);
+    printf("wsstest passed\n");
+    return 0;
+}